@@ -0,0 +1,26 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+/*
+ * Helpers shared by the microbenchmarks.  Inputs come from a fixed-seed
+ * generator so numbers can be compared between commits, and heap use of the
+ * agent code is counted through the linker's --wrap of malloc and friends.
+ */
+
+/* allocations made by the code under test since start-up */
+extern unsigned long benchAllocs;
+
+double benchNowNs(void);
+void benchSeed(unsigned int seed);
+unsigned int benchRand(void);
+
+/* fills buff with printable lines of 8 to 120 bytes ending in CR LF or LF */
+size_t benchLines(char *buff, size_t size, int *lineCount);
+
+void benchHeader(void);
+void benchReport(const char *name, double ns, double bytes, double ops,
+    unsigned long allocs);
+
+#endif  /* BENCH_H */
@@ -0,0 +1,127 @@
+/*
+ * Line assembly: sioTtyRead() draining a pipe or a raw pty into the receive
+ * ring and sioTtyNextLine() splitting it, the path every serial byte takes.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "sio_agent.h"
+#include "bench.h"
+
+#define INPUT_SIZE (256 * 1024)
+#define CHUNK 4096
+#define PASSES 20
+
+static char input[INPUT_SIZE];
+
+static struct SioPort port;
+
+static void benchAssemble(const char *name, int readFd, int writeFd,
+    size_t inputLen, int expectLines)
+{
+    struct SioTtyRing *ring = &port.ring;
+    char line[SIO_BUFFER_SIZE];
+    double elapsed = 0;
+    unsigned long allocs = 0;
+    int lines = 0;
+    int pass;
+
+    port.serialEv.fd = readFd;
+    sioSetNonBlocking(readFd);
+    for (pass = 0 ; pass < PASSES ; pass++) {
+        const int passEnd = lines + expectLines;
+        size_t off = 0;
+
+        sioTtyRingReset(ring);
+        while ((off < inputLen) || (lines < passEnd)) {
+            struct pollfd pfd = { readFd, POLLIN, 0 };
+            unsigned long allocsBefore;
+            double start;
+            int cnt;
+
+            if (off < inputLen) {
+                const size_t len = (inputLen - off < CHUNK) ?
+                    inputLen - off : CHUNK;
+                const ssize_t written = write(writeFd, input + off, len);
+
+                if (written <= 0) {
+                    perror("write");
+                    exit(1);
+                }
+                off += written;
+            }
+
+            /* a pty hands the bytes over asynchronously */
+            if (poll(&pfd, 1, 1000) != 1) {
+                break;
+            }
+
+            /* time only the agent side */
+            allocsBefore = benchAllocs;
+            start = benchNowNs();
+            while ((cnt = sioTtyRead(&port)) > 0) {
+                while (sioTtyNextLine(ring, line, sizeof(line)) > 0) {
+                    lines++;
+                }
+            }
+            if (cnt < 0) {
+                perror("sioTtyRead");
+                exit(1);
+            }
+            elapsed += benchNowNs() - start;
+            allocs += benchAllocs - allocsBefore;
+        }
+    }
+
+    if (lines != expectLines * PASSES) {
+        fprintf(stderr, "%s: got %d lines, expected %d\n", name, lines,
+            expectLines * PASSES);
+        exit(1);
+    }
+    benchReport(name, elapsed, (double)inputLen * PASSES, lines, allocs);
+}
+
+int main(int argc, char *argv[])
+{
+    int lineCount;
+    size_t inputLen;
+    int p[2];
+    int master, slave;
+    struct termios tio;
+
+    benchSeed(1);
+    inputLen = benchLines(input, sizeof(input), &lineCount);
+    sioTtySetParams(&port, 0, SIO_DEFAULT_SERIAL_RATE, 0);
+
+    benchHeader();
+
+    if (pipe(p) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    benchAssemble("line assembly (pipe)", p[0], p[1], inputLen, lineCount);
+    close(p[0]);
+    close(p[1]);
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0)) {
+        perror("posix_openpt");
+        return 1;
+    }
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    tcsetattr(master, TCSANOW, &tio);
+    benchAssemble("line assembly (pty)", master, slave, inputLen, lineCount);
+    close(slave);
+    close(master);
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Log formatting: the cost LogMsg() adds to the data path when the message
+ * is filtered out and when it is formatted into the log ring.  The writer
+ * thread drains to /dev/null.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "sio_agent.h"
+#include "bench.h"
+
+#define MESSAGES 200000
+
+static char lines[64][128];
+
+int main(int argc, char *argv[])
+{
+    unsigned long allocs;
+    double start, elapsed;
+    size_t bytes = 0;
+    int i;
+
+    benchSeed(2);
+    for (i = 0 ; i < 64 ; i++) {
+        const size_t len = 8 + benchRand() % 100;
+        size_t j;
+
+        for (j = 0 ; j < len ; j++) {
+            lines[i][j] = ' ' + 1 + benchRand() % 94;
+        }
+        lines[i][len] = '\n';
+        lines[i][len + 1] = '\0';
+    }
+    for (i = 0 ; i < MESSAGES ; i++) {
+        bytes += strlen(lines[i & 63]);
+    }
+
+    LogOpen("bench", 0, "/dev/null", 0);
+
+    benchHeader();
+
+    allocs = benchAllocs;
+    start = benchNowNs();
+    for (i = 0 ; i < MESSAGES ; i++) {
+        LogMsg(LOG_INFO, "[SIO] received => \"%s\"\n", lines[i & 63]);
+    }
+    elapsed = benchNowNs() - start;
+    benchReport("LogMsg filtered out", elapsed, bytes, MESSAGES,
+        benchAllocs - allocs);
+
+    LogSetLevel(LOG_DEBUG);
+    allocs = benchAllocs;
+    start = benchNowNs();
+    for (i = 0 ; i < MESSAGES ; i++) {
+        LogMsg(LOG_INFO, "[SIO] received => \"%s\"\n", lines[i & 63]);
+    }
+    elapsed = benchNowNs() - start;
+    benchReport("LogMsg formatted", elapsed, bytes, MESSAGES,
+        benchAllocs - allocs);
+
+    LogClose();
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * Shared-memory rings of sio_shm_ring.c against a Unix socketpair, between
+ * two threads the way the agent and a client on the same board talk.  The
+ * stream case sends lines one at a time to a consumer that takes whatever
+ * has arrived; the ping-pong case sends one line and waits for it to come
+ * back.  Wakeups counts how often a side had to be woken through its
+ * eventfd; while the consumer keeps up the producer never writes it.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "sio_shm.h"
+#include "bench.h"
+
+#define LINE "0123456789abcdef0123456789abcdef0123456789abcdef012345678901\r\n"
+#define LINE_LEN (sizeof(LINE) - 1)
+#define STREAM_LINES 1000000
+#define PINGS 100000
+#define RING_SIZE (64 * 1024)
+
+static struct SioShmHeader *header;
+static int agentFd;                 /* eventfd of the "agent" thread */
+static int clientFd;                /* eventfd of the "client" thread */
+static int sockets[2];
+static unsigned long wakeups;
+
+static void setupRings(void)
+{
+    const size_t headerSize = (sizeof(*header) + SIO_SHM_CACHELINE - 1) &
+        ~(size_t)(SIO_SHM_CACHELINE - 1);
+
+    header = aligned_alloc(SIO_SHM_CACHELINE, headerSize + 2 * RING_SIZE);
+    memset(header, 0, headerSize);
+    header->magic = SIO_SHM_MAGIC;
+    header->headerSize = headerSize;
+    header->ringSize = RING_SIZE;
+    agentFd = eventfd(0, 0);
+    clientFd = eventfd(0, 0);
+}
+
+/* blocks on fd after the ring said it was worth it */
+static void sleepOn(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+        __atomic_fetch_add(&wakeups, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void shmSend(struct SioShmEnd *end, int ownFd, const char *p,
+    size_t len)
+{
+    while (len > 0) {
+        const size_t n = sioShmPut(end, p, len);
+
+        p += n;
+        len -= n;
+        if ((len > 0) && sioShmWaitSpace(end)) {
+            sleepOn(ownFd);
+        }
+    }
+}
+
+static size_t shmRecv(struct SioShmEnd *end, int ownFd, char *buf,
+    size_t size)
+{
+    size_t n;
+
+    while ((n = sioShmGet(end, buf, size)) == 0) {
+        if (sioShmWaitData(end)) {
+            sleepOn(ownFd);
+        }
+    }
+    return n;
+}
+
+static void *shmStreamConsumer(void *arg)
+{
+    struct SioShmEnd end;
+    char buf[16384];
+    size_t total = 0;
+
+    sioShmEndInit(&end, header, 0, agentFd);
+    while (total < (size_t)STREAM_LINES * LINE_LEN) {
+        total += shmRecv(&end, clientFd, buf, sizeof(buf));
+    }
+    return 0;
+}
+
+static void *sockStreamConsumer(void *arg)
+{
+    char buf[16384];
+    size_t total = 0;
+
+    while (total < (size_t)STREAM_LINES * LINE_LEN) {
+        const ssize_t n = read(sockets[1], buf, sizeof(buf));
+
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        total += n;
+    }
+    return 0;
+}
+
+static void *shmEcho(void *arg)
+{
+    struct SioShmEnd rx, tx;
+    char buf[LINE_LEN];
+    int i;
+
+    sioShmEndInit(&rx, header, 0, agentFd);
+    sioShmEndInit(&tx, header, 1, agentFd);
+    for (i = 0 ; i < PINGS ; i++) {
+        size_t got = 0;
+
+        while (got < LINE_LEN) {
+            got += shmRecv(&rx, clientFd, buf + got, LINE_LEN - got);
+        }
+        shmSend(&tx, clientFd, buf, LINE_LEN);
+    }
+    return 0;
+}
+
+static void *sockEcho(void *arg)
+{
+    char buf[LINE_LEN];
+    int i;
+
+    for (i = 0 ; i < PINGS ; i++) {
+        size_t got = 0;
+
+        while (got < LINE_LEN) {
+            const ssize_t n = read(sockets[1], buf + got, LINE_LEN - got);
+
+            if (n <= 0) {
+                perror("read");
+                exit(1);
+            }
+            got += n;
+        }
+        if (write(sockets[1], buf, LINE_LEN) != LINE_LEN) {
+            perror("write");
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+static void benchStream(int shm)
+{
+    struct SioShmEnd tx;
+    pthread_t thread;
+    double start, elapsed;
+    int i;
+
+    wakeups = 0;
+    sioShmEndInit(&tx, header, 0, clientFd);
+    pthread_create(&thread, 0, shm ? shmStreamConsumer : sockStreamConsumer, 0);
+
+    start = benchNowNs();
+    for (i = 0 ; i < STREAM_LINES ; i++) {
+        if (shm) {
+            shmSend(&tx, agentFd, LINE, LINE_LEN);
+        } else if (write(sockets[0], LINE, LINE_LEN) != LINE_LEN) {
+            perror("write");
+            exit(1);
+        }
+    }
+    pthread_join(thread, 0);
+    elapsed = benchNowNs() - start;
+
+    benchReport(shm ? "stream shm" : "stream socket", elapsed,
+        (double)STREAM_LINES * LINE_LEN, STREAM_LINES, 0);
+    if (shm) {
+        printf("    %lu wakeups for %d lines\n", wakeups, STREAM_LINES);
+    }
+}
+
+static void benchPingPong(int shm)
+{
+    struct SioShmEnd tx, rx;
+    char buf[LINE_LEN];
+    pthread_t thread;
+    double start, elapsed;
+    int i;
+
+    wakeups = 0;
+    sioShmEndInit(&tx, header, 0, clientFd);
+    sioShmEndInit(&rx, header, 1, clientFd);
+    pthread_create(&thread, 0, shm ? shmEcho : sockEcho, 0);
+
+    start = benchNowNs();
+    for (i = 0 ; i < PINGS ; i++) {
+        size_t got = 0;
+
+        if (shm) {
+            shmSend(&tx, agentFd, LINE, LINE_LEN);
+            while (got < LINE_LEN) {
+                got += shmRecv(&rx, agentFd, buf + got, LINE_LEN - got);
+            }
+            continue;
+        }
+        if (write(sockets[0], LINE, LINE_LEN) != LINE_LEN) {
+            perror("write");
+            exit(1);
+        }
+        while (got < LINE_LEN) {
+            const ssize_t n = read(sockets[0], buf + got, LINE_LEN - got);
+
+            if (n <= 0) {
+                perror("read");
+                exit(1);
+            }
+            got += n;
+        }
+    }
+    pthread_join(thread, 0);
+    elapsed = benchNowNs() - start;
+
+    benchReport(shm ? "ping-pong shm" : "ping-pong socket", elapsed,
+        2.0 * PINGS * LINE_LEN, PINGS, 0);
+    if (shm) {
+        printf("    %lu wakeups for %d round trips\n", wakeups, PINGS);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    setupRings();
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    benchHeader();
+    benchStream(0);
+    benchStream(1);
+    benchPingPong(0);
+    benchPingPong(1);
+
+    return 0;
+}
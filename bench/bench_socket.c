@@ -0,0 +1,147 @@
+/*
+ * Socket framing: sioTioSocketRead() taking client chunks off a socketpair
+ * and sioLineAssemble() cutting them into batches of whole lines, and
+ * sioClientBroadcast() queueing serial lines for a client and flushing
+ * them with writev().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sio_agent.h"
+#include "bench.h"
+
+#define INPUT_SIZE (256 * 1024)
+#define PASSES 20
+
+static char input[INPUT_SIZE];
+static struct SioPort port;
+
+static void onClient(struct SioEvent *ev, unsigned int events)
+{
+}
+
+static void benchRead(int agentFd, int clientFd, size_t inputLen)
+{
+    struct SioLineBuf in;
+    double elapsed = 0;
+    unsigned long allocs = 0;
+    unsigned long reads = 0;
+    unsigned long batched = 0;
+    int pass;
+
+    if (sioLineBufInit(&in, SIO_DEFAULT_LINE_MAX, SIO_DEFAULT_BATCH_MAX) < 0) {
+        exit(1);
+    }
+
+    for (pass = 0 ; pass < PASSES ; pass++) {
+        size_t off = 0;
+
+        while (off < inputLen) {
+            const size_t len = (inputLen - off < 1024) ? inputLen - off : 1024;
+            const unsigned long allocsBefore = benchAllocs;
+            double start;
+            int cnt;
+
+            if (write(clientFd, input + off, len) != (ssize_t)len) {
+                perror("write");
+                exit(1);
+            }
+
+            start = benchNowNs();
+            cnt = sioTioSocketRead(agentFd, &in);
+            batched += sioLineAssemble(&in);
+            sioLineBufConsume(&in);
+            elapsed += benchNowNs() - start;
+            allocs += benchAllocs - allocsBefore;
+            if (cnt <= 0) {
+                fprintf(stderr, "sioTioSocketRead failed\n");
+                exit(1);
+            }
+            off += cnt;
+            reads++;
+        }
+    }
+
+    if (batched != inputLen * PASSES) {
+        fprintf(stderr, "socket read: batched %lu bytes, expected %lu\n",
+            batched, (unsigned long)(inputLen * PASSES));
+        exit(1);
+    }
+    benchReport("socket read", elapsed, (double)inputLen * PASSES, reads,
+        allocs);
+    sioLineBufFree(&in);
+}
+
+static void benchBroadcast(int agentFd, int clientFd, size_t inputLen)
+{
+    static char sink[INPUT_SIZE];
+    struct SioClient *client;
+    double elapsed = 0;
+    unsigned long allocs = 0;
+    unsigned long lines = 0;
+    int pass;
+
+    client = sioClientAdd(&port, agentFd, onClient);
+    if (client == 0) {
+        exit(1);
+    }
+
+    for (pass = 0 ; pass < PASSES ; pass++) {
+        size_t off = 0;
+
+        while (off < inputLen) {
+            size_t len = 0;
+            unsigned long allocsBefore;
+            double start;
+
+            while (input[off + len++] != '\n') {
+            }
+
+            allocsBefore = benchAllocs;
+            start = benchNowNs();
+            sioClientBroadcast(&port, input + off, len);
+            elapsed += benchNowNs() - start;
+            allocs += benchAllocs - allocsBefore;
+
+            off += len;
+            lines++;
+
+            /* keep the socket from filling up */
+            if ((lines & 63) == 0) {
+                while (read(clientFd, sink, sizeof(sink)) == sizeof(sink)) {
+                }
+            }
+        }
+    }
+
+    benchReport("socket broadcast", elapsed, (double)inputLen * PASSES,
+        lines, allocs);
+    sioClientCloseAll(&port);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t inputLen;
+    int sv[2];
+
+    benchSeed(3);
+    inputLen = benchLines(input, sizeof(input), 0);
+
+    if ((socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) ||
+        (sioEventInit() < 0)) {
+        perror("socketpair");
+        return 1;
+    }
+    sioSetNonBlocking(sv[0]);
+    sioSetNonBlocking(sv[1]);
+    sioClientSetQueueParams(0, SIO_QUEUE_DROP_OLDEST);
+
+    benchHeader();
+    benchRead(sv[0], sv[1], inputLen);
+    benchBroadcast(sv[0], sv[1], inputLen);
+
+    sioEventClose();
+    return 0;
+}
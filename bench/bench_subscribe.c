@@ -0,0 +1,200 @@
+/*
+ * Subscription matching: sioSubMatch() running one line through the
+ * port's compiled patterns, against testing each pattern in turn with
+ * memmem() the way a client filtering for itself would.  Half of the
+ * patterns are prefixes.  The matcher's cost should stay flat as the
+ * number of patterns grows.  Before timing anything it checks that a
+ * subscribed client still gets the reply to its own request.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sio_agent.h"
+#include "bench.h"
+
+#define INPUT_SIZE (256 * 1024)
+#define PASSES 20
+
+static char input[INPUT_SIZE];
+static struct SioPort port;
+static int peers[SIO_MAX_CLIENTS];  /* hold the answers, unread */
+
+static void onClient(struct SioEvent *ev, unsigned int events)
+{
+}
+
+/* subscribes clients clients to perClient random patterns each */
+static void subscribe(int clients, int perClient)
+{
+    int i;
+    int j;
+
+    for (i = 0 ; i < clients ; i++) {
+        struct SioClient *client;
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        sioSetNonBlocking(sv[0]);
+        peers[i] = sv[1];
+        client = sioClientAdd(&port, sv[0], onClient);
+        if (client == 0) {
+            exit(1);
+        }
+        for (j = 0 ; j < perClient ; j++) {
+            char line[16] = "sio.sub=^";
+            const int prefix = j & 1;
+            const int len = 4 + benchRand() % 4;
+            char *p = line + 8 + prefix;
+            int k;
+
+            for (k = 0 ; k < len ; k++) {
+                *p++ = ' ' + 1 + benchRand() % 94;
+            }
+            sioSubRequest(client, line, p - line);
+        }
+    }
+}
+
+/* what a client's peer has been sent, as a string */
+static const char *received(int peer)
+{
+    static char buff[256];
+    ssize_t n = recv(peer, buff, sizeof(buff) - 1, MSG_DONTWAIT);
+
+    buff[(n > 0) ? n : 0] = '\0';
+    return buff;
+}
+
+/* a reply not matching its patterns reaches the client that asked only */
+static void checkReply(void)
+{
+    struct SioClient *asker;
+    struct SioClient *other;
+    int i;
+
+    subscribe(2, 1);
+    other = port.clients;
+    asker = other->next;
+    for (i = 0 ; i < 2 ; i++) {
+        received(peers[i]);     /* the sio.sub=1 answers */
+    }
+
+    sioSubAsked(asker);
+    sioClientBroadcast(&port, "reply 1\n", 8);
+    sioClientBroadcast(&port, "reply 2\n", 8);
+    sioSubAsked(other);
+    sioClientBroadcast(&port, "reply 3\n", 8);
+    if ((strcmp(received(peers[0]), "reply 1\nreply 2\n") != 0) ||
+        (strcmp(received(peers[1]), "reply 3\n") != 0)) {
+        fprintf(stderr, "a subscribed client missed its reply\n");
+        exit(1);
+    }
+
+    sioClientCloseAll(&port);
+    sioClientReap();
+    for (i = 0 ; i < 2 ; i++) {
+        close(peers[i]);
+    }
+}
+
+static void benchMatch(int clients, int perClient, size_t inputLen)
+{
+    char name[64];
+    double start;
+    double elapsed;
+    double naive;
+    unsigned long lines = 0;
+    unsigned long found = 0;
+    unsigned long foundNaive = 0;
+    int pass;
+    int i;
+
+    subscribe(clients, perClient);
+
+    start = benchNowNs();
+    for (pass = 0 ; pass < PASSES ; pass++) {
+        size_t off = 0;
+
+        while (off < inputLen) {
+            size_t len = 0;
+
+            while (input[off + len++] != '\n') {
+            }
+            found += (sioSubMatch(&port, input + off, len) != 0);
+            off += len;
+            lines++;
+        }
+    }
+    elapsed = benchNowNs() - start;
+
+    start = benchNowNs();
+    for (pass = 0 ; pass < PASSES ; pass++) {
+        size_t off = 0;
+
+        while (off < inputLen) {
+            struct SioClient *client;
+            size_t len = 0;
+            int hit = 0;
+
+            while (input[off + len++] != '\n') {
+            }
+            for (client = port.clients ; client != 0 ; client = client->next) {
+                for (i = 0 ; i < client->subCount ; i++) {
+                    const char *p = client->sub[i];
+                    const size_t n = strlen(p + (*p == '^'));
+
+                    hit |= (*p == '^') ?
+                        ((n <= len) && (memcmp(input + off, p + 1, n) == 0)) :
+                        (memmem(input + off, len, p, n) != 0);
+                }
+            }
+            foundNaive += hit;
+            off += len;
+        }
+    }
+    naive = benchNowNs() - start;
+
+    if (found != foundNaive) {
+        fprintf(stderr, "matched %lu lines, memmem() %lu\n", found,
+            foundNaive);
+        exit(1);
+    }
+    snprintf(name, sizeof(name), "match %d patterns", clients * perClient);
+    benchReport(name, elapsed, (double)inputLen * PASSES, lines, 0);
+    snprintf(name, sizeof(name), "memmem %d patterns", clients * perClient);
+    benchReport(name, naive, (double)inputLen * PASSES, lines, 0);
+    sioClientCloseAll(&port);
+    sioClientReap();
+    for (i = 0 ; i < clients ; i++) {
+        close(peers[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t inputLen;
+
+    benchSeed(5);
+    inputLen = benchLines(input, sizeof(input), 0);
+    if (sioEventInit() < 0) {
+        perror("sioEventInit");
+        return 1;
+    }
+    sioClientSetQueueParams(0, SIO_QUEUE_DROP_OLDEST);
+
+    checkReply();
+    benchHeader();
+    benchMatch(1, 1, inputLen);
+    benchMatch(4, 4, inputLen);
+    benchMatch(32, 16, inputLen);
+
+    sioEventClose();
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench.h"
+
+unsigned long benchAllocs;
+
+static unsigned int benchState = 1;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    benchAllocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    benchAllocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    benchAllocs++;
+    return __real_realloc(p, size);
+}
+
+double benchNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void benchSeed(unsigned int seed)
+{
+    benchState = seed;
+}
+
+unsigned int benchRand(void)
+{
+    /* Numerical Recipes LCG: the same sequence on every platform */
+    benchState = benchState * 1664525u + 1013904223u;
+    return benchState >> 8;
+}
+
+size_t benchLines(char *buff, size_t size, int *lineCount)
+{
+    size_t n = 0;
+    int lines = 0;
+
+    for (;;) {
+        const size_t len = 8 + benchRand() % 113;
+        const int crlf = benchRand() & 1;
+        size_t i;
+
+        if (n + len + 2 > size) {
+            break;
+        }
+        for (i = 0 ; i < len ; i++) {
+            buff[n++] = ' ' + 1 + benchRand() % 94;
+        }
+        if (crlf) {
+            buff[n++] = '\r';
+        }
+        buff[n++] = '\n';
+        lines++;
+    }
+
+    if (lineCount != 0) {
+        *lineCount = lines;
+    }
+    return n;
+}
+
+void benchHeader(void)
+{
+    printf("%-28s %10s %10s %10s\n", "benchmark", "ns/byte", "ns/op",
+        "allocs/op");
+}
+
+void benchReport(const char *name, double ns, double bytes, double ops,
+    unsigned long allocs)
+{
+    printf("%-28s %10.3f %10.1f %10.2f\n", name,
+        (bytes > 0) ? ns / bytes : 0.0, ns / ops, allocs / ops);
+}
@@ -0,0 +1,150 @@
+/*
+ * Wakeup cost of the old select() loop against the epoll reactor in
+ * sio_event.c.  One descriptor out of N is made readable per iteration, the
+ * way a single serial line arrives while the other descriptors sit idle.
+ * The select() variant does what sioAgent used to do each time round: copy
+ * the fd_set, wait, then test every descriptor with FD_ISSET.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+
+#include "sio_agent.h"
+
+#define ITERATIONS 200000
+
+static int (*pipes)[2];
+static unsigned long handled;
+
+static double nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void openPipes(int count)
+{
+    int i;
+
+    pipes = calloc(count, sizeof(*pipes));
+    for (i = 0 ; i < count ; i++) {
+        if (pipe(pipes[i]) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+    }
+}
+
+static void closePipes(int count)
+{
+    int i;
+
+    for (i = 0 ; i < count ; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    free(pipes);
+}
+
+static double benchSelect(int count)
+{
+    const int active = count - 1;
+    fd_set currFdSet;
+    int nfds = 0;
+    int i, n;
+    char c = 'x';
+    double start;
+
+    FD_ZERO(&currFdSet);
+    for (i = 0 ; i < count ; i++) {
+        FD_SET(pipes[i][0], &currFdSet);
+        if (pipes[i][0] >= nfds) {
+            nfds = pipes[i][0] + 1;
+        }
+    }
+
+    start = nowNs();
+    for (n = 0 ; n < ITERATIONS ; n++) {
+        fd_set readFdSet = currFdSet;
+
+        write(pipes[active][1], &c, 1);
+        if (select(nfds, &readFdSet, 0, 0, 0) <= 0) {
+            perror("select");
+            exit(1);
+        }
+        for (i = 0 ; i < count ; i++) {
+            if (FD_ISSET(pipes[i][0], &readFdSet)) {
+                read(pipes[i][0], &c, 1);
+                handled++;
+            }
+        }
+    }
+    return (nowNs() - start) / ITERATIONS;
+}
+
+static void onReadable(struct SioEvent *ev, unsigned int events)
+{
+    char c;
+
+    read(ev->fd, &c, 1);
+    handled++;
+}
+
+static double benchEpoll(int count)
+{
+    const int active = count - 1;
+    struct SioEvent *evs = calloc(count, sizeof(*evs));
+    int i, n;
+    char c = 'x';
+    double start, elapsed;
+
+    sioEventInit();
+    for (i = 0 ; i < count ; i++) {
+        evs[i].fd = pipes[i][0];
+        evs[i].handler = onReadable;
+        sioEventAdd(&evs[i], EPOLLIN);
+    }
+
+    start = nowNs();
+    for (n = 0 ; n < ITERATIONS ; n++) {
+        write(pipes[active][1], &c, 1);
+        if (sioEventRun(-1) <= 0) {
+            perror("epoll");
+            exit(1);
+        }
+    }
+    elapsed = nowNs() - start;
+
+    for (i = 0 ; i < count ; i++) {
+        sioEventDel(&evs[i]);
+    }
+    sioEventClose();
+    free(evs);
+    return elapsed / ITERATIONS;
+}
+
+int main(int argc, char *argv[])
+{
+    /* every pipe costs two descriptors and select() stops at FD_SETSIZE */
+    static const int counts[] = { 1, 4, 16, 64, 256, 500 };
+    unsigned i;
+
+    printf("%-12s %14s %14s\n", "descriptors", "select ns/wake",
+        "epoll ns/wake");
+    for (i = 0 ; i < sizeof(counts) / sizeof(counts[0]) ; i++) {
+        double sel, ep;
+
+        openPipes(counts[i]);
+        sel = benchSelect(counts[i]);
+        ep = benchEpoll(counts[i]);
+        closePipes(counts[i]);
+        printf("%-12d %14.0f %14.0f\n", counts[i], sel, ep);
+    }
+
+    return (handled == 2UL * ITERATIONS * i) ? 0 : 1;
+}
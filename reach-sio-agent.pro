@@ -10,10 +10,31 @@ DEFINES += SIO_VERSION=\\\"$$VERSION\\\"
 TARGET=sio-agent
 
 SOURCES += src/sio_agent.c \
+        src/sio_baud.c \
+        src/sio_event.c \
+        src/sio_client.c \
+        src/sio_config.c \
+        src/sio_queue.c \
+        src/sio_raw.c \
+        src/sio_realtime.c \
+        src/sio_capture.c \
+        src/sio_frame.c \
+        src/sio_cache.c \
+        src/sio_hotplug.c \
+        src/sio_latency.c \
+        src/sio_line.c \
         src/sio_local.c \
+        src/sio_pace.c \
+        src/sio_pipeline.c \
+        src/sio_profile.c \
         src/sio_serial.c \
+        src/sio_shm.c \
+        src/sio_shm_ring.c \
         src/sio_socket.c \
+        src/sio_subscribe.c \
+        src/sio_uring.c \
         src/logmsg.c
 
-HEADERS += src/sio_agent.h
+HEADERS += src/sio_agent.h \
+        src/sio_shm.h
 
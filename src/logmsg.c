@@ -1,35 +1,93 @@
-#define _BSD_SOURCE  /* for vsyslog() */
+#define _DEFAULT_SOURCE  /* for vsyslog() */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "sio_agent.h"
 
+/*
+ * Messages are formatted by the caller into a slot of a bounded lock-free
+ * ring (Vyukov's sequence-numbered queue, so any thread may log) and written
+ * out by a background thread.  When the ring is full the message is counted
+ * and discarded; the caller never waits on log I/O.
+ */
+#define LOG_SLOTS 256               /* a power of two */
+#define LOG_SLOT_TEXT 500
+#define LOG_BATCH_SIZE (16 * 1024)  /* bytes gathered into one write() */
+
+struct LogSlot {
+    unsigned int seq;       /* sequence number less the slot index */
+    int level;
+    unsigned int len;
+    char text[LOG_SLOT_TEXT];
+};
+
+/* messages with a priority above this are discarded by LogMsg() */
+int logThreshold = LOG_NOTICE;
 
-/* -1: syslog; >= 0: an open file descriptor */
+/* 0: syslog; otherwise the stream the writer thread appends to */
 static FILE *logFile;
-static int verboseOn;
 
-static void print_io_msg(int size, char *msg);
+static struct LogSlot logRing[LOG_SLOTS];
+static unsigned int enqueuePos;
+static unsigned int dequeuePos;     /* only touched by the writer thread */
+static unsigned int droppedCount;
+
+static pthread_t writerThread;
+static int writerRunning;
+static int writerSleeping;
+static int writerStopping;
+static int wakeFd = -1;
+
+static void *LogWriter(void *arg);
+
+/*
+ * A slot's sequence number starts out equal to its index; storing it with
+ * the index subtracted lets the zero-initialized ring be valid before
+ * LogOpen() runs.
+ */
+static inline unsigned int LogSlotSeq(const struct LogSlot *slot,
+    unsigned int pos)
+{
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) +
+        (pos & (LOG_SLOTS - 1));
+}
+
+static inline void LogSlotPublish(struct LogSlot *slot, unsigned int pos,
+    unsigned int seq)
+{
+    __atomic_store_n(&slot->seq, seq - (pos & (LOG_SLOTS - 1)),
+        __ATOMIC_RELEASE);
+}
 
 /**
- * Sets up the logging for the program.  Three different message destinations 
- * are possible: the system's syslog facility; a named file; and the process' 
- * standard error stream. 
- * 
- * @param ident the ident string supplied to syslog, typically this is the 
+ * Sets up the logging for the program.  Three different message destinations
+ * are possible: the system's syslog facility; a named file; and the process'
+ * standard output stream.  Starts the writer thread, so call it after any
+ * fork(), e.g. after daemon().
+ *
+ * @param ident the ident string supplied to syslog, typically this is the
  *              program's name
- * @param logToSyslog 
- * @param logFilePath 
- * @param verboseFlag 
+ * @param logToSyslog non-zero to send messages to syslog
+ * @param logFilePath file to append messages to, or 0 for standard output
+ * @param verboseFlag non-zero to pass every message, including debug ones;
+ *                    otherwise only notices and above
  */
 void LogOpen(const char *ident, int logToSyslog, const char *logFilePath,
     int verboseFlag)
 {
+    sigset_t all, old;
+
     if (logToSyslog) {
         openlog(ident, 0, LOG_USER);
         logFile = 0;
@@ -39,108 +97,272 @@ void LogOpen(const char *ident, int logToSyslog, const char *logFilePath,
             perror("could not open log file");
             exit(-1);
         }
-
-        /* 
-         * set the file to line buffered so it gets updated in a timely
-         * manner 
-         */ 
-        setlinebuf(logFile);
     } else {
-        logFile = stderr;
+        logFile = stdout;
+    }
+
+    logThreshold = verboseFlag ? LOG_DEBUG : LOG_NOTICE;
+    if (verboseFlag) {
+        fprintf(stdout, "Verbose mode enabled\n");
+        fflush(stdout);
+    }
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (wakeFd < 0) {
+        perror("could not create log eventfd");
+        exit(-1);
+    }
+
+    /* signals belong to the event loop, not to the writer */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&writerThread, 0, LogWriter, 0) != 0) {
+        perror("could not start log writer");
+        exit(-1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    writerRunning = 1;
+
+    atexit(LogClose);
+}
+
+/**
+ * Writes out every message still queued and stops the writer thread.  Runs
+ * automatically at exit().
+ */
+void LogClose(void)
+{
+    const uint64_t one = 1;
+
+    if (!writerRunning) {
+        return;
+    }
+    writerRunning = 0;
+
+    __atomic_store_n(&writerStopping, 1, __ATOMIC_SEQ_CST);
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        /* the writer also polls writerStopping, nothing else to do */
+    }
+    pthread_join(writerThread, 0);
+    close(wakeFd);
+    wakeFd = -1;
+
+    if ((logFile != 0) && (logFile != stdout)) {
+        fclose(logFile);
+    }
+}
+
+void LogSetLevel(int level)
+{
+    __atomic_store_n(&logThreshold, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * Parses a syslog priority given by name (err, warning, notice, info,
+ * debug) or by number.
+ *
+ * @return int the priority, or -1 if the name is unknown
+ */
+int LogParseLevel(const char *name)
+{
+    static const struct {
+        const char *name; int level;
+    } levelTable[] = {
+        { "err",     LOG_ERR },
+        { "error",   LOG_ERR },
+        { "warning", LOG_WARNING },
+        { "notice",  LOG_NOTICE },
+        { "info",    LOG_INFO },
+        { "debug",   LOG_DEBUG }
+    };
+    unsigned i;
+
+    if ((name[0] >= '0') && (name[0] <= '7') && (name[1] == '\0')) {
+        return name[0] - '0';
+    }
+    for (i = 0 ; i < (sizeof(levelTable) / sizeof(levelTable[0])) ; i++) {
+        if (strcmp(name, levelTable[i].name) == 0) {
+            return levelTable[i].level;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Copies src to dst showing control characters as ^X, as the serial data
+ * in a message may hold any byte.  A single trailing newline is kept.
+ */
+static unsigned int LogEscape(char *dst, unsigned int dstSize,
+    const char *src, unsigned int srcLen)
+{
+    unsigned int n = 0;
+    unsigned int i;
+    int keepNewline = 0;
+
+    if ((srcLen > 0) && (src[srcLen - 1] == '\n')) {
+        keepNewline = 1;
+        srcLen--;
+    }
+
+    for (i = 0 ; (i < srcLen) && (n + 3 < dstSize) ; i++) {
+        const unsigned char c = src[i];
+
+        if (iscntrl(c)) {
+            dst[n++] = '^';
+            dst[n++] = (c == 0x7f) ? '?' : c - 1 + 'A';
+        } else {
+            dst[n++] = c;
+        }
+    }
+    if (keepNewline || (i < srcLen)) {
+        dst[n++] = '\n';
     }
 
-    verboseOn = verboseFlag;
-    if(verboseOn) {
-		fprintf(stdout, "Verbose mode enabled\n");
-	}
+    return n;
 }
 
-void LogMsg(int level, const char *fmt, ...)
+/**
+ * Formats a message into the log ring.  Called through the LogMsg() macro,
+ * which has already checked the priority against logThreshold.
+ */
+void LogWrite(int level, const char *fmt, ...)
 {
-	const char *p;
-	va_list argp;
-	int i, len;
-	char *s;
-	char fmtbuf[256];
-
-	va_start(argp, fmt);
-
-	for(p = fmt; *p != '\0'; p++) {
-		if(*p != '%')
-		{
-			putchar(*p);
-			continue;
-		}
-
-		switch(*++p)
-		{
-			case 'c':
-				i = va_arg(argp, int);
-				putchar(i);
-				break;
-
-			case 'd':
-				i = va_arg(argp, int);
-				sprintf(fmtbuf,"%d",i);
-				fputs(fmtbuf, stdout);
-				break;
-
-			case 's':
-				s = va_arg(argp, char *);
-				len = strlen(s);
-				//fputs(s, stdout);
-				print_io_msg(len, s);
-				break;
-
-			case 'x':
-			case 'X':
-				i = va_arg(argp, int);
-				sprintf(fmtbuf,"0x%X",i);
-				fputs(fmtbuf, stdout);
-				break;
-
-			case '%':
-				putchar('%');
-				break;
-		}
-	}
-
-	va_end(argp);
+    char text[LOG_SLOT_TEXT];
+    struct LogSlot *slot;
+    unsigned int pos;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    } else if (len >= (int)sizeof(text)) {
+        len = sizeof(text) - 1;
+    }
+
+    /* claim a slot; give up rather than wait if the ring is full */
+    pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    for (;;) {
+        int diff;
+
+        slot = &logRing[pos & (LOG_SLOTS - 1)];
+        diff = (int)(LogSlotSeq(slot, pos) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&droppedCount, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+    slot->len = LogEscape(slot->text, sizeof(slot->text), text, len);
+    LogSlotPublish(slot, pos, pos + 1);
+
+    /* only pay for a wakeup if the writer has gone to sleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writerSleeping, __ATOMIC_RELAXED)) {
+        const uint64_t one = 1;
+
+        __atomic_store_n(&writerSleeping, 0, __ATOMIC_SEQ_CST);
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            /* counter overflow is harmless, the writer is awake anyway */
+        }
+    }
 }
 
-static void print_io_msg(int size, char *msg)
+static int LogRingEmpty(void)
 {
-	int i;
-	
-	for (i=0; i < size; i++) {
-		if (iscntrl(msg[i])) {
-			fprintf(stdout,"^%C", msg[i] - 1 + 'A');
-		} else {
-			putchar(msg[i]);
-		}
-	}
+    const struct LogSlot *slot = &logRing[dequeuePos & (LOG_SLOTS - 1)];
+
+    return LogSlotSeq(slot, dequeuePos) != dequeuePos + 1;
 }
 
-//void LogMsg(int level, const char *fmt, ...)
-//{
-    ///* 
-     //* only log the message if in verbose mode or the priority is higher than
-     //* informational
-     //*/
-    //if (verboseOn) {
-        //va_list ap;
-        //va_start(ap, fmt);
-
-		///* support logging to stdout only */
-        ////if (logFile == 0) {
-            ///* log to syslog */
-        ////    vsyslog(LOG_USER | level, fmt, ap);
-        ////} else {
-            ///* log to an open descriptor such as stdout or a file */
-            ////vfprintf(logFile, fmt, ap);
-            //vprintf(fmt,ap);
-        ////}
-
-        //va_end(ap);
-    //}
-//}
+static void LogFlushBatch(const char *batch, size_t len)
+{
+    const int fd = fileno(logFile);
+
+    while (len > 0) {
+        const ssize_t cnt = write(fd, batch, len);
+
+        if (cnt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;  /* nowhere to report it */
+        }
+        batch += cnt;
+        len -= cnt;
+    }
+}
+
+/* background thread moving messages from the ring to their destination */
+static void *LogWriter(void *arg)
+{
+    static char batch[LOG_BATCH_SIZE];
+    unsigned int reportedDrops = 0;
+
+    for (;;) {
+        size_t batchLen = 0;
+        unsigned int drops;
+
+        while (!LogRingEmpty() && (batchLen + LOG_SLOT_TEXT <= sizeof(batch))) {
+            struct LogSlot *slot = &logRing[dequeuePos & (LOG_SLOTS - 1)];
+
+            if (logFile == 0) {
+                syslog(slot->level, "%.*s", (int)slot->len, slot->text);
+            } else {
+                memcpy(batch + batchLen, slot->text, slot->len);
+                batchLen += slot->len;
+            }
+            LogSlotPublish(slot, dequeuePos, dequeuePos + LOG_SLOTS);
+            dequeuePos++;
+        }
+
+        drops = __atomic_load_n(&droppedCount, __ATOMIC_RELAXED);
+        if (drops != reportedDrops) {
+            char note[64];
+            const int len = snprintf(note, sizeof(note),
+                "[SIO] %u log message(s) lost\n", drops - reportedDrops);
+
+            reportedDrops = drops;
+            if (logFile == 0) {
+                syslog(LOG_WARNING, "%s", note);
+            } else if (batchLen + len <= sizeof(batch)) {
+                memcpy(batch + batchLen, note, len);
+                batchLen += len;
+            }
+        }
+
+        if (batchLen > 0) {
+            LogFlushBatch(batch, batchLen);
+            continue;
+        }
+
+        if (__atomic_load_n(&writerStopping, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        /* sleep until a producer sees writerSleeping and kicks wakeFd */
+        __atomic_store_n(&writerSleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (LogRingEmpty() &&
+            !__atomic_load_n(&writerStopping, __ATOMIC_SEQ_CST)) {
+            uint64_t count;
+
+            if (read(wakeFd, &count, sizeof(count)) < 0) {
+                /* EINTR cannot happen, all signals are blocked */
+            }
+        }
+        __atomic_store_n(&writerSleeping, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return arg;
+}
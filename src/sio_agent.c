@@ -6,17 +6,48 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 
 #include "sio_agent.h"
 
+/* long options without a short equivalent */
+enum {
+    OPT_CLIENT_QUEUE = 256,
+    OPT_TTY_QUEUE,
+    OPT_LOG_LEVEL,
+    OPT_CAPTURE,
+    OPT_LINE_MAX,
+    OPT_BATCH_MAX,
+    OPT_CACHE,
+    OPT_CACHE_INVALIDATE,
+    OPT_PORT,
+    OPT_VMIN,
+    OPT_VTIME,
+    OPT_LOW_LATENCY,
+    OPT_RAW,
+    OPT_PIPELINE,
+    OPT_REPLY_RULE,
+    OPT_PROFILE,
+    OPT_CONFIG,
+    OPT_SEQPACKET,
+    OPT_REALTIME,
+    OPT_JITTER,
+    OPT_FLOW,
+    OPT_PACE,
+    OPT_RS485_DELAY,
+    OPT_IO_URING
+};
+
 /* module-wide "global" variables */
 static int keepGoing;
 static const char *progName;
 
 static void sioDumpHelp();
-static void sioAgent(const char *serialName, int useStdio,
-    unsigned short tcpPort, const char *unixSocketPath);
-static inline int max(int a, int b) { return (a > b) ? a : b; }
+static int sioParseLimit(const char *arg, size_t *limit);
+static int sioParsePort(char *arg, struct SioPort *port,
+    unsigned int *baudRate);
+static void sioAgent(struct SioPort *ports, int portCount);
+static void sioOnClientShm(struct SioEvent *ev, unsigned int events);
 
 int main(int argc, char *argv[])
 {
@@ -25,6 +56,16 @@ int main(int argc, char *argv[])
     const char *serialName  = SIO_DEFAULT_SERIAL_DEVICE;
     unsigned short tcpPort  = 0;
     unsigned int baudRate   = SIO_DEFAULT_SERIAL_RATE;
+    unsigned int vmin       = SIO_DEFAULT_VMIN;
+    unsigned int vtime      = SIO_DEFAULT_VTIME;
+    int lowLatency          = 0;
+    int flow                = SIO_FLOW_NONE;
+    unsigned int rtsBeforeMs = 0;
+    unsigned int rtsAfterMs = 0;
+    unsigned int pacePercent = 0;
+    unsigned int paceGapUs  = 0;
+    int rawMode             = 0;
+    int seqpacketMode       = 0;
     int useStdio            = 0;
     int enableRS485         = 0;
     const char *logFilePath = 0;
@@ -34,6 +75,20 @@ int main(int argc, char *argv[])
      */ 
     int logToSyslog = 0;
     int verboseFlag = 0;
+    int logLevel = -1;
+    const char *capturePath = 0;
+    const char *configPath  = 0;
+    size_t captureSize      = SIO_CAPTURE_DEFAULT_SIZE;
+    size_t clientQueueMax   = SIO_DEFAULT_QUEUE_MAX;
+    int clientQueuePolicy   = SIO_QUEUE_DROP_OLDEST;
+    size_t ttyQueueMax      = SIO_DEFAULT_QUEUE_MAX;
+    int ttyQueuePolicy      = SIO_QUEUE_DROP_NEWEST;
+    size_t lineMax          = SIO_DEFAULT_LINE_MAX;
+    size_t batchMax         = SIO_DEFAULT_BATCH_MAX;
+    char *portSpecs[SIO_MAX_PORTS];
+    int portCount           = 0;
+    struct SioPort *ports;
+    int i;
 
     /* allocate memory for progName since basename() modifies it */
     const size_t nameLen = strlen(argv[0]) + 1;
@@ -61,9 +116,34 @@ int main(int argc, char *argv[])
             { "stdio",      no_argument,       0, 'i' },
             { "verbose",    no_argument,       0, 'v' },
             { "help",       no_argument,       0, 'h' },
+            { "log",        required_argument, 0, 'o' },
+            { "log-level",  required_argument, 0, OPT_LOG_LEVEL },
+            { "capture",    required_argument, 0, OPT_CAPTURE },
+            { "client-queue", required_argument, 0, OPT_CLIENT_QUEUE },
+            { "tty-queue",  required_argument, 0, OPT_TTY_QUEUE },
+            { "line-max",   required_argument, 0, OPT_LINE_MAX },
+            { "batch-max",  required_argument, 0, OPT_BATCH_MAX },
+            { "cache",      required_argument, 0, OPT_CACHE },
+            { "cache-invalidate", required_argument, 0, OPT_CACHE_INVALIDATE },
+            { "port",       required_argument, 0, OPT_PORT },
+            { "vmin",       required_argument, 0, OPT_VMIN },
+            { "vtime",      required_argument, 0, OPT_VTIME },
+            { "low-latency", no_argument,      0, OPT_LOW_LATENCY },
+            { "raw",        no_argument,       0, OPT_RAW },
+            { "pipeline",   required_argument, 0, OPT_PIPELINE },
+            { "reply-rule", required_argument, 0, OPT_REPLY_RULE },
+            { "profile",    required_argument, 0, OPT_PROFILE },
+            { "config",     required_argument, 0, OPT_CONFIG },
+            { "seqpacket",  no_argument,       0, OPT_SEQPACKET },
+            { "realtime",   required_argument, 0, OPT_REALTIME },
+            { "jitter",     optional_argument, 0, OPT_JITTER },
+            { "flow",       required_argument, 0, OPT_FLOW },
+            { "pace",       required_argument, 0, OPT_PACE },
+            { "rs485-delay", required_argument, 0, OPT_RS485_DELAY },
+            { "io-uring",   no_argument,       0, OPT_IO_URING },
             { 0,            0, 0,  0  }
         };
-        int c = getopt_long(argc, argv, "b:dilpsf::t:vh?", longOptions, 0);
+        int c = getopt_long(argc, argv, "b:dilo:psf::t:vh?", longOptions, 0);
 
         if (c == -1) {
             break;  // no more options to process
@@ -71,7 +151,10 @@ int main(int argc, char *argv[])
 
         switch (c) {
         case 'b':
-            baudRate = atoi(optarg);
+            if (sioTtyParseRate(optarg, &baudRate) < 0) {
+                fprintf(stderr, "%s: bad bit rate %s\n", progName, optarg);
+                exit(1);
+            }
             break;
 
         case 'd':
@@ -106,6 +189,181 @@ int main(int argc, char *argv[])
             verboseFlag = 1;
             break;
 
+        case 'o':
+            if (strcmp(optarg, "syslog") == 0) {
+                logToSyslog = 1;
+            } else {
+                logFilePath = optarg;
+            }
+            break;
+
+        case OPT_LOG_LEVEL:
+            logLevel = LogParseLevel(optarg);
+            if (logLevel < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_CAPTURE:
+            {
+                /* <file>[:<size>] with an optional K or M suffix */
+                char *sep = strrchr(optarg, ':');
+
+                capturePath = optarg;
+                if (sep != 0) {
+                    char *end;
+                    captureSize = strtoul(sep + 1, &end, 10);
+                    if ((*end == 'k') || (*end == 'K')) {
+                        captureSize *= 1024;
+                    } else if ((*end == 'm') || (*end == 'M')) {
+                        captureSize *= 1024 * 1024;
+                    }
+                    *sep = '\0';
+                }
+            }
+            break;
+
+        case OPT_CLIENT_QUEUE:
+            if (sioQueueParse(optarg, &clientQueueMax, &clientQueuePolicy) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_TTY_QUEUE:
+            if (sioQueueParse(optarg, &ttyQueueMax, &ttyQueuePolicy) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_LINE_MAX:
+        case OPT_BATCH_MAX:
+            if (sioParseLimit(optarg,
+                (c == OPT_LINE_MAX) ? &lineMax : &batchMax) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_CACHE:
+            if (sioCacheAdd(optarg) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_CACHE_INVALIDATE:
+            if (sioCacheAddRule(optarg) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_PIPELINE:
+            if (sioPipelineSetup(optarg) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_REPLY_RULE:
+            if (sioPipelineAddRule(optarg) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_PROFILE:
+            if (sioProfileSetup(optarg) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_REALTIME:
+            if (sioRealtimeSetup(optarg) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_JITTER:
+            if (sioJitterSetup(optarg) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_FLOW:
+            if (sioTtyParseFlow(optarg, &flow) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_PACE:
+            if (sioPaceParse(optarg, &pacePercent, &paceGapUs) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_RS485_DELAY:
+            if (sioTtyParseDelay(optarg, &rtsBeforeMs, &rtsAfterMs) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            break;
+
+        case OPT_CONFIG:
+            configPath = optarg;
+            break;
+
+        case OPT_VMIN:
+        case OPT_VTIME:
+            {
+                /* both are a single cc_t */
+                char *end;
+                const unsigned long n = strtoul(optarg, &end, 10);
+
+                if ((end == optarg) || (*end != '\0') || (n > 255)) {
+                    sioDumpHelp();
+                    exit(1);
+                }
+                if (c == OPT_VMIN) {
+                    vmin = n;
+                } else {
+                    vtime = n;
+                }
+            }
+            break;
+
+        case OPT_LOW_LATENCY:
+            lowLatency = 1;
+            break;
+
+        case OPT_RAW:
+            rawMode = 1;
+            break;
+
+        case OPT_SEQPACKET:
+            seqpacketMode = 1;
+            break;
+
+        case OPT_IO_URING:
+            sioEventSetUring(1);
+            break;
+
+        case OPT_PORT:
+            if (portCount >= SIO_MAX_PORTS) {
+                sioDumpHelp();
+                exit(1);
+            }
+            portSpecs[portCount++] = optarg;
+            break;
+
         case '?':
         case 'h':
         default:
@@ -114,8 +372,11 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* set up logging to syslog or file; will be STDERR not told otherwise */
-    LogOpen(progName, logToSyslog, logFilePath, verboseFlag);
+    if (rawMode && seqpacketMode) {
+        /* raw bytes have no lines to put in packets */
+        sioDumpHelp();
+        exit(1);
+    }
 
     /*  Keep STDIO going for now.
      */
@@ -124,12 +385,75 @@ int main(int argc, char *argv[])
         useStdio = 0;  /* don't use stdin and stdout if daemon */
     }
 
+    /* 
+     * set up logging to syslog or file; will be STDOUT if not told 
+     * otherwise.  This starts the log writer thread, so it has to come 
+     * after daemon() forks. 
+     */
+    LogOpen(progName, logToSyslog, logFilePath, verboseFlag);
+    if (logLevel >= 0) {
+        LogSetLevel(logLevel);
+    }
+
+    if ((capturePath != 0) && (sioCaptureOpen(capturePath, captureSize) < 0)) {
+        exit(1);
+    }
+
     if (useStdio) {
         localEcho = 0;  /* terminal should already do this */
     }
 
-    sioTtySetParams(localEcho, baudRate, enableRS485);
-    sioAgent(serialName, useStdio, tcpPort, SIO_AGENT_UNIX_SOCKET);
+    /* without --port the classic options describe a single port */
+    ports = calloc((portCount > 0) ? portCount : 1, sizeof(*ports));
+    if (ports == 0) {
+        exit(1);
+    }
+    if (portCount == 0) {
+        ports[0].serialName = serialName;
+        ports[0].useStdio = useStdio;
+        ports[0].tcpPort = tcpPort;
+        ports[0].unixSocketPath = SIO_AGENT_UNIX_SOCKET;
+        sioTtySetParams(&ports[0], localEcho, baudRate, enableRS485);
+        portCount = 1;
+    } else {
+        for (i = 0 ; i < portCount ; i++) {
+            unsigned int portRate = baudRate;
+
+            if (sioParsePort(portSpecs[i], &ports[i], &portRate) < 0) {
+                sioDumpHelp();
+                exit(1);
+            }
+            sioTtySetParams(&ports[i], localEcho, portRate, enableRS485);
+        }
+    }
+
+    sioClientSetQueueParams(clientQueueMax, clientQueuePolicy);
+    sioClientSetLineParams(lineMax, batchMax);
+    for (i = 0 ; i < portCount ; i++) {
+        ports[i].index = i;
+        ports[i].raw = rawMode;
+        ports[i].seqpacket = seqpacketMode && (ports[i].tcpPort == 0);
+        sioTtySetTiming(&ports[i], vmin, vtime, lowLatency);
+        sioTtySetFlow(&ports[i], flow, rtsBeforeMs, rtsAfterMs);
+        sioPaceSet(&ports[i], pacePercent, paceGapUs);
+        if (sioTtySetQueueParams(&ports[i], ttyQueueMax, ttyQueuePolicy) < 0) {
+            exit(1);
+        }
+        ports[i].serialEv.fd = -1;  /* until sioAgent() opens it */
+    }
+    if ((configPath != 0) && (sioConfigLoad(configPath, ports, portCount) < 0)) {
+        exit(1);
+    }
+
+    /* last, so the log writer thread keeps the default policy */
+    sioRealtimeStart();
+    sioAgent(ports, portCount);
+    sioCaptureClose();
+
+    for (i = 0 ; i < portCount ; i++) {
+        sioQueueFree(&ports[i].ttyOut);
+    }
+    free(ports);
 
     return 0;
 }
@@ -140,7 +464,8 @@ static void sioDumpHelp()
 	
     fprintf(stderr, "usage: %s [options]\n"
         "  where options are:\n"
-        "    -b<rate>   | --baud=<rate>       serial port bit rate, default = %d\n"
+        "    -b<rate>   | --baud=<rate>       serial port bit rate, default = %d; rates such as\n"
+        "                                     460800, 921600 or 3000000 need driver support\n"
         "    -d         | --daemon            run in background\n"
         "    -e         | --test              echo, backspace\n"
         "    -i         | --stdio             use standard I/O instead of serial\n"
@@ -148,184 +473,782 @@ static void sioDumpHelp()
         "    -s[<port>] | --sio_port[=<port>] use TCP socket, default = %d\n"
         "    -t         | --serial <dev>      use <dev> instead of /dev/ttyUSB0\n"
         "    -f         | --rs485             enable RS-485 mode\n"
+        "    --vmin=<bytes> --vtime=<ds>      termios VMIN and VTIME of the device, default = %d and %d\n"
+        "    --low-latency                    ask the UART driver for ASYNC_LOW_LATENCY\n"
+        "    --flow=<type>                    flow control: none (default), rtscts or xonxoff\n"
+        "    --rs485-delay=<before>,<after>   RS-485 RTS delays around sending, in ms (0 to %d)\n"
+        "    --pace=<percent>[,<us>]          write to the device at <percent> of its line rate,\n"
+        "                                     and with <us> of idle line between client writes\n"
+        "    --raw                            pass bytes through unchanged: no line framing,\n"
+        "                                     local commands or cache\n"
+        "    --seqpacket                      make Unix sockets SOCK_SEQPACKET: one line per\n"
+        "                                     packet each way, TCP ports are not affected\n"
+        "    --realtime=<cpu>[,<prio>]        pin the bridge loop to <cpu>, run it under\n"
+        "                                     SCHED_FIFO <prio> (default = 50) with memory locked\n"
+        "    --jitter[=<us>]                  measure how late the loop wakes for a timer every\n"
+        "                                     <us>, default = 1000; SIGUSR1 logs the result\n"
+        "    --io-uring                       read serial lines and client sockets and write to\n"
+        "                                     clients through io_uring if the kernel has it\n"
+        "    -o<dest>   | --log=<dest>        log to file <dest>, or to syslog if <dest> is syslog\n"
         "    -v         | --verbose           print progress messages\n"
-        "    -h         | -? | --help         print usage information\n",
-        progName, SIO_DEFAULT_SERIAL_RATE, SIO_DEFAULT_AGENT_PORT);
+        "    --log-level=<level>              err, warning, notice (default), info or debug\n"
+        "    --capture=<file>[:<size>]        record all traffic to a ring file, default size = %d\n"
+        "    -h         | -? | --help         print usage information\n"
+        "    --client-queue=<bytes>[:<policy>]  per-client output limit, default = %d:drop-oldest\n"
+        "    --tty-queue=<bytes>[:<policy>]     serial output limit, default = %d:drop-newest\n"
+        "        <policy> is drop-oldest, drop-newest or disconnect; 0 bytes = unlimited\n"
+        "    --line-max=<bytes>               longest client line passed on, default = %d\n"
+        "    --batch-max=<bytes>              most client lines sent in one serial write, default = %d\n"
+        "    --cache=<request>,<reply>[,<ms>] answer <request> from the last device line\n"
+        "                                     starting with <reply> for <ms>, default = 1000\n"
+        "    --cache-invalidate=<prefix>[,<request>]  client lines starting with <prefix>\n"
+        "                                     clear the <request> entry, or all entries\n"
+        "    --pipeline=<depth>[,<ms>]        keep up to <depth> requests outstanding per port\n"
+        "                                     and send each reply only to the client that\n"
+        "                                     asked; give up on a request after <ms>, default = 1000\n"
+        "    --reply-rule=<request>,<reply>   with --pipeline, correlate only lines starting with\n"
+        "                                     <request>, answered by lines starting with <reply>;\n"
+        "                                     without rules every line is answered in order\n"
+        "    --profile=<name>[,<ms>]          tune client sockets: latency (no delay, small send\n"
+        "                                     buffer), throughput (hold output for <ms> and write\n"
+        "                                     it corked, default = 2) or adaptive (switch between\n"
+        "                                     the two with the device's line rate)\n"
+        "    --config=<file>                  read <key> = <value> settings from <file>, and again\n"
+        "                                     on SIGHUP without dropping clients; keys are baud,\n"
+        "                                     rs485, rs485-delay, vmin, vtime, low-latency, flow,\n"
+        "                                     pace, tty-queue, client-queue and log-level,\n"
+        "                                     <key>.<n> for port n only\n"
+        "    --port=<dev>:<listen>[:<rate>]   bridge serial <dev> (or pty) to TCP port or Unix\n"
+        "                                     socket <listen>; repeat for up to %d ports\n",
+        progName, SIO_DEFAULT_SERIAL_RATE, SIO_DEFAULT_AGENT_PORT,
+        SIO_DEFAULT_VMIN, SIO_DEFAULT_VTIME, SIO_RS485_DELAY_MAX_MS,
+        SIO_CAPTURE_DEFAULT_SIZE, SIO_DEFAULT_QUEUE_MAX, SIO_DEFAULT_QUEUE_MAX,
+        SIO_DEFAULT_LINE_MAX, SIO_DEFAULT_BATCH_MAX, SIO_MAX_PORTS);
+}
+
+/*
+ * Fills in a port from an argument of the form <dev>:<listen>[:<rate>]. 
+ * <dev> is a serial device or "pty", <listen> a TCP port number or the 
+ * path of a Unix domain socket.  arg is split in place. 
+ */
+static int sioParsePort(char *arg, struct SioPort *port,
+    unsigned int *baudRate)
+{
+    char *listen = strchr(arg, ':');
+    char *rate;
+    char *end;
+
+    if ((listen == 0) || (listen == arg) || (listen[1] == '\0')) {
+        return -1;
+    }
+    *listen++ = '\0';
+
+    rate = strchr(listen, ':');
+    if (rate != 0) {
+        *rate++ = '\0';
+        if (sioTtyParseRate(rate, baudRate) < 0) {
+            return -1;
+        }
+    }
+
+    port->serialName = (strcmp(arg, "pty") == 0) ? 0 : arg;
+    port->tcpPort = strtoul(listen, &end, 10);
+    if ((end == listen) || (*end != '\0')) {
+        /* not a number, so a socket path */
+        port->tcpPort = 0;
+        port->unixSocketPath = listen;
+    } else if (port->tcpPort == 0) {
+        return -1;
+    }
+    return 0;
 }
 
+/* a byte count of 1 to 16M with an optional K or M suffix */
+static int sioParseLimit(const char *arg, size_t *limit)
+{
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+
+    if ((*end == 'k') || (*end == 'K')) {
+        n *= 1024;
+        end++;
+    } else if ((*end == 'm') || (*end == 'M')) {
+        n *= 1024 * 1024;
+        end++;
+    }
+    if ((end == arg) || (*end != '\0') || (n == 0) || (n > 16 * 1024 * 1024)) {
+        return -1;
+    }
+    *limit = n;
+    return 0;
+}
+
+static volatile sig_atomic_t dumpRequested;
+static volatile sig_atomic_t reloadRequested;
+
 static void sioInterruptHandler(int sig)
 {
     keepGoing = 0;
 }
 
+static void sioDumpHandler(int sig)
+{
+    dumpRequested = 1;
+}
+
+static void sioReloadHandler(int sig)
+{
+    reloadRequested = 1;
+}
+
+/*
+ * Writes queued serial output and waits for EPOLLOUT if some is left, or
+ * for port->paceAt if --pace is holding it.
+ */
+static void sioSerialFlush(struct SioPort *port)
+{
+    ssize_t left;
+    int wantOut;
+
+    if (port->serialEv.fd < 0) {
+        port->paceAt = 0;
+        return;  /* closed, the queue waits for the port to be reopened */
+    }
+
+    left = sioTtyFlush(port);
+    sioPipelineWritten(port, sioNowNs());
+    wantOut = (left > 0) && (port->paceAt == 0);
+    if (port->serialOutFd != port->serialEv.fd) {
+        return;
+    } else if (port->readDone != 0) {
+        /* io_uring does the reading, epoll only waits for room to write */
+        if (wantOut && (port->serialEv.events == 0) && !port->serialFailed) {
+            sioEventAdd(&port->serialEv, EPOLLOUT);
+        } else if (!wantOut && (port->serialEv.events != 0)) {
+            sioEventDel(&port->serialEv);
+        }
+    } else if (port->serialEv.events != 0) {
+        sioEventMod(&port->serialEv, wantOut ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    }
+}
+
+/* queues a run of client lines for the serial port */
+static int sioForwardRun(struct SioClient *client, const char *data,
+    size_t len)
+{
+    if ((len > 0) && (sioTtyWrite(client->port, data, len) < 0)) {
+        LogMsg(LOG_NOTICE, "[SIO] serial queue full, dropping client\n");
+        sioClientClose(client);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sends a batch of complete client lines on to the serial port, answering
+ * local commands and cached queries in place.  The lines between two such
+ * answers still go out as one write.  Returns -1 if the client was closed.
+ */
+static int sioForwardLines(struct SioClient *client, const char *data,
+    size_t len)
+{
+    const char *const end = data + len;
+    const char *run = data;
+    const char *p = data;
+
+    while (p < end) {
+        const size_t lineLen = sioFindEol(p, end - p);
+        const char *next = p + lineLen + 1;
+        char reply[SIO_BUFFER_SIZE];
+        int replyLen;
+        const char *value = reply;
+        size_t valueLen = 0;
+        int action;
+
+        if ((p[lineLen] == '\r') && (next < end) && (*next == '\n')) {
+            next++;
+        }
+
+        if (sioFrameNegotiate(client, p, lineLen) ||
+            sioShmNegotiate(client, p, lineLen, sioOnClientShm) ||
+            sioSubRequest(client, p, lineLen)) {
+            if (client->ev.fd < 0) {
+                return -1;
+            }
+            action = SIO_CACHE_HIT;     /* answered, nothing more to send */
+        } else if ((replyLen = sioHandleLocal(client->port, p, lineLen,
+            reply, sizeof(reply))) > 0) {
+            valueLen = replyLen;
+            action = SIO_CACHE_HIT;
+        } else {
+            action = sioCacheRequest(client->port, p, lineLen, &value,
+                &valueLen);
+        }
+
+        if ((action == SIO_CACHE_MERGED) && sioPipelineEnabled()) {
+            /* the reply will only go to the client that asked first */
+            action = SIO_CACHE_FORWARD;
+        } else if ((action != SIO_CACHE_HIT) && !sioPipelineEnabled()) {
+            /* whatever the device says next may be for this client */
+            sioSubAsked(client);
+        }
+
+        if (action != SIO_CACHE_FORWARD) {
+            /* answered here, or merged with the same request in flight */
+            if (sioForwardRun(client, run, p - run) < 0) {
+                return -1;
+            }
+            if (valueLen > 0) {
+                sioClientSend(client, value, valueLen);
+                if (client->ev.fd < 0) {
+                    return -1;
+                }
+            }
+            run = next;
+        } else if (sioPipelineEnabled()) {
+            /* requests go through the window one line at a time */
+            if (sioPipelineSubmit(client, p, next - p) < 0) {
+                LogMsg(LOG_NOTICE, "[SIO] serial queue full, dropping client\n");
+                sioClientClose(client);
+                return -1;
+            }
+            run = next;
+        }
+        p = next;
+    }
+
+    return sioForwardRun(client, run, end - run);
+}
+
+/*
+ * Passes on the lines completed by the readCount bytes just appended to a
+ * client's line assembler.  Returns -1 if the client was closed.
+ */
+static int sioClientInput(struct SioClient *client, int readCount)
+{
+    struct SioPort *port = client->port;
+    unsigned int batch;
+
+    sioCaptureRecord(SIO_CAPTURE_SOCKET_RX, client->ev.fd,
+        client->in.data + client->in.len - readCount, readCount);
+
+    /* 
+     * Whole lines only, and all the lines of a read in one write; 
+     * batches from all clients go out in the order they complete. 
+     */
+    batch = sioLineAssemble(&client->in);
+    if (batch > 0) {
+        if (sioForwardLines(client, client->in.data, batch) == 0) {
+            sioLineBufConsume(&client->in);
+        }
+        sioSerialFlush(port);
+    }
+    return (client->ev.fd < 0) ? -1 : 0;
+}
+
+/* a connected tio_agent has something to relay or can take more output */
+static void sioOnClient(struct SioEvent *ev, unsigned int events)
+{
+    struct SioClient *client = ev->ctx;
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        const int readCount = sioTioSocketRead(ev->fd, &client->in);
+
+        if (readCount < 0) {
+            sioClientClose(client);
+            return;
+        } else if ((readCount > 0) && (sioClientInput(client, readCount) < 0)) {
+            return;
+        }
+    }
+
+    if (events & EPOLLOUT) {
+        sioClientFlush(client);
+    }
+}
+
+/* a shared-memory client put lines in its ring or made room in ours */
+static void sioOnClientShm(struct SioEvent *ev, unsigned int events)
+{
+    struct SioClient *client = ev->ctx;
+    uint64_t count;
+    int readCount;
+
+    if (read(ev->fd, &count, sizeof(count)) < 0) {
+        /* woken by an earlier read of the ring, nothing new */
+    }
+    while ((readCount = sioShmReceive(client)) > 0) {
+        if (sioClientInput(client, readCount) < 0) {
+            return;
+        }
+    }
+    sioClientFlush(client);
+}
+
+/* a SOCK_SEQPACKET client sent a burst of lines, one per packet */
+static void sioOnClientPackets(struct SioEvent *ev, unsigned int events)
+{
+    struct SioClient *client = ev->ctx;
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        char *lines;
+        int closed;
+        const int len = sioTioSocketReadPackets(ev->fd, client->in.maxLine,
+            &lines, &closed);
+
+        if (len < 0) {
+            sioClientClose(client);
+            return;
+        }
+        if (len > 0) {
+            /* every packet is a whole line, so they all go out at once */
+            sioCaptureRecord(SIO_CAPTURE_SOCKET_RX, ev->fd, lines, len);
+            closed |= (sioForwardLines(client, lines, len) < 0);
+            sioSerialFlush(client->port);
+        }
+        if (closed) {
+            sioClientClose(client);
+            return;
+        }
+    }
+
+    if (events & EPOLLOUT) {
+        sioClientFlush(client);
+    }
+}
+
+static void sioOnClientRaw(struct SioEvent *ev, unsigned int events)
+{
+    struct SioClient *client = ev->ctx;
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if (sioRawFromClient(client) < 0) {
+            return;
+        }
+        sioSerialFlush(client->port);
+    }
+
+    if (events & EPOLLOUT) {
+        sioClientFlush(client);
+    }
+}
+
+/* a connection from a tio-agent is queued on the server socket */
+static void sioOnListen(struct SioEvent *ev, unsigned int events)
+{
+    struct SioPort *port = ev->ctx;
+    const int fd = sioTioSocketAccept(ev->fd, port->addressFamily);
+    struct SioClient *client;
+
+    if (fd < 0) {
+        return;
+    }
+
+    sioProfileAccept(fd, port->addressFamily);
+    if ((sioSetNonBlocking(fd) < 0) ||
+        ((client = sioClientAdd(port, fd, port->raw ? sioOnClientRaw :
+            port->seqpacket ? sioOnClientPackets : sioOnClient)) == 0)) {
+        close(fd);
+    } else if (!port->raw && !port->seqpacket) {
+        /* stays on epoll if io_uring isn't in use */
+        sioClientUring(client, sioClientInput);
+    }
+}
+
+/* hands the complete lines in a port's receive ring to its clients */
+static void sioSerialLines(struct SioPort *port)
+{
+    char ttyBuff[SIO_BUFFER_SIZE];
+    int lineLen;
+
+    while ((lineLen = sioTtyNextLine(&port->ring, ttyBuff,
+        sizeof(ttyBuff))) > 0) {
+        sioCaptureRecord(SIO_CAPTURE_SERIAL_RX, port->index, ttyBuff, lineLen);
+        sioCacheReply(port, ttyBuff, lineLen);
+        if (!sioPipelineReply(port, ttyBuff, lineLen)) {
+            sioClientBroadcast(port, ttyBuff, lineLen);
+        }
+    }
+    sioFrameFlush();
+    if (sioPipelineEnabled()) {
+        /* replies may have let waiting requests out */
+        sioSerialFlush(port);
+    }
+}
+
+/*
+ * New bytes from the serial device are in the port's receive ring, or with
+ * EPOLLERR its read failed.  Also the completion handler of io_uring reads.
+ */
+static void sioOnSerialRead(struct SioEvent *ev, unsigned int events)
+{
+    struct SioPort *port = ev->ctx;
+
+    if (events & EPOLLERR) {
+        /* the main loop reopens the serial port or pts */
+        port->serialFailed = 1;
+        sioEventDel(&port->serialEv);
+        return;
+    }
+    sioSerialLines(port);
+}
+
+/* serial port has something to send to the connected tio_agents */
+static void sioOnSerial(struct SioEvent *ev, unsigned int events)
+{
+    struct SioPort *port = ev->ctx;
+
+    if (events & EPOLLOUT) {
+        sioSerialFlush(port);
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ||
+        (port->readDone != 0)) {
+        /* with io_uring a failing device shows up in its read */
+        return;
+    }
+
+    sioOnSerialRead(ev, (sioTtyRead(port) < 0) ? EPOLLERR : EPOLLIN);
+}
+
+/* the device of a raw port has bytes for the clients or can take more */
+static void sioOnSerialRaw(struct SioEvent *ev, unsigned int events)
+{
+    struct SioPort *port = ev->ctx;
+
+    if (events & EPOLLOUT) {
+        sioSerialFlush(port);
+    }
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+        (sioRawFromSerial(port) < 0)) {
+        /* the main loop reopens the serial port or pts */
+        port->serialFailed = 1;
+        sioEventDel(&port->serialEv);
+    }
+}
+
+/**
+ * Opens the serial device (or pty, or stdio) of a port and registers it 
+ * with the event loop. 
+ * 
+ * @return int 0 on success, -1 if the device could not be opened
+ */
+static int sioSerialOpen(struct SioPort *port)
+{
+    sioTtyRingReset(&port->ring);
+
+    if (port->useStdio) {
+        /* left blocking: O_NONBLOCK would leak to the shell's terminal */
+        port->serialEv.fd = fileno(stdin);
+        port->serialOutFd = fileno(stdout);
+    } else {
+        /* try opening the serial device */
+        port->serialEv.fd = sioTtyInit(port);
+        if (port->serialEv.fd < 0) {
+            return -1;
+        }
+        port->serialOutFd = port->serialEv.fd;
+        sioSetNonBlocking(port->serialEv.fd);
+    }
+
+    port->serialFailed = 0;
+    if (!port->useStdio && !port->raw && !port->localEcho &&
+        (sioTtyReadAsync(port, sioOnSerialRead) == 0)) {
+        /* epoll is only asked to wait for room to write */
+    } else if (sioEventAdd(&port->serialEv, EPOLLIN) < 0) {
+        if (!port->useStdio) {
+            sioTtyClose(port);
+        }
+        return -1;
+    }
+    port->openedAt = sioNowNs();
+    port->reopenAt = 0;
+    /* send anything queued before the port was reopened */
+    sioSerialFlush(port);
+    return 0;
+}
+
+/* 
+ * Reopen backoff for a device that is missing.  inotify normally cuts the 
+ * wait short; the timer covers devices whose directory can't be watched 
+ * and drivers that need a moment after the node shows up. 
+ */
+#define SIO_RETRY_MIN_MS 50
+#define SIO_RETRY_MAX_MS 2000
+
+/* schedules the next open attempt of a closed serial device */
+static void sioSerialRetryLater(struct SioPort *port, uint64_t now)
+{
+    if (port->retryMs == 0) {
+        port->retryMs = SIO_RETRY_MIN_MS;
+    } else if (port->retryMs < SIO_RETRY_MAX_MS / 2) {
+        port->retryMs *= 2;
+    } else {
+        port->retryMs = SIO_RETRY_MAX_MS;
+    }
+    port->reopenAt = now + port->retryMs * 1000000ULL;
+    if (port->watch < 0) {
+        /* the directory may have come back, e.g. /dev/serial/by-id */
+        sioHotplugWatch(port);
+    }
+}
+
+/* tries to open a closed serial device, scheduling a retry on failure */
+static void sioSerialRetry(struct SioPort *port)
+{
+    const unsigned int queued = port->ttyOut.bytes;
+
+    if (sioSerialOpen(port) == 0) {
+        LogMsg(LOG_NOTICE, "[SIO] port %d: %s is back, %u byte(s) replayed\n",
+            port->index, port->ttyName, queued);
+        return;
+    }
+    sioSerialRetryLater(port, sioNowNs());
+}
+
+/**
+ * Opens a port's server socket and serial device.  A serial device that 
+ * isn't there yet is waited for like one that was unplugged. 
+ * 
+ * @return int 0 on success, -1 on failure (nothing is left open)
+ */
+static int sioPortOpen(struct SioPort *port)
+{
+    /* open the server socket */
+    port->listenEv.fd = sioTioSocketInit(port->tcpPort, &port->addressFamily,
+        port->unixSocketPath, port->seqpacket);
+    if (port->listenEv.fd < 0) {
+        /* open failed, can't continue */
+        LogMsg(LOG_ERR, "[SIO] could not open server socket\n");
+        return -1;
+    }
+
+    port->listenEv.handler = sioOnListen;
+    port->listenEv.ctx = port;
+    port->serialEv.handler = port->raw ? sioOnSerialRaw : sioOnSerial;
+    port->serialEv.ctx = port;
+    if ((sioSetNonBlocking(port->listenEv.fd) < 0) ||
+        (sioEventAdd(&port->listenEv, EPOLLIN) < 0)) {
+        sioEventDel(&port->listenEv);
+        close(port->listenEv.fd);
+        port->listenEv.fd = -1;
+        return -1;
+    }
+
+    sioHotplugWatch(port);
+    if (sioSerialOpen(port) < 0) {
+        if (port->useStdio) {
+            sioEventDel(&port->listenEv);
+            close(port->listenEv.fd);
+            port->listenEv.fd = -1;
+            return -1;
+        }
+        LogMsg(LOG_WARNING, "[SIO] could not open serial port %s, "
+            "waiting for it\n", port->serialName);
+        sioSerialRetryLater(port, sioNowNs());
+    }
+    return 0;
+}
+
+/* closes everything a port has open; its queued serial output is dropped */
+static void sioPortClose(struct SioPort *port)
+{
+    sioClientCloseAll(port);
+    if (port->serialEv.fd >= 0) {
+        sioEventDel(&port->serialEv);
+        if (!port->useStdio) {
+            sioTtyClose(port);
+        }
+        port->serialEv.fd = -1;
+    }
+    if (port->listenEv.fd >= 0) {
+        sioEventDel(&port->listenEv);
+        close(port->listenEv.fd);
+        port->listenEv.fd = -1;
+
+        if (port->tcpPort == 0) {
+            /* best effort removal of socket */
+            const int rv = unlink(port->unixSocketPath);
+            if (rv == 0) {
+                LogMsg(LOG_INFO, "[SIO] socket file %s unlinked\n",
+                    port->unixSocketPath);
+            } else {
+                LogMsg(LOG_INFO, "[SIO] socket file %s unlink failed\n",
+                    port->unixSocketPath);
+            }
+        }
+    }
+    sioQueueClear(&port->ttyOut);
+    sioCacheFree(port);
+    sioPipelineFree(port);
+    sioRawClose(port);
+}
+
+/**
+ * Handles a serial device whose read failed.  It is reopened at once if 
+ * it had been up for a while; if it is gone, as when a USB adapter is 
+ * unplugged or re-enumerates, the port keeps its clients and holds their 
+ * output in its serial queue until the device node comes back. 
+ */
+static void sioPortReopen(struct SioPort *port)
+{
+    const uint64_t now = sioNowNs();
+
+    if (port->useStdio) {
+        /* don't try to reopen stdin/stdout */
+        keepGoing = 0;
+        return;
+    }
+
+    sioTtyClose(port);
+    if (now - port->openedAt >= SIO_RETRY_MAX_MS * 1000000ULL) {
+        /* a device failing right after it was opened is not retried at once */
+        port->retryMs = 0;
+        if (sioSerialOpen(port) == 0) {
+            return;
+        }
+    }
+    LogMsg(LOG_WARNING, "[SIO] port %d: %s is gone, waiting for it\n",
+        port->index, port->ttyName);
+    sioSerialRetryLater(port, now);
+}
+
+/* the epoll timeout until the earliest reopen, request timeout or pace */
+static int sioNextTimeout(const struct SioPort *ports, int portCount)
+{
+    const uint64_t now = sioNowNs();
+    int timeoutMs = -1;
+    int i;
+
+    /* reopen, pipeline, profile and pace deadlines of every port */
+    for (i = 0 ; i < portCount * 4 ; i++) {
+        const struct SioPort *port = &ports[i % portCount];
+        const uint64_t at = (i < portCount) ? port->reopenAt :
+            (i < portCount * 2) ? sioPipelineDeadline(port) :
+            (i < portCount * 3) ? sioProfileDeadline(port) : port->paceAt;
+        int ms;
+
+        if (at == 0) {
+            continue;
+        }
+        ms = (at > now) ? (int)((at - now + 999999) / 1000000) : 0;
+        if ((timeoutMs < 0) || (ms < timeoutMs)) {
+            timeoutMs = ms;
+        }
+    }
+    return timeoutMs;
+}
+
 /**
  * This is the main loop function.  It opens and configures the 
- * serial port (or pty) and opens the socket (TCP or Unix 
- * domain) and enters a select loop waiting for connections. 
+ * serial port (or pty) and the socket (TCP or Unix domain) of 
+ * every port and runs one epoll loop dispatching to a handler 
+ * for each server socket, connected client and serial port. 
  * 
- * @param serialName the name of the serial device to open or 0 
- *                   to use a pty
- * @param useStdio non-zero indicates that stdin and stdout should be used for 
- *                 instead of a serial device
- * @param tcpPort if non-zero, the port number to open for 
- *                accepting connections from the tio-agent; if
- *                zero, uses a hard-coded named Unix domain
- *                socket
- * @param unixSocketPath the file system path to use for a Unix domain socket; 
- *                       0 means use TCP
+ * @param ports the ports to bridge, each with its serial device and the 
+ *              socket its tio-agents connect to
+ * @param portCount the number of entries in ports
  */
-static void sioAgent(const char *serialName, int useStdio,
-    unsigned short tcpPort, const char *unixSocketPath)
+static void sioAgent(struct SioPort *ports, int portCount)
 {
-    fd_set currFdSet;
-    int connectedFd = -1;  /* not currently connected */
+    int opened = 0;
+    int i;
 
     {
         /* install a signal handler to remove the socket file */
         struct sigaction a;
         memset(&a, 0, sizeof(a));
         a.sa_handler = sioInterruptHandler;
-        if (sigaction(SIGINT, &a, 0) != 0) {
+        if ((sigaction(SIGINT, &a, 0) != 0) ||
+            (sigaction(SIGTERM, &a, 0) != 0)) {
             LogMsg(LOG_ERR, "[SIO] sigaction() failed, errno = %d\n", errno);
             exit(1);
         }
+
+        /* SIGUSR1 logs the latency histograms */
+        a.sa_handler = sioDumpHandler;
+        sigaction(SIGUSR1, &a, 0);
+
+        /* SIGHUP rereads the --config file */
+        a.sa_handler = sioReloadHandler;
+        sigaction(SIGHUP, &a, 0);
+
+        /* a vanished client shows up as EPIPE from writev() instead */
+        a.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &a, 0);
     }
 
-    /* open the server socket */
-    int addressFamily = 0;
-    const int listenFd = sioTioSocketInit(tcpPort, &addressFamily,
-        unixSocketPath);
-    if (listenFd < 0) {
-        /* open failed, can't continue */
-        LogMsg(LOG_ERR, "[SIO] could not open server socket\n");
+    if ((sioEventInit() < 0) || (sioJitterStart() < 0)) {
         return;
     }
 
-    FD_ZERO(&currFdSet);
-    FD_SET(listenFd, &currFdSet);
+    for (i = 0 ; i < portCount ; i++) {
+        ports[i].listenEv.fd = -1;
+        ports[i].serialEv.fd = -1;
+        ports[i].watch = -1;
+    }
+    for (i = 0 ; i < portCount ; i++) {
+        if (sioPortOpen(&ports[i]) < 0) {
+            /* every port is opened or none, as with a single port */
+            break;
+        }
+        opened++;
+    }
 
-    /* execution remains in this loop until a fatal error or SIGINT */
-    keepGoing = 1;
+    /* 
+     * Wait for characters to be received on the serial/pty descriptors 
+     * and on either a listen socket (meaning an incoming connection 
+     * is queued) or on a connected socket descriptor. 
+     * Execution remains in this loop until a fatal error or SIGINT; a 
+     * port whose device is missing waits for it with its clients still 
+     * connected. 
+     */
+    keepGoing = (opened == portCount);
     while (keepGoing) {
-        int nfds = 0;
-        off_t serialPos = 0;
-        char ttyBuff[SIO_BUFFER_SIZE];
-        struct FdPair serialFds;
-
-        if (useStdio) {
-            serialFds.inFd = fileno(stdin);
-            serialFds.outFd = fileno(stdout);
-            serialFds.maxFd = max(serialFds.inFd, serialFds.outFd);
-        } else {
-            /* try opening the serial device */
-            serialFds.inFd = sioTtyInit(serialName);
-            if (serialFds.inFd < 0) {
-                /* open failed, can't continue */
-                LogMsg(LOG_ERR, "[SIO] could not open serial port %s\n", serialName);
+        if (sioEventRun(sioNextTimeout(ports, portCount)) < 0) {
+            if (errno != EINTR) {
+                exit(1);
+            } else if (!keepGoing) {
                 break;
-            } else {
-                serialFds.outFd = serialFds.maxFd = serialFds.inFd;
             }
         }
+        sioClientReap();
 
-        FD_SET(serialFds.inFd, &currFdSet);
-        if (serialFds.inFd != serialFds.outFd) {
-            FD_SET(serialFds.outFd, &currFdSet);
-        }
-        nfds = max(serialFds.maxFd,
-            (connectedFd >= 0) ? connectedFd : listenFd) + 1;
-
-        /* 
-         * This is the select loop which waits for characters to be received on 
-         * the serial/pty descriptor and on either the listen socket (meaning 
-         * an incoming connection is queued) or on a connected socket 
-         * descriptor.
-         */
-        while (1) {
-            /* wait indefinitely for someone to blink */
-            fd_set readFdSet = currFdSet;
-            const int sel = select(nfds, &readFdSet, 0, 0, 0);
-
-            if (sel == -1) {
-                if (errno == EINTR) {
-                    break;  /* drop out of inner while */
-                } else {
-                    LogMsg(LOG_ERR, "[SIO] select() returned -1, errno = %d\n", errno);
-                    exit(1);
-                }
-            } else if (sel <= 0) {
-                continue;
+        for (i = 0 ; i < portCount ; i++) {
+            if (ports[i].serialFailed) {
+                ports[i].serialFailed = 0;
+                sioPortReopen(&ports[i]);
+            } else if ((ports[i].reopenAt != 0) &&
+                (ports[i].reopenAt <= sioNowNs())) {
+                sioSerialRetry(&ports[i]);
             }
-
-            /* check for a new connection to accept */
-            if (FD_ISSET(listenFd, &readFdSet)) {
-                /* new connection is here, accept it */
-                connectedFd = sioTioSocketAccept(listenFd, addressFamily);
-                if (connectedFd >= 0) {
-                    FD_CLR(listenFd, &currFdSet);
-                    FD_SET(connectedFd, &currFdSet);
-                    nfds = max(serialFds.maxFd, connectedFd) + 1;
-                }
-            }
-
-            /* check for packet received on the client socket */
-            if ((connectedFd >= 0) && FD_ISSET(connectedFd, &readFdSet)) {
-                /* connected tio_agent has something to relay to serial port */
-                char msgBuff[SIO_BUFFER_SIZE];
-                const int readCount = sioTioSocketRead(connectedFd, msgBuff,
-                    sizeof(msgBuff));
-                if (readCount < 0) {
-                    FD_CLR(connectedFd, &currFdSet);
-                    FD_SET(listenFd, &currFdSet);
-                    nfds = max(serialFds.maxFd, listenFd) + 1;
-                    connectedFd = -1;
-                } else if (readCount > 0) {
-                    sioTtyWrite(serialFds.outFd, msgBuff, readCount);
-                }
+            if ((sioPipelineExpire(&ports[i], sioNowNs()) > 0) ||
+                ((ports[i].paceAt != 0) && (ports[i].paceAt <= sioNowNs()))) {
+                sioSerialFlush(&ports[i]);
             }
+            sioProfileFlush(&ports[i], sioNowNs());
+        }
 
-            /* check for a character on the serial port */
-            if (FD_ISSET(serialFds.inFd, &readFdSet)) {
-                /* 
-                 * serial port has something to send to the tio_agent,
-                 * if connected 
-                 */
-                int serialRet = sioTtyRead(serialFds.inFd, ttyBuff,
-                    sizeof(ttyBuff), &serialPos);
-                if (serialRet < 0) {
-                    /* fall out of this loop to reopen serial port or pts */
-                    break;
-                } else if ((serialRet > 0) && (connectedFd >= 0)) {
-                    sioTioSocketWrite(connectedFd, ttyBuff);
-                }
-            }
+        if (reloadRequested) {
+            reloadRequested = 0;
+            sioConfigReload(ports, portCount);
         }
 
-        if (useStdio) {
-            /* don't try to reopen stdin/stdout */
-            keepGoing = 0;
-        } else {
-            close(serialFds.inFd);
-            FD_CLR(serialFds.inFd, &currFdSet);
+        if (dumpRequested) {
+            dumpRequested = 0;
+            sioLatencyDump();
+            sioCacheDump();
+            sioPipelineDump();
         }
     }
 
     LogMsg(LOG_INFO, "[SIO] cleaning up\n");
 
-    if (connectedFd >= 0) {
-        close(connectedFd);
-    }
-    if (listenFd >= 0) {
-        close(listenFd);
-    }
-
-    if (tcpPort == 0) {
-        /* best effort removal of socket */
-        const int rv = unlink(unixSocketPath);
-        if (rv == 0) {
-            LogMsg(LOG_INFO, "[SIO] socket file %s unlinked\n", unixSocketPath);
-        } else {
-            LogMsg(LOG_INFO, "[SIO] socket file %s unlink failed\n", unixSocketPath);
-        }
+    for (i = 0 ; i < portCount ; i++) {
+        sioPortClose(&ports[i]);
     }
+    sioClientReap();
+    sioHotplugClose();
+    sioJitterStop();
+    sioEventClose();
+    sioClientReap();    /* those io_uring had operations for */
 }
@@ -1,8 +1,32 @@
 #ifndef SIO_AGENT_H
 #define SIO_AGENT_H
 
+#include <stdint.h>
 #include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "sio_shm.h"
+
+#define SIO_DEFAULT_AGENT_PORT 7880
+#define SIO_AGENT_UNIX_SOCKET "/tmp/sioSocket"
+#define SIO_DEFAULT_SERIAL_DEVICE "/dev/ttyUSB0"
+#define SIO_DEFAULT_SERIAL_RATE 115200
+#define SIO_DEFAULT_VMIN 1
+#define SIO_DEFAULT_VTIME 5
+#define SIO_RS485_DELAY_MAX_MS 100      /* the kernel clamps longer delays */
+
+#define SIO_BUFFER_SIZE 2048
+#define SIO_MAX_CLIENTS 32
+#define SIO_MAX_PORTS 32
+#define SIO_SUB_MAX 16                  /* subscriptions per client */
+#define SIO_SUB_PATTERN_MAX 64
+#define SIO_DEFAULT_QUEUE_MAX (256 * 1024)
+#define SIO_DEFAULT_LINE_MAX SIO_BUFFER_SIZE
+#define SIO_DEFAULT_BATCH_MAX (4 * SIO_BUFFER_SIZE)
 
 /* types */
 struct FdPair {
@@ -11,32 +35,561 @@ struct FdPair {
     int maxFd;
 };
 
+/*
+ * A descriptor registered with the event loop.  The record is owned by the
+ * caller and handed back to its handler when the descriptor is ready.
+ */
+struct SioEvent;
+typedef void (*SioEventHandler)(struct SioEvent *ev, unsigned int events);
+
+struct SioEvent {
+    int fd;
+    unsigned int events;        /* registered EPOLL* mask, 0 if not added */
+    SioEventHandler handler;
+    void *ctx;
+};
+
+/*
+ * An operation submitted to io_uring, see sio_uring.c.  The record is
+ * owned by the caller, normally embedded in the object the operation works
+ * for; the handler gets the result and flags of each completion.
+ */
+struct SioUringOp;
+typedef void (*SioUringHandler)(struct SioUringOp *op, int res,
+    unsigned int flags);
+
+struct SioUringOp {
+    SioUringHandler handler;
+    int pending;                /* a completion is still to come */
+};
+
+/*
+ * A message shared by the output queues of every client it is sent to; it
+ * is freed when the last reference is released.
+ */
+struct SioBuf {
+    unsigned int refs;
+    unsigned int len;
+    uint64_t stamp;             /* when it entered the agent, 0 if unknown */
+    char data[];
+};
+
+/* takes queued messages as writev() would, see sioQueueFlushTo() */
+typedef ssize_t (*SioQueueWriter)(void *ctx, const struct iovec *iov,
+    int count);
+
+/* what a bounded output queue does when a message would exceed its cap */
+enum SioQueuePolicy {
+    SIO_QUEUE_DROP_OLDEST,
+    SIO_QUEUE_DROP_NEWEST,
+    SIO_QUEUE_DISCONNECT
+};
+
+/* flow control on the serial line, see sioTtySetFlow() */
+enum SioFlow {
+    SIO_FLOW_NONE,
+    SIO_FLOW_RTSCTS,
+    SIO_FLOW_XONXOFF
+};
+
+/* the serial line settings a configuration reload can change */
+struct SioTtySettings {
+    unsigned int rate;
+    int rs485;
+    unsigned int vmin;
+    unsigned int vtime;
+    int lowLatency;
+    int flow;                   /* an enum SioFlow */
+    unsigned int rtsBeforeMs;
+    unsigned int rtsAfterMs;
+};
+
+/* what sioCacheRequest() wants done with a client line */
+enum SioCacheResult {
+    SIO_CACHE_FORWARD,          /* send it to the device */
+    SIO_CACHE_HIT,              /* answer it from the cache */
+    SIO_CACHE_MERGED            /* the same request is already pending */
+};
+
+/*
+ * Latency histogram with log-linear buckets: exact below SIO_HIST_SUB ns,
+ * then SIO_HIST_SUB / 2 buckets per power of two up to 2^40 ns.
+ */
+#define SIO_HIST_SUB_BITS 6
+#define SIO_HIST_SUB (1 << SIO_HIST_SUB_BITS)
+#define SIO_HIST_SHIFTS (40 - SIO_HIST_SUB_BITS + 1)
+#define SIO_HIST_BUCKETS ((SIO_HIST_SHIFTS + 1) * (SIO_HIST_SUB / 2))
+
+struct SioHistogram {
+    const char *name;
+    unsigned long count;
+    uint64_t max;
+    unsigned long buckets[SIO_HIST_BUCKETS];
+};
+
+/* output queue of one endpoint: a growable ring of shared messages */
+struct SioQueue {
+    struct SioBuf **ring;
+    unsigned int size;          /* number of slots, a power of two */
+    unsigned int head;          /* next free slot */
+    unsigned int tail;          /* oldest queued message */
+    unsigned int offset;        /* bytes of the oldest message already sent */
+    unsigned int pinned;        /* oldest messages a send in flight reads */
+    size_t bytes;               /* bytes still to be written */
+    uint64_t consumed;          /* bytes that left the queue, written or dropped */
+    size_t maxBytes;            /* cap on bytes, 0 for unlimited */
+    int policy;                 /* an enum SioQueuePolicy */
+    unsigned long dropMsgs;
+    unsigned long dropBytes;
+    struct SioHistogram *latency;   /* delivery latency, 0 to skip */
+};
+
+/*
+ * Input assembler of one client.  Complete lines collect in [0, done) and
+ * go to the serial port together; [done, len) is a partial line waiting
+ * for the rest of it.
+ */
+struct SioLineBuf {
+    char *data;
+    unsigned int size;          /* bytes allocated, the largest batch */
+    unsigned int len;           /* bytes held */
+    unsigned int done;          /* end of the last complete line */
+    unsigned int scan;          /* first byte not yet searched for CR/LF */
+    unsigned int maxLine;       /* longer lines are dropped */
+    int discard;                /* skipping the rest of an overlong line */
+};
+
+/* a connected tio-agent client */
+struct SioClient {
+    struct SioEvent ev;         /* ev.ctx points back to the client */
+    struct SioClient *next;
+    struct SioPort *port;       /* the port the client is bridged to */
+    struct SioQueue out;
+    struct SioLineBuf in;
+    int framed;                 /* receives frames, see sio_frame.c */
+    struct SioShmLink *shm;     /* 0 unless switched to sio_shm.c */
+    struct SioUringLink *uring; /* 0 unless on io_uring, see sio_client.c */
+    uint32_t subBit;            /* 0 unless filtered, see sio_subscribe.c */
+    int subCount;
+    char *sub[SIO_SUB_MAX];     /* "^" starts a prefix */
+};
+
+/*
+ * Receive ring for one serial port.  The indices run freely and are masked
+ * with SIO_TTY_RING_SIZE - 1 on access, so the size must be a power of two.
+ * Bytes in [tail, scan) are known to hold no line terminator.
+ */
+#define SIO_TTY_RING_SIZE (2 * SIO_BUFFER_SIZE)
+
+struct SioTtyRing {
+    unsigned int head;      /* next free byte */
+    unsigned int tail;      /* first byte of the oldest unconsumed line */
+    unsigned int scan;      /* first byte not yet searched for CR/LF */
+    unsigned int lineLen;   /* length of the partial line (local echo only) */
+    char data[SIO_TTY_RING_SIZE];
+};
+
+/* a request outstanding on a serial link, see sio_pipeline.c */
+#define SIO_PIPELINE_MAX 64
+
+struct SioPipeReq {
+    struct SioClient *client;   /* 0 once the client is gone */
+    int rule;                   /* reply rule, -1 when matched by order */
+    uint64_t lineEnd;           /* ttyOut consumed count past its line */
+    uint64_t sentAt;            /* ns, 0 while the line is still queued */
+};
+
+struct SioPipeWait;
+
+struct SioPipeline {
+    struct SioPipeReq inFlight[SIO_PIPELINE_MAX];   /* oldest first */
+    unsigned int count;
+    struct SioPipeWait *waitHead;   /* lines held until there is room */
+    struct SioPipeWait *waitTail;
+    size_t waitBytes;
+};
+
+/* pipe used to splice() one direction of a raw port */
+struct SioRawPipe {
+    int fd[2];
+    int state;                  /* 0 not open yet, 1 open, -1 not usable */
+};
+
+/* the cached answer of one cache entry on one port */
+#define SIO_CACHE_MAX 16
+
+struct SioCacheSlot {
+    char *value;                /* the last answer, 0 if none */
+    size_t valueLen;
+    uint64_t stamp;             /* when value was received */
+    uint64_t pendingSince;      /* when the request went out, 0 if idle */
+};
+
+/*
+ * One serial port bridged to its own listening socket.  Everything the
+ * bridge keeps per port lives here so a single event loop can drive all of
+ * them; the event records point back to the port through their ctx.
+ */
+struct SioPort {
+    int index;                  /* position on the command line */
+    const char *serialName;     /* device to open, 0 for a pty */
+    int useStdio;               /* stdin and stdout instead of a device */
+    unsigned short tcpPort;     /* 0 to listen on unixSocketPath */
+    const char *unixSocketPath;
+    int addressFamily;
+    int seqpacket;              /* Unix listener is SOCK_SEQPACKET */
+    struct SioEvent listenEv;
+    struct SioEvent serialEv;   /* fd is -1 while the device is closed */
+    int serialOutFd;
+    int serialFailed;           /* read failed, reopen from the main loop */
+    struct SioUringOp readOp;   /* see sioTtyReadAsync() */
+    SioEventHandler readDone;   /* 0 unless read through io_uring */
+    int readStale;              /* readOp reads a device closed since */
+    uint64_t reopenAt;          /* ns, next open attempt, 0 while open */
+    uint64_t openedAt;          /* ns, when the device was last opened */
+    unsigned int retryMs;       /* current reopen backoff */
+    int watch;                  /* inotify watch on the device's directory */
+
+    /* serial settings, see sioTtySetParams() */
+    int localEcho;
+    unsigned int rate;
+    int rs485;
+    unsigned int vmin;          /* termios VMIN, bytes */
+    unsigned int vtime;         /* termios VTIME, tenths of a second */
+    int lowLatency;             /* set ASYNC_LOW_LATENCY on the UART */
+    int flow;                   /* an enum SioFlow */
+    unsigned int rtsBeforeMs;   /* RS-485 delay_rts_before_send */
+    unsigned int rtsAfterMs;    /* RS-485 delay_rts_after_send */
+    char ttyName[64];           /* device or pts opened last, "" for stdio */
+    int raw;                    /* pass bytes through, see sio_raw.c */
+    struct SioRawPipe rawRx;    /* device to client */
+    struct SioRawPipe rawTx;    /* client to device */
+
+    struct SioTtyRing ring;
+    struct SioQueue ttyOut;
+    unsigned int pacePercent;   /* of the line rate, 0 to write freely */
+    unsigned int paceGapUs;     /* idle time between writes, see sio_pace.c */
+    uint64_t paceAt;            /* ns, when held output may go, or 0 */
+    uint64_t paceWireAt;        /* ns, when the line should run idle */
+    uint64_t flowBlockedAt;     /* ns, since when flow control holds output */
+    uint64_t flowBlockedNs;     /* in total */
+    unsigned long flowStalls;
+    struct SioClient *clients;
+    int clientCount;
+    int framedCount;            /* clients that receive frames */
+    uint32_t frameSeq;          /* of the next line sent in a frame */
+    int coalesce;               /* adaptive profile is holding output */
+    uint64_t flushAt;           /* ns, when held output is written, or 0 */
+    uint64_t rateStart;         /* ns, start of the rate sample */
+    unsigned int rateLines;     /* lines sent in the rate sample */
+    struct SioCacheSlot cache[SIO_CACHE_MAX];
+    struct SioPipeline pipe;
+    uint32_t subBits;           /* subBit of every filtered client */
+    uint32_t subAsking;         /* subBit of the clients being answered */
+    int subAnswered;            /* the device has spoken since they asked */
+    struct SioSubMatcher *sub;  /* their patterns, compiled, or 0 */
+};
+
+/*
+ * Capture ring file: a SioCaptureHeader followed by dataSize bytes of
+ * records.  head and tail are logical byte offsets that only grow; a record
+ * lives at offset % dataSize, starts on a 16 byte boundary and is followed
+ * by its len bytes of data.  Each time the agent opens the file it writes a
+ * SIO_CAPTURE_CLOCK record, as the monotonic clock restarts with a reboot;
+ * the records after it are timed against its bases.
+ */
+#define SIO_CAPTURE_MAGIC 0x31504143u     /* "CAP1" */
+#define SIO_CAPTURE_DEFAULT_SIZE (4 * 1024 * 1024)
+
+enum SioCaptureDir {
+    SIO_CAPTURE_PAD,            /* filler up to the end of the ring */
+    SIO_CAPTURE_SERIAL_RX,      /* a line received from the serial port */
+    SIO_CAPTURE_SOCKET_RX,      /* a chunk received from a client */
+    SIO_CAPTURE_CLOCK           /* a SioCaptureClock, the agent (re)started */
+};
+
+struct SioCaptureHeader {
+    uint32_t magic;
+    uint32_t headerSize;
+    uint64_t dataSize;
+    uint64_t head;              /* end of the newest record */
+    uint64_t tail;              /* start of the oldest record */
+    uint64_t monoBase;          /* CLOCK_MONOTONIC ns for the records at tail */
+    uint64_t realBase;          /* CLOCK_REALTIME ns at the same moment */
+    uint64_t reserved[2];
+};
+
+/* the data of a SIO_CAPTURE_CLOCK record */
+struct SioCaptureClock {
+    uint64_t monoBase;          /* CLOCK_MONOTONIC ns when the agent started */
+    uint64_t realBase;          /* CLOCK_REALTIME ns at the same moment */
+};
+
+struct SioCaptureRecord {
+    uint32_t len;
+    uint16_t dir;               /* an enum SioCaptureDir */
+    uint16_t channel;           /* client descriptor for socket records */
+    uint64_t timestamp;         /* CLOCK_MONOTONIC ns */
+};
+
+/*
+ * Framed output, for clients that asked for it with "sio.framed".  Each
+ * frame is a SioFrameHeader followed by count records; a record is a
+ * SioFrameRecord followed by its len bytes of data, padded to the next 8
+ * byte boundary.  Fields are in host byte order.
+ */
+#define SIO_FRAME_MAGIC 0x31524653u       /* "SFR1" */
+#define SIO_FRAME_MAX (64 * 1024)
+
+enum SioFrameFlags {
+    SIO_FRAME_DIRECT = 1        /* for this client only, record seq is 0 */
+};
+
+struct SioFrameHeader {
+    uint32_t magic;
+    uint32_t len;               /* bytes of records after the header */
+    uint16_t count;             /* number of records */
+    uint16_t flags;             /* enum SioFrameFlags */
+    uint32_t reserved;
+};
+
+struct SioFrameRecord {
+    uint32_t len;
+    uint32_t seq;               /* per port, one more for every line */
+    uint64_t timestamp;         /* CLOCK_MONOTONIC ns the line was read */
+};
+
+static inline uint64_t sioNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* functions defined in sio_event.c */
+void sioEventSetUring(int enable);
+int sioEventInit(void);
+uint64_t sioEventTime(void);
+void sioEventClose(void);
+int sioSetNonBlocking(int fd);
+int sioWriteAll(int fd, const char *buff, size_t len);
+int sioEventAdd(struct SioEvent *ev, unsigned int events);
+int sioEventMod(struct SioEvent *ev, unsigned int events);
+void sioEventDel(struct SioEvent *ev);
+int sioEventRun(int timeoutMs);
+
+/* functions defined in sio_uring.c */
+int sioUringInit(int epollFd);
+void sioUringClose(void);
+int sioUringWait(int timeoutMs);
+int sioUringDispatch(void);
+int sioUringFixed(int index, void *data, size_t len);
+int sioUringRead(struct SioUringOp *op, int fd, void *buff, size_t len,
+    int fixed);
+int sioUringRecv(struct SioUringOp *op, int fd);
+const char *sioUringBuffer(unsigned int flags);
+void sioUringRecycle(unsigned int flags);
+int sioUringSend(struct SioUringOp *op, int fd, const struct msghdr *msg);
+void sioUringCancel(struct SioUringOp *op);
+int sioUringBusy(const struct SioUringOp *op);
+
 /* functions defined in sio_socket.c */
 int sioTioSocketInit(unsigned short port, int *addressFamily,
-    const char *unixSocketPath);
+    const char *unixSocketPath, int seqpacket);
 int sioTioSocketAccept(int serverFd, int addressFamily);
-int sioTioSocketRead(int newFd, char *msgBuff, size_t bufferSize);
-void sioTioSocketWrite(int socketFd, const char *buff);
+int sioTioSocketRead(int socketFd, struct SioLineBuf *in);
+ssize_t sioTioSocketWrite(int socketFd, struct SioQueue *out);
+int sioTioSocketReadPackets(int socketFd, unsigned int maxLine, char **lines,
+    int *closed);
+ssize_t sioTioSocketWritePackets(int socketFd, struct SioQueue *out);
+
+/* functions defined in sio_hotplug.c */
+int sioHotplugWatch(struct SioPort *port);
+void sioHotplugClose(void);
+
+/* functions defined in sio_raw.c */
+int sioRawFromSerial(struct SioPort *port);
+int sioRawFromClient(struct SioClient *client);
+void sioRawClose(struct SioPort *port);
+
+/* functions defined in sio_baud.c */
+int sioTtyParseRate(const char *arg, unsigned int *baudRate);
+int sioTtySetCustomRate(int fd, unsigned int rate);
+
+/* functions defined in sio_queue.c */
+struct SioBuf *sioBufAlloc(const char *data, size_t len);
+void sioBufRelease(struct SioBuf *buf);
+int sioQueueParse(const char *arg, size_t *maxBytes, int *policy);
+int sioQueueInit(struct SioQueue *q, size_t maxBytes, int policy);
+void sioQueueClear(struct SioQueue *q);
+void sioQueueDropped(struct SioQueue *q, size_t len);
+void sioQueueFree(struct SioQueue *q);
+int sioQueuePush(struct SioQueue *q, struct SioBuf *buf);
+ssize_t sioQueueFlush(struct SioQueue *q, int fd);
+ssize_t sioQueueFlushTo(struct SioQueue *q, SioQueueWriter writer, void *ctx);
+unsigned int sioQueueIov(const struct SioQueue *q, struct iovec *iov,
+    unsigned int max);
+void sioQueueConsume(struct SioQueue *q, size_t cnt);
+void sioQueueTotals(unsigned long *dropMsgs, unsigned long *dropBytes);
+
+/* functions defined in sio_line.c */
+size_t sioFindEol(const char *p, size_t n);
+int sioLineBufInit(struct SioLineBuf *lb, unsigned int maxLine,
+    unsigned int maxBatch);
+void sioLineBufFree(struct SioLineBuf *lb);
+unsigned int sioLineAssemble(struct SioLineBuf *lb);
+void sioLineBufConsume(struct SioLineBuf *lb);
+
+/* functions defined in sio_client.c */
+void sioClientSetQueueParams(size_t maxBytes, int policy);
+void sioClientSetLineParams(unsigned int maxLine, unsigned int maxBatch);
+struct SioClient *sioClientAdd(struct SioPort *port, int fd,
+    SioEventHandler handler);
+int sioClientUring(struct SioClient *client,
+    int (*input)(struct SioClient *client, int readCount));
+void sioClientClose(struct SioClient *client);
+void sioClientReap(void);
+void sioClientCloseAll(struct SioPort *port);
+int sioClientFlush(struct SioClient *client);
+int sioClientSend(struct SioClient *client, const char *msg, size_t len);
+void sioClientBroadcast(struct SioPort *port, const char *msg, size_t len);
+void sioClientBroadcastFrame(struct SioPort *port, struct SioBuf *buf);
+void sioClientUpdateQueues(struct SioPort *port);
 
 /* functions in sio_serial.c */
-void sioTtySetParams(int localEcho, unsigned int serialRate, int enableRS485);
-int sioTtyInit(const char *tty_dev);
-int sioTtyRead(int fd, char *msgBuff, size_t bufSize, off_t *currPos);
-void sioTtyWrite(int serialFd, const char *msgBuff, int buffSize);
+void sioTtySetParams(struct SioPort *port, int localEcho,
+    unsigned int serialRate, int enableRS485);
+void sioTtySetTiming(struct SioPort *port, unsigned int vmin,
+    unsigned int vtime, int lowLatency);
+void sioTtySetFlow(struct SioPort *port, int flow, unsigned int rtsBeforeMs,
+    unsigned int rtsAfterMs);
+int sioTtyParseFlow(const char *arg, int *flow);
+int sioTtyParseDelay(const char *arg, unsigned int *beforeMs,
+    unsigned int *afterMs);
+int sioTtyInit(struct SioPort *port);
+void sioTtyGetSettings(const struct SioPort *port, struct SioTtySettings *s);
+int sioTtyReconfigure(struct SioPort *port, const struct SioTtySettings *s);
+void sioTtyClose(struct SioPort *port);
+int sioTtyStatus(const struct SioPort *port, char *buff, size_t size);
+void sioTtyRingReset(struct SioTtyRing *ring);
+int sioTtyRead(struct SioPort *port);
+int sioTtyReadAsync(struct SioPort *port, SioEventHandler done);
+int sioTtyNextLine(struct SioTtyRing *ring, char *msgBuff, size_t bufSize);
+int sioTtySetQueueParams(struct SioPort *port, size_t maxBytes, int policy);
+int sioTtyWrite(struct SioPort *port, const char *msgBuff, int buffSize);
+ssize_t sioTtyFlush(struct SioPort *port);
+
+/* functions defined in sio_frame.c */
+int sioFrameNegotiate(struct SioClient *client, const char *line, size_t len);
+void sioFrameAppend(struct SioPort *port, const char *line, size_t len);
+void sioFrameFlush(void);
+struct SioBuf *sioFrameDirect(const char *msg, size_t len);
+
+/* functions defined in sio_profile.c */
+int sioProfileSetup(const char *arg);
+void sioProfileAccept(int fd, int addressFamily);
+void sioProfileCount(struct SioPort *port);
+int sioProfileDefer(struct SioClient *client);
+uint64_t sioProfileDeadline(const struct SioPort *port);
+void sioProfileFlush(struct SioPort *port, uint64_t now);
+
+/* functions defined in sio_pace.c */
+int sioPaceParse(const char *arg, unsigned int *percent, unsigned int *gapUs);
+void sioPaceSet(struct SioPort *port, unsigned int percent, unsigned int gapUs);
+ssize_t sioPaceFlush(struct SioPort *port);
+void sioFlowAccount(struct SioPort *port, int refused);
+
+/* functions defined in sio_realtime.c */
+int sioRealtimeSetup(const char *arg);
+int sioJitterSetup(const char *arg);
+void sioRealtimeStart(void);
+int sioJitterStart(void);
+void sioJitterStop(void);
+
+/* functions defined in sio_config.c */
+int sioConfigLoad(const char *path, struct SioPort *ports, int portCount);
+void sioConfigReload(struct SioPort *ports, int portCount);
+
+/* functions defined in sio_shm.c */
+int sioShmNegotiate(struct SioClient *client, const char *line, size_t len,
+    SioEventHandler onWake);
+int sioShmReceive(struct SioClient *client);
+int sioShmFlush(struct SioClient *client);
+void sioShmDetach(struct SioClient *client);
+
+/* functions defined in sio_subscribe.c */
+int sioSubRequest(struct SioClient *client, const char *line, size_t len);
+void sioSubDetach(struct SioClient *client);
+void sioSubAsked(struct SioClient *client);
+uint32_t sioSubAnswer(struct SioPort *port);
+uint32_t sioSubMatch(const struct SioPort *port, const char *line, size_t len);
+
+/* functions defined in sio_capture.c */
+int sioCaptureOpen(const char *path, size_t size);
+void sioCaptureClose(void);
+void sioCaptureRecord(int dir, int channel, const char *data, size_t len);
+const struct SioCaptureHeader *sioCaptureMap(const char *path,
+    size_t *mapSize);
+const struct SioCaptureRecord *sioCaptureNext(
+    const struct SioCaptureHeader *h, uint64_t *pos);
+
+/* functions defined in sio_cache.c */
+int sioCacheAdd(const char *arg);
+int sioCacheAddRule(const char *arg);
+int sioCacheRequest(struct SioPort *port, const char *line, size_t len,
+    const char **value, size_t *valueLen);
+void sioCacheReply(struct SioPort *port, const char *line, size_t len);
+void sioCacheFree(struct SioPort *port);
+void sioCacheTotals(unsigned long *hits, unsigned long *misses);
+void sioCacheDump(void);
+
+/* functions defined in sio_pipeline.c */
+int sioPipelineSetup(const char *arg);
+int sioPipelineAddRule(const char *arg);
+int sioPipelineEnabled(void);
+int sioPipelineSubmit(struct SioClient *client, const char *line, size_t len);
+int sioPipelineReply(struct SioPort *port, const char *line, size_t len);
+void sioPipelineWritten(struct SioPort *port, uint64_t now);
+uint64_t sioPipelineDeadline(const struct SioPort *port);
+int sioPipelineExpire(struct SioPort *port, uint64_t now);
+void sioPipelineDropClient(struct SioClient *client);
+void sioPipelineFree(struct SioPort *port);
+void sioPipelineDump(void);
+
+/* functions defined in sio_latency.c */
+extern struct SioHistogram sioLatencyToClient;
+extern struct SioHistogram sioLatencyToSerial;
+extern struct SioHistogram sioLatencyWakeup;
+void sioHistRecord(struct SioHistogram *h, uint64_t ns);
+uint64_t sioHistPercentile(const struct SioHistogram *h, double fraction);
+int sioHistFormat(const struct SioHistogram *h, char *buff, size_t size);
+void sioLatencyDump(void);
 
 /* functions defined in sio_local.c */
-char *sioHandleLocal(char *qmlString);
+int sioHandleLocal(struct SioPort *port, const char *line, size_t len,
+    char *reply, size_t size);
 
 /* functions exported from logmsg.c */
 void LogOpen(const char *ident, int logToSyslog, const char *logFilePath,
     int verboseFlag);
-void LogMsg(int level, const char *fmt, ...);
+void LogClose(void);
+void LogSetLevel(int level);
+int LogParseLevel(const char *name);
+void LogWrite(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
 
-#define SIO_DEFAULT_AGENT_PORT 7880
-#define SIO_AGENT_UNIX_SOCKET "/tmp/sioSocket"
-#define SIO_DEFAULT_SERIAL_DEVICE "/dev/ttyUSB0"
-#define SIO_DEFAULT_SERIAL_RATE 115200
+extern int logThreshold;
 
-#define SIO_BUFFER_SIZE 2048
+/*
+ * Logs a message at a syslog priority.  A message above logThreshold costs a
+ * compare: its arguments are not even evaluated.
+ */
+#define LogMsg(level, ...)                                  \
+    do {                                                    \
+        if (__builtin_expect((level) <= logThreshold, 0)) { \
+            LogWrite((level), __VA_ARGS__);                 \
+        }                                                   \
+    } while (0)
 
 #endif  /* SIO_AGENT_H */
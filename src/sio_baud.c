@@ -0,0 +1,54 @@
+/*
+ * Non-standard bit rates through termios2 and BOTHER.  struct termios2
+ * comes from the kernel headers, which clash with glibc's <termios.h>, so
+ * this is kept apart from sio_serial.c.
+ */
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "sio_agent.h"
+
+/**
+ * Parses a bit rate.  Any rate up to 16M is accepted here: rates termios
+ * has no constant for are set through termios2, and a driver that can't
+ * produce the rate fails when the port is opened.
+ */
+int sioTtyParseRate(const char *arg, unsigned int *baudRate)
+{
+    char *end;
+    const unsigned long n = strtoul(arg, &end, 10);
+
+    if ((end == arg) || (*end != '\0') || (n == 0) || (n > 16000000)) {
+        return -1;
+    }
+    *baudRate = n;
+    return 0;
+}
+
+/**
+ * Sets an arbitrary input and output bit rate on a serial device that has
+ * already been configured with tcsetattr().
+ *
+ * @param fd the serial device
+ * @param rate the bit rate
+ *
+ * @return int the rate the driver actually set, which may be rounded to
+ *         what its clock can divide down to, or -1 if it refused
+ */
+int sioTtySetCustomRate(int fd, unsigned int rate)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) < 0) {
+        return -1;
+    }
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = rate;
+    tio.c_ospeed = rate;
+    if ((ioctl(fd, TCSETS2, &tio) < 0) || (ioctl(fd, TCGETS2, &tio) < 0)) {
+        return -1;
+    }
+    return tio.c_ospeed;
+}
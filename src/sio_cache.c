@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sio_agent.h"
+
+/*
+ * Response cache for read-only device queries.  An entry names a request
+ * line and the prefix of the line the device answers it with.  Entries are
+ * shared by all ports but each port keeps its own answers in its cache
+ * slots.  An answer is kept for ttl and handed back to later askers without
+ * touching the serial port; while a request is on its way to the device,
+ * identical requests are swallowed since the answer goes to every client
+ * that asked anyway, subscribed or not (see sio_subscribe.c).  With
+ * --pipeline only the first asker would get it, so they are sent instead.
+ */
+#define SIO_CACHE_DEFAULT_TTL_MS 1000
+
+/* a request unanswered for this long is sent again */
+#define SIO_CACHE_PENDING_NS (2 * 1000000000ULL)
+
+struct SioCacheEntry {
+    char *request;              /* the query line, without terminator */
+    size_t requestLen;
+    char *reply;                /* prefix of the device's answer */
+    size_t replyLen;
+    uint64_t ttl;               /* ns */
+};
+
+/* a client line starting with prefix clears one entry, or all of them */
+struct SioCacheRule {
+    char *prefix;
+    size_t prefixLen;
+    int entry;                  /* index in cacheEntries, -1 for all */
+};
+
+static struct SioCacheEntry cacheEntries[SIO_CACHE_MAX];
+static int cacheCount;
+static struct SioCacheRule cacheRules[SIO_CACHE_MAX];
+static int ruleCount;
+
+static unsigned long cacheHits;
+static unsigned long cacheMisses;
+static unsigned long cacheMerged;
+static unsigned long cacheInvalidations;
+
+static char *sioCacheDup(const char *s, size_t len)
+{
+    char *d = malloc(len + 1);
+
+    if (d != 0) {
+        memcpy(d, s, len);
+        d[len] = '\0';
+    }
+    return d;
+}
+
+static int sioCacheFind(const char *request, size_t len)
+{
+    int i;
+
+    for (i = 0 ; i < cacheCount ; i++) {
+        if ((cacheEntries[i].requestLen == len) &&
+            (memcmp(cacheEntries[i].request, request, len) == 0)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Adds a cache entry from an argument of the form
+ * <request>,<reply>[,<ttl-ms>].
+ *
+ * @return int 0 on success, -1 if arg is malformed or the table is full
+ */
+int sioCacheAdd(const char *arg)
+{
+    struct SioCacheEntry *e = &cacheEntries[cacheCount];
+    const char *comma = strchr(arg, ',');
+    const char *reply;
+    const char *ttl;
+    unsigned long ttlMs = SIO_CACHE_DEFAULT_TTL_MS;
+
+    if ((cacheCount >= SIO_CACHE_MAX) || (comma == 0) || (comma == arg)) {
+        return -1;
+    }
+    reply = comma + 1;
+    ttl = strchr(reply, ',');
+    if (ttl != 0) {
+        char *end;
+
+        ttlMs = strtoul(ttl + 1, &end, 10);
+        if ((end == ttl + 1) || (*end != '\0')) {
+            return -1;
+        }
+    } else {
+        ttl = reply + strlen(reply);
+    }
+    if (ttl == reply) {
+        return -1;
+    }
+
+    e->requestLen = comma - arg;
+    e->request = sioCacheDup(arg, e->requestLen);
+    e->replyLen = ttl - reply;
+    e->reply = sioCacheDup(reply, e->replyLen);
+    e->ttl = ttlMs * 1000000ULL;
+    if ((e->request == 0) || (e->reply == 0)) {
+        free(e->request);
+        free(e->reply);
+        return -1;
+    }
+    cacheCount++;
+    return 0;
+}
+
+/**
+ * Adds an invalidation rule from an argument of the form
+ * <prefix>[,<request>].  A client line starting with prefix clears the
+ * entry for request, or every entry if request is left out; the entry must
+ * have been added with sioCacheAdd() first.
+ *
+ * @return int 0 on success, -1 if arg is malformed or the table is full
+ */
+int sioCacheAddRule(const char *arg)
+{
+    struct SioCacheRule *r = &cacheRules[ruleCount];
+    const char *comma = strchr(arg, ',');
+    const size_t prefixLen = (comma != 0) ? (size_t)(comma - arg) : strlen(arg);
+
+    if ((ruleCount >= SIO_CACHE_MAX) || (prefixLen == 0)) {
+        return -1;
+    }
+    r->entry = -1;
+    if (comma != 0) {
+        r->entry = sioCacheFind(comma + 1, strlen(comma + 1));
+        if (r->entry < 0) {
+            return -1;
+        }
+    }
+    r->prefix = sioCacheDup(arg, prefixLen);
+    if (r->prefix == 0) {
+        return -1;
+    }
+    r->prefixLen = prefixLen;
+    ruleCount++;
+    return 0;
+}
+
+static void sioCacheClear(struct SioCacheSlot *slot)
+{
+    free(slot->value);
+    slot->value = 0;
+    slot->valueLen = 0;
+    slot->pendingSince = 0;
+}
+
+/* releases every answer cached for a port */
+void sioCacheFree(struct SioPort *port)
+{
+    int i;
+
+    for (i = 0 ; i < cacheCount ; i++) {
+        sioCacheClear(&port->cache[i]);
+    }
+}
+
+/* applies the invalidation rules to a line going to a port's device */
+static void sioCacheInvalidate(struct SioPort *port, const char *line,
+    size_t len)
+{
+    int i;
+
+    for (i = 0 ; i < ruleCount ; i++) {
+        const struct SioCacheRule *r = &cacheRules[i];
+
+        if ((len >= r->prefixLen) &&
+            (memcmp(line, r->prefix, r->prefixLen) == 0)) {
+            int j;
+
+            cacheInvalidations++;
+            for (j = 0 ; j < cacheCount ; j++) {
+                if ((r->entry < 0) || (r->entry == j)) {
+                    sioCacheClear(&port->cache[j]);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Looks up a client line before it is sent to the device.
+ *
+ * @param port the port the line was sent to
+ * @param line the line, without its terminator
+ * @param len the number of bytes in line
+ * @param value set to the cached answer on a hit
+ * @param valueLen set to the length of the answer on a hit
+ *
+ * @return int SIO_CACHE_HIT to answer from *value, SIO_CACHE_MERGED if an
+ *         identical request is already on its way, or SIO_CACHE_FORWARD to
+ *         send the line to the device
+ */
+int sioCacheRequest(struct SioPort *port, const char *line, size_t len,
+    const char **value, size_t *valueLen)
+{
+    const struct SioCacheEntry *e;
+    struct SioCacheSlot *slot;
+    uint64_t now;
+    int i;
+
+    if (cacheCount == 0) {
+        return SIO_CACHE_FORWARD;
+    }
+
+    i = sioCacheFind(line, len);
+    if (i < 0) {
+        sioCacheInvalidate(port, line, len);
+        return SIO_CACHE_FORWARD;
+    }
+
+    e = &cacheEntries[i];
+    slot = &port->cache[i];
+    now = sioEventTime();
+    if ((slot->value != 0) && (now - slot->stamp < e->ttl)) {
+        cacheHits++;
+        *value = slot->value;
+        *valueLen = slot->valueLen;
+        return SIO_CACHE_HIT;
+    }
+
+    if ((slot->pendingSince != 0) &&
+        (now - slot->pendingSince < SIO_CACHE_PENDING_NS)) {
+        cacheMerged++;
+        return SIO_CACHE_MERGED;
+    }
+
+    cacheMisses++;
+    slot->pendingSince = now;
+    return SIO_CACHE_FORWARD;
+}
+
+/**
+ * Offers a line received from a port's device to the cache.  Any line
+ * starting with an entry's reply prefix refreshes it, solicited or not.
+ *
+ * @param port the port the line was received on
+ * @param line the line including its LF
+ * @param len the number of bytes in line
+ */
+void sioCacheReply(struct SioPort *port, const char *line, size_t len)
+{
+    int i;
+
+    for (i = 0 ; i < cacheCount ; i++) {
+        const struct SioCacheEntry *e = &cacheEntries[i];
+        struct SioCacheSlot *slot = &port->cache[i];
+        char *value;
+
+        if ((len < e->replyLen) || (memcmp(line, e->reply, e->replyLen) != 0)) {
+            continue;
+        }
+
+        value = sioCacheDup(line, len);
+        if (value == 0) {
+            continue;
+        }
+        free(slot->value);
+        slot->value = value;
+        slot->valueLen = len;
+        slot->stamp = sioEventTime();
+        slot->pendingSince = 0;
+    }
+}
+
+void sioCacheTotals(unsigned long *hits, unsigned long *misses)
+{
+    *hits = cacheHits;
+    *misses = cacheMisses;
+}
+
+/* logs the counters, normally in response to SIGUSR1 */
+void sioCacheDump(void)
+{
+    if (cacheCount > 0) {
+        LogMsg(LOG_NOTICE, "[SIO] cache: %lu hit(s), %lu miss(es), "
+            "%lu merged, %lu invalidation(s)\n", cacheHits, cacheMisses,
+            cacheMerged, cacheInvalidations);
+    }
+}
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sio_agent.h"
+
+/* records start on this boundary, so a wrap always leaves room for a pad */
+#define SIO_CAPTURE_ALIGN sizeof(struct SioCaptureRecord)
+
+static struct SioCaptureHeader *capHeader;   /* 0 when capture is off */
+static char *capData;
+static size_t capMapSize;
+
+static inline uint64_t sioCaptureAlign(uint64_t n)
+{
+    return (n + SIO_CAPTURE_ALIGN - 1) & ~(uint64_t)(SIO_CAPTURE_ALIGN - 1);
+}
+
+static uint64_t sioClockNs(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int sioCaptureValid(const struct SioCaptureHeader *h, size_t mapSize)
+{
+    return (h->magic == SIO_CAPTURE_MAGIC) &&
+        (h->headerSize == sizeof(*h)) &&
+        (h->dataSize + sizeof(*h) == mapSize) &&
+        (h->tail <= h->head) && (h->head - h->tail <= h->dataSize);
+}
+
+/* retires the oldest record, keeping the clock bases of the records left */
+static void sioCaptureRetire(struct SioCaptureHeader *h)
+{
+    const struct SioCaptureRecord *rec =
+        (const struct SioCaptureRecord *)(capData + h->tail % h->dataSize);
+
+    if ((rec->dir == SIO_CAPTURE_CLOCK) &&
+        (rec->len == sizeof(struct SioCaptureClock))) {
+        const struct SioCaptureClock *clock =
+            (const struct SioCaptureClock *)(rec + 1);
+
+        h->monoBase = clock->monoBase;
+        h->realBase = clock->realBase;
+    }
+    h->tail += sioCaptureAlign(sizeof(*rec) + rec->len);
+}
+
+/**
+ * Maps a capture ring file, creating or resizing it as needed.  An existing 
+ * capture of the same size is appended to so history survives a restart; 
+ * a SIO_CAPTURE_CLOCK record marks where the new clock bases start. 
+ * 
+ * @param path the capture file
+ * @param size total file size in bytes, rounded down to the record alignment
+ * 
+ * @return int 0 on success, -1 on error
+ */
+int sioCaptureOpen(const char *path, size_t size)
+{
+    const size_t dataSize = (size - sizeof(*capHeader)) &
+        ~(SIO_CAPTURE_ALIGN - 1);
+    struct SioCaptureClock clock;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (size < sizeof(*capHeader) + 16 * SIO_CAPTURE_ALIGN) {
+        LogMsg(LOG_ERR, "[SIO] capture size %d is too small\n", (int)size);
+        return -1;
+    }
+    capMapSize = sizeof(*capHeader) + dataSize;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LogMsg(LOG_ERR, "[SIO] can't open capture file %s, errno = %d\n",
+            path, errno);
+        return -1;
+    }
+    if ((fstat(fd, &st) < 0) ||
+        (((size_t)st.st_size != capMapSize) && (ftruncate(fd, capMapSize) < 0))) {
+        LogMsg(LOG_ERR, "[SIO] can't size capture file %s, errno = %d\n",
+            path, errno);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(0, capMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LogMsg(LOG_ERR, "[SIO] can't map capture file %s, errno = %d\n",
+            path, errno);
+        return -1;
+    }
+
+    capHeader = map;
+    capData = (char *)map + sizeof(*capHeader);
+    clock.monoBase = sioClockNs(CLOCK_MONOTONIC);
+    clock.realBase = sioClockNs(CLOCK_REALTIME);
+    if (!sioCaptureValid(capHeader, capMapSize)) {
+        memset(capHeader, 0, sizeof(*capHeader));
+        capHeader->magic = SIO_CAPTURE_MAGIC;
+        capHeader->headerSize = sizeof(*capHeader);
+        capHeader->dataSize = dataSize;
+        capHeader->monoBase = clock.monoBase;
+        capHeader->realBase = clock.realBase;
+    }
+    sioCaptureRecord(SIO_CAPTURE_CLOCK, 0, (const char *)&clock,
+        sizeof(clock));
+
+    LogMsg(LOG_NOTICE, "[SIO] capturing traffic to %s\n", path);
+    return 0;
+}
+
+void sioCaptureClose(void)
+{
+    if (capHeader != 0) {
+        msync(capHeader, capMapSize, MS_ASYNC);
+        munmap(capHeader, capMapSize);
+        capHeader = 0;
+    }
+}
+
+/**
+ * Appends one record to the capture ring, overwriting the oldest records 
+ * as needed.  Only memory is touched; the kernel writes the pages back, so 
+ * the record survives even if the agent crashes. 
+ * 
+ * @param dir SIO_CAPTURE_SERIAL_RX, SIO_CAPTURE_SOCKET_RX or 
+ *            SIO_CAPTURE_CLOCK
+ * @param channel identifies the client for socket records
+ * @param data the captured bytes
+ * @param len the number of bytes in data
+ */
+void sioCaptureRecord(int dir, int channel, const char *data, size_t len)
+{
+    struct SioCaptureHeader *h = capHeader;
+    struct SioCaptureRecord *rec;
+    uint64_t need;
+    uint64_t off;
+
+    if (h == 0) {
+        return;
+    }
+
+    need = sioCaptureAlign(sizeof(*rec) + len);
+    if (need > h->dataSize / 2) {
+        /* keep at least two records; clip a monster */
+        len = h->dataSize / 2 - sizeof(*rec);
+        need = sioCaptureAlign(sizeof(*rec) + len);
+    }
+
+    off = h->head % h->dataSize;
+    if (off + need > h->dataSize) {
+        /* no room before the end: pad it out and wrap to the start */
+        const uint64_t pad = h->dataSize - off;
+
+        while (h->head + pad - h->tail > h->dataSize) {
+            sioCaptureRetire(h);
+        }
+        rec = (struct SioCaptureRecord *)(capData + off);
+        rec->len = pad - sizeof(*rec);
+        rec->dir = SIO_CAPTURE_PAD;
+        rec->channel = 0;
+        rec->timestamp = 0;
+        h->head += pad;
+        off = 0;
+    }
+
+    /* make room by retiring the oldest records */
+    while (h->head + need - h->tail > h->dataSize) {
+        sioCaptureRetire(h);
+    }
+
+    rec = (struct SioCaptureRecord *)(capData + off);
+    rec->len = len;
+    rec->dir = dir;
+    rec->channel = channel;
+    rec->timestamp = sioClockNs(CLOCK_MONOTONIC);
+    memcpy(rec + 1, data, len);
+
+    /* publish after the record is complete so readers never see half */
+    __atomic_store_n(&h->head, h->head + need, __ATOMIC_RELEASE);
+}
+
+/**
+ * Maps an existing capture file read-only, e.g. for the replay tool. 
+ * 
+ * @param path the capture file
+ * @param mapSize receives the size of the mapping for munmap()
+ * 
+ * @return const struct SioCaptureHeader* the mapped file, or 0 on error
+ */
+const struct SioCaptureHeader *sioCaptureMap(const char *path,
+    size_t *mapSize)
+{
+    struct stat st;
+    void *map;
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return 0;
+    }
+    if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(*capHeader))) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    if (!sioCaptureValid(map, st.st_size)) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return 0;
+    }
+
+    *mapSize = st.st_size;
+    return map;
+}
+
+/**
+ * Steps through the records of a mapped capture, oldest first, skipping 
+ * padding. 
+ * 
+ * @param h the mapped capture
+ * @param pos iteration cursor; set it to h->tail before the first call
+ * 
+ * @return const struct SioCaptureRecord* the next record (its bytes follow 
+ *         it), or 0 at the end of the capture
+ */
+const struct SioCaptureRecord *sioCaptureNext(
+    const struct SioCaptureHeader *h, uint64_t *pos)
+{
+    const char *data = (const char *)(h + 1);
+
+    while (*pos < h->head) {
+        const struct SioCaptureRecord *rec =
+            (const struct SioCaptureRecord *)(data + *pos % h->dataSize);
+
+        *pos += sioCaptureAlign(sizeof(*rec) + rec->len);
+        if (rec->dir != SIO_CAPTURE_PAD) {
+            return rec;
+        }
+    }
+    return 0;
+}
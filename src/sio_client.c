@@ -0,0 +1,485 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "sio_agent.h"
+
+static struct SioClient *closedClients;     /* freed by sioClientReap() */
+
+/* most queued messages one io_uring send gathers, as IOV_MAX for writev() */
+#define SIO_URING_IOV 64
+
+/* the io_uring state of a client, see sioClientUring() */
+struct SioUringLink {
+    struct SioUringOp recv;
+    struct SioUringOp send;
+    struct SioClient *client;
+    int (*input)(struct SioClient *client, int readCount);
+    struct msghdr msg;
+    struct iovec iov[SIO_URING_IOV];
+};
+
+static int sioClientUringFlush(struct SioClient *client);
+
+/* output queue limits applied to each new client */
+static size_t clientQueueMax = SIO_DEFAULT_QUEUE_MAX;
+static int clientQueuePolicy = SIO_QUEUE_DROP_OLDEST;
+
+/* input line limits applied to each new client */
+static unsigned int clientLineMax = SIO_DEFAULT_LINE_MAX;
+static unsigned int clientBatchMax = SIO_DEFAULT_BATCH_MAX;
+
+void sioClientSetQueueParams(size_t maxBytes, int policy)
+{
+    clientQueueMax = maxBytes;
+    clientQueuePolicy = policy;
+}
+
+/* applies the current output queue limits to the clients of a port */
+void sioClientUpdateQueues(struct SioPort *port)
+{
+    struct SioClient *client;
+
+    for (client = port->clients ; client != 0 ; client = client->next) {
+        client->out.maxBytes = clientQueueMax;
+        client->out.policy = clientQueuePolicy;
+    }
+}
+
+void sioClientSetLineParams(unsigned int maxLine, unsigned int maxBatch)
+{
+    clientLineMax = maxLine;
+    clientBatchMax = maxBatch;
+}
+
+/**
+ * Registers a newly accepted connection with the event loop. 
+ * 
+ * @param port the port whose listener accepted the connection
+ * @param fd the connected, non-blocking socket
+ * @param handler called by the event loop when the socket is ready
+ * 
+ * @return struct SioClient* the new client, or 0 if the client limit was 
+ *         reached or memory ran out (fd is left open)
+ */
+struct SioClient *sioClientAdd(struct SioPort *port, int fd,
+    SioEventHandler handler)
+{
+    struct SioClient *client;
+
+    if (port->clientCount >= SIO_MAX_CLIENTS) {
+        LogMsg(LOG_ERR, "[SIO] client limit of %d reached\n", SIO_MAX_CLIENTS);
+        return 0;
+    }
+
+    client = calloc(1, sizeof(*client));
+    if (client == 0) {
+        return 0;
+    }
+    if (sioQueueInit(&client->out, clientQueueMax, clientQueuePolicy) < 0) {
+        free(client);
+        return 0;
+    }
+    if (sioLineBufInit(&client->in, clientLineMax, clientBatchMax) < 0) {
+        sioQueueFree(&client->out);
+        free(client);
+        return 0;
+    }
+    client->out.latency = &sioLatencyToClient;
+    client->port = port;
+    client->ev.fd = fd;
+    client->ev.handler = handler;
+    client->ev.ctx = client;
+    if (sioEventAdd(&client->ev, EPOLLIN) < 0) {
+        sioLineBufFree(&client->in);
+        sioQueueFree(&client->out);
+        free(client);
+        return 0;
+    }
+
+    client->next = port->clients;
+    port->clients = client;
+    port->clientCount++;
+    LogMsg(LOG_INFO, "[SIO] %d client(s) connected to port %d\n",
+        port->clientCount, port->index);
+
+    return client;
+}
+
+/**
+ * Closes a client's socket and drops its queued output.  The memory is only 
+ * released by sioClientReap() so that events still pending for the client 
+ * in the current batch can be skipped safely. 
+ */
+void sioClientClose(struct SioClient *client)
+{
+    struct SioPort *port = client->port;
+    struct SioClient **pp;
+
+    if (client->ev.fd < 0) {
+        return;  /* already closed */
+    }
+
+    sioEventDel(&client->ev);
+    if (client->uring != 0) {
+        sioUringCancel(&client->uring->recv);
+        sioUringCancel(&client->uring->send);
+    }
+    close(client->ev.fd);
+    client->ev.fd = -1;
+
+    if (client->out.dropMsgs > 0) {
+        LogMsg(LOG_NOTICE, "[SIO] client dropped %d message(s), %d bytes\n",
+            (int)client->out.dropMsgs, (int)client->out.dropBytes);
+    }
+    if (client->out.pinned == 0) {
+        /* else a send still reads it, sioClientReap() frees it */
+        sioQueueClear(&client->out);
+    }
+    if (client->in.len > 0) {
+        LogMsg(LOG_INFO, "[SIO] client closed with %d byte partial line\n",
+            (int)client->in.len);
+    }
+    sioPipelineDropClient(client);
+    sioShmDetach(client);
+    sioSubDetach(client);
+    if (client->framed) {
+        port->framedCount--;
+    }
+
+    for (pp = &port->clients ; *pp != 0 ; pp = &(*pp)->next) {
+        if (*pp == client) {
+            *pp = client->next;
+            break;
+        }
+    }
+    client->next = closedClients;
+    closedClients = client;
+    port->clientCount--;
+    LogMsg(LOG_INFO, "[SIO] %d client(s) connected to port %d\n",
+        port->clientCount, port->index);
+}
+
+/*
+ * Frees clients closed during the last event loop iteration, except those
+ * io_uring may still complete an operation for; they go in a later call.
+ */
+void sioClientReap(void)
+{
+    struct SioClient **pp = &closedClients;
+
+    while (*pp != 0) {
+        struct SioClient *client = *pp;
+
+        if ((client->uring != 0) && (sioUringBusy(&client->uring->recv) ||
+            sioUringBusy(&client->uring->send))) {
+            pp = &client->next;
+            continue;
+        }
+        *pp = client->next;
+        sioLineBufFree(&client->in);
+        sioQueueFree(&client->out);
+        free(client->uring);
+        free(client);
+    }
+}
+
+void sioClientCloseAll(struct SioPort *port)
+{
+    while (port->clients != 0) {
+        sioClientClose(port->clients);
+    }
+    sioClientReap();
+}
+
+/**
+ * Sends as much of the client's queued output as the socket accepts and 
+ * waits for EPOLLOUT if anything is left.  A client whose socket failed is 
+ * closed.  Shared-memory clients are handed to sioShmFlush(), clients on 
+ * io_uring to sioClientUringFlush(). 
+ * 
+ * @param client the client to flush
+ * 
+ * @return int 0 on success, -1 if the client was closed
+ */
+int sioClientFlush(struct SioClient *client)
+{
+    ssize_t left;
+
+    if (client->shm != 0) {
+        return sioShmFlush(client);
+    } else if (client->uring != 0) {
+        return sioClientUringFlush(client);
+    }
+
+    left = client->port->seqpacket ?
+        sioTioSocketWritePackets(client->ev.fd, &client->out) :
+        sioTioSocketWrite(client->ev.fd, &client->out);
+    if (left < 0) {
+        sioClientClose(client);
+        return -1;
+    }
+
+    return sioEventMod(&client->ev, (left == 0) ?
+        EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+static int sioClientRecvNext(struct SioUringLink *link)
+{
+    return sioUringRecv(&link->recv, link->client->ev.fd);
+}
+
+/* passes received bytes to the client's line assembler, as they fit */
+static void sioClientUringInput(struct SioUringLink *link, const char *data,
+    int len)
+{
+    struct SioClient *client = link->client;
+    struct SioLineBuf *in = &client->in;
+
+    while (len > 0) {
+        const int n = (len < (int)(in->size - in->len)) ?
+            len : (int)(in->size - in->len);
+
+        if (n == 0) {
+            /* a full line assembler, where a recv() would have returned 0 */
+            LogMsg(LOG_INFO, "[SIO] %s(): no room, client closed\n",
+                __FUNCTION__);
+            sioClientClose(client);
+            return;
+        }
+        memcpy(in->data + in->len, data, n);
+        LogMsg(LOG_INFO, "[SIO] received => \"%.*s\"\n", n,
+            in->data + in->len);
+        in->len += n;
+        if (link->input(client, n) < 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void sioClientOnRecv(struct SioUringOp *op, int res,
+    unsigned int flags)
+{
+    struct SioUringLink *link = (struct SioUringLink *)((char *)op -
+        offsetof(struct SioUringLink, recv));
+    struct SioClient *client = link->client;
+    const char *data = sioUringBuffer(flags);
+
+    if ((data != 0) && (res > 0) && (client->ev.fd >= 0)) {
+        sioClientUringInput(link, data, res);
+    }
+    sioUringRecycle(flags);
+    if ((client->ev.fd < 0) || op->pending) {
+        return;
+    }
+
+    /* the multishot receive ended; it runs out of buffers under a burst */
+    if ((res > 0) || (res == -ENOBUFS) || (res == -EAGAIN) ||
+        (res == -EINTR)) {
+        if (sioClientRecvNext(link) == 0) {
+            return;
+        }
+    } else {
+        LogMsg(LOG_INFO, "[SIO] %s(): recv() failed, client closed\n",
+            __FUNCTION__);
+    }
+    sioClientClose(client);
+}
+
+static void sioClientOnSend(struct SioUringOp *op, int res,
+    unsigned int flags)
+{
+    struct SioUringLink *link = (struct SioUringLink *)((char *)op -
+        offsetof(struct SioUringLink, send));
+    struct SioClient *client = link->client;
+
+    client->out.pinned = 0;
+    if (client->ev.fd < 0) {
+        return;     /* closed, sioClientReap() frees what was queued */
+    }
+
+    if (res > 0) {
+        sioQueueConsume(&client->out, res);
+    } else if ((res < 0) && (res != -EAGAIN) && (res != -EINTR)) {
+        LogMsg(LOG_ERR, "[SIO] socket_send_to_client(): send() failed, %d\n",
+            client->ev.fd);
+        sioClientClose(client);
+        return;
+    }
+    sioClientUringFlush(client);
+}
+
+/*
+ * Starts a send of the queued output of a client on io_uring unless one is
+ * in flight; its completion starts the next one while anything is left.
+ */
+static int sioClientUringFlush(struct SioClient *client)
+{
+    struct SioUringLink *link = client->uring;
+    unsigned int n;
+
+    if (link->send.pending || (client->out.bytes == 0)) {
+        return 0;
+    }
+
+    n = sioQueueIov(&client->out, link->iov, SIO_URING_IOV);
+    memset(&link->msg, 0, sizeof(link->msg));
+    link->msg.msg_iov = link->iov;
+    link->msg.msg_iovlen = n;
+    if (sioUringSend(&link->send, client->ev.fd, &link->msg) < 0) {
+        sioClientClose(client);
+        return -1;
+    }
+    client->out.pinned = n;
+    return 0;
+}
+
+/**
+ * Moves a newly accepted line-mode client to io_uring: its socket is taken
+ * off epoll and read by a multishot receive, whose bytes go to input as
+ * sioTioSocketRead() bytes would, and its output is sent by one sendmsg()
+ * in flight at a time.
+ *
+ * @param client the client, just added
+ * @param input takes the readCount bytes appended to client->in, returns
+ *              -1 if it closed the client
+ *
+ * @return int 0 on success, -1 if the client stays on epoll
+ */
+int sioClientUring(struct SioClient *client,
+    int (*input)(struct SioClient *client, int readCount))
+{
+    struct SioUringLink *link = calloc(1, sizeof(*link));
+
+    if (link == 0) {
+        return -1;
+    }
+    link->recv.handler = sioClientOnRecv;
+    link->send.handler = sioClientOnSend;
+    link->client = client;
+    link->input = input;
+    if (sioClientRecvNext(link) < 0) {
+        free(link);
+        return -1;
+    }
+
+    sioEventDel(&client->ev);
+    client->uring = link;
+    return 0;
+}
+
+/* queues buf for one client, closing it if its policy says so */
+static int sioClientPush(struct SioClient *client, struct SioBuf *buf)
+{
+    const int wasIdle = (client->out.bytes == 0);
+
+    if (sioQueuePush(&client->out, buf) < 0) {
+        LogMsg(LOG_NOTICE, "[SIO] disconnecting slow client %d\n",
+            client->ev.fd);
+        sioClientClose(client);
+        return -1;
+    } else if (wasIdle && !sioProfileDefer(client)) {
+        /* nothing else waiting, try to send right away */
+        return sioClientFlush(client);
+    }
+    return 0;
+}
+
+/**
+ * Sends a message to a single client, such as the answer to a local 
+ * command. 
+ * 
+ * @return int 0 on success, -1 if the client was closed or memory ran out
+ */
+int sioClientSend(struct SioClient *client, const char *msg, size_t len)
+{
+    struct SioBuf *buf;
+    int rv;
+
+    if (client->framed) {
+        /* lines already read for the port go first */
+        sioFrameFlush();
+        buf = sioFrameDirect(msg, len);
+    } else {
+        buf = sioBufAlloc(msg, len);
+    }
+
+    if (buf == 0) {
+        LogMsg(LOG_ERR, "[SIO] out of memory, reply dropped\n");
+        return -1;
+    }
+    rv = sioClientPush(client, buf);
+    sioBufRelease(buf);
+    return rv;
+}
+
+/**
+ * Sends a serial line to every client of a port.  The line is copied once 
+ * into a shared buffer that each client's queue references; framed clients 
+ * get it in the port's next frame instead, and clients with subscriptions 
+ * only if it matches one. 
+ * 
+ * @param port the port the line was received on
+ * @param msg the NUL-terminated line
+ * @param len the number of bytes to send from msg
+ */
+void sioClientBroadcast(struct SioPort *port, const char *msg, size_t len)
+{
+    struct SioClient *client;
+    struct SioClient *next;
+    struct SioBuf *buf = 0;
+    uint32_t wanted;
+
+    sioProfileCount(port);
+    if (port->framedCount > 0) {
+        sioFrameAppend(port, msg, len);
+    }
+    if (port->clientCount == port->framedCount) {
+        return;
+    }
+
+    /*
+     * Subscribers the line is for, and those it may answer; clients without
+     * subscriptions get it anyway.
+     */
+    wanted = sioSubMatch(port, msg, len) | sioSubAnswer(port);
+
+    for (client = port->clients ; client != 0 ; client = next) {
+        next = client->next;
+        if (client->framed || ((client->subBit & ~wanted) != 0)) {
+            continue;
+        }
+        if (buf == 0) {
+            buf = sioBufAlloc(msg, len);
+            if (buf == 0) {
+                LogMsg(LOG_ERR, "[SIO] out of memory, line dropped\n");
+                return;
+            }
+            LogMsg(LOG_INFO, "[SIO] sending => \"%.*s\"\n", (int)len, msg);
+        }
+        sioClientPush(client, buf);
+    }
+
+    if (buf != 0) {
+        sioBufRelease(buf);
+    }
+}
+
+/* queues a frame from sio_frame.c for every framed client of a port */
+void sioClientBroadcastFrame(struct SioPort *port, struct SioBuf *buf)
+{
+    struct SioClient *client;
+    struct SioClient *next;
+
+    for (client = port->clients ; client != 0 ; client = next) {
+        next = client->next;
+        if (client->framed) {
+            sioClientPush(client, buf);
+        }
+    }
+}
@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sio_agent.h"
+
+/*
+ * Configuration file, read at start-up and again on SIGHUP.  Each line is
+ * <key> = <value>; blank lines and lines starting with # are skipped.  A
+ * key applies to every port, or to port n only when written <key>.<n>:
+ *
+ *   baud, rs485, rs485-delay, vmin, vtime, low-latency,
+ *   flow, pace, tty-queue                               serial settings
+ *   client-queue, log-level                             for the whole agent
+ *
+ * The file is checked completely before anything is applied, so a typo
+ * leaves the running settings alone.  Serial settings go to the open
+ * device in place; listeners, clients and the bytes queued either way are
+ * not touched.  Keys left out keep their current value.
+ */
+#define SIO_CONFIG_LINE_MAX 256
+
+/* the settings of one port as the file wants them */
+struct SioConfigPort {
+    struct SioTtySettings tty;
+    unsigned int pacePercent;
+    unsigned int paceGapUs;
+    size_t ttyQueueMax;
+    int ttyQueuePolicy;
+};
+
+struct SioConfig {
+    struct SioConfigPort port[SIO_MAX_PORTS];
+    int logLevel;               /* -1 to leave alone */
+    int clientQueueSet;
+    size_t clientQueueMax;
+    int clientQueuePolicy;
+};
+
+static const char *configPath;  /* 0 without --config */
+
+static char *sioConfigTrim(char *s)
+{
+    char *end;
+
+    while ((*s == ' ') || (*s == '\t')) {
+        s++;
+    }
+    end = s + strlen(s);
+    while ((end > s) && ((end[-1] == ' ') || (end[-1] == '\t') ||
+        (end[-1] == '\n') || (end[-1] == '\r'))) {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
+
+static int sioConfigBool(const char *value, int *flag)
+{
+    if ((strcmp(value, "1") == 0) || (strcmp(value, "on") == 0) ||
+        (strcmp(value, "yes") == 0)) {
+        *flag = 1;
+    } else if ((strcmp(value, "0") == 0) || (strcmp(value, "off") == 0) ||
+        (strcmp(value, "no") == 0)) {
+        *flag = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int sioConfigByte(const char *value, unsigned int *n)
+{
+    char *end;
+    const unsigned long v = strtoul(value, &end, 10);
+
+    if ((end == value) || (*end != '\0') || (v > 255)) {
+        return -1;
+    }
+    *n = v;
+    return 0;
+}
+
+/* applies one serial key to a port's staged settings */
+static int sioConfigPortKey(struct SioConfigPort *p, const char *key,
+    const char *value)
+{
+    if (strcmp(key, "baud") == 0) {
+        return sioTtyParseRate(value, &p->tty.rate);
+    } else if (strcmp(key, "rs485") == 0) {
+        return sioConfigBool(value, &p->tty.rs485);
+    } else if (strcmp(key, "vmin") == 0) {
+        return sioConfigByte(value, &p->tty.vmin);
+    } else if (strcmp(key, "vtime") == 0) {
+        return sioConfigByte(value, &p->tty.vtime);
+    } else if (strcmp(key, "low-latency") == 0) {
+        return sioConfigBool(value, &p->tty.lowLatency);
+    } else if (strcmp(key, "rs485-delay") == 0) {
+        return sioTtyParseDelay(value, &p->tty.rtsBeforeMs,
+            &p->tty.rtsAfterMs);
+    } else if (strcmp(key, "flow") == 0) {
+        return sioTtyParseFlow(value, &p->tty.flow);
+    } else if (strcmp(key, "pace") == 0) {
+        return sioPaceParse(value, &p->pacePercent, &p->paceGapUs);
+    } else if (strcmp(key, "tty-queue") == 0) {
+        return sioQueueParse(value, &p->ttyQueueMax, &p->ttyQueuePolicy);
+    }
+    return -1;
+}
+
+/* applies one line of the file to the staged settings */
+static int sioConfigLine(struct SioConfig *cfg, int portCount, char *key,
+    const char *value)
+{
+    char *dot = strchr(key, '.');
+    int first = 0;
+    int last = portCount - 1;
+    int i;
+
+    if (strcmp(key, "log-level") == 0) {
+        cfg->logLevel = LogParseLevel(value);
+        return (cfg->logLevel < 0) ? -1 : 0;
+    } else if (strcmp(key, "client-queue") == 0) {
+        cfg->clientQueueSet = 1;
+        return sioQueueParse(value, &cfg->clientQueueMax,
+            &cfg->clientQueuePolicy);
+    }
+
+    if (dot != 0) {
+        char *end;
+
+        *dot = '\0';
+        first = last = strtol(dot + 1, &end, 10);
+        if ((end == dot + 1) || (*end != '\0') || (first < 0) ||
+            (first >= portCount)) {
+            return -1;
+        }
+    }
+    for (i = first ; i <= last ; i++) {
+        if (sioConfigPortKey(&cfg->port[i], key, value) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* reads the file into cfg, which holds the current settings on entry */
+static int sioConfigRead(const char *path, struct SioConfig *cfg,
+    int portCount)
+{
+    char line[SIO_CONFIG_LINE_MAX];
+    int lineNo = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == 0) {
+        LogMsg(LOG_ERR, "[SIO] can't open %s, errno = %d\n", path, errno);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != 0) {
+        char *key = sioConfigTrim(line);
+        char *eq = strchr(key, '=');
+
+        lineNo++;
+        if ((*key == '\0') || (*key == '#')) {
+            continue;
+        }
+        if (eq != 0) {
+            *eq = '\0';
+        }
+        if ((eq == 0) ||
+            (sioConfigLine(cfg, portCount, sioConfigTrim(key),
+            sioConfigTrim(eq + 1)) < 0)) {
+            LogMsg(LOG_ERR, "[SIO] %s:%d: bad setting\n", path, lineNo);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* puts the staged settings into effect */
+static void sioConfigApply(const struct SioConfig *cfg,
+    struct SioPort *ports, int portCount)
+{
+    int i;
+
+    if (cfg->logLevel >= 0) {
+        LogSetLevel(cfg->logLevel);
+    }
+    if (cfg->clientQueueSet) {
+        sioClientSetQueueParams(cfg->clientQueueMax, cfg->clientQueuePolicy);
+    }
+
+    for (i = 0 ; i < portCount ; i++) {
+        const struct SioConfigPort *p = &cfg->port[i];
+        struct SioPort *port = &ports[i];
+        const struct SioTtySettings *tty = &p->tty;
+        const int serialChanged = (tty->rate != port->rate) ||
+            (tty->rs485 != port->rs485) || (tty->vmin != port->vmin) ||
+            (tty->vtime != port->vtime) ||
+            (tty->lowLatency != port->lowLatency) ||
+            (tty->flow != port->flow) ||
+            (tty->rtsBeforeMs != port->rtsBeforeMs) ||
+            (tty->rtsAfterMs != port->rtsAfterMs);
+
+        sioTtySetQueueParams(port, p->ttyQueueMax, p->ttyQueuePolicy);
+        if ((p->pacePercent != port->pacePercent) ||
+            (p->paceGapUs != port->paceGapUs)) {
+            sioPaceSet(port, p->pacePercent, p->paceGapUs);
+        }
+        if (cfg->clientQueueSet) {
+            sioClientUpdateQueues(port);
+        }
+        if (!serialChanged) {
+            continue;
+        }
+
+        if (sioTtyReconfigure(port, tty) < 0) {
+            LogMsg(LOG_ERR, "[SIO] port %d: new settings refused by %s, "
+                "kept %u baud\n", port->index, port->ttyName, port->rate);
+        } else {
+            LogMsg(LOG_NOTICE, "[SIO] port %d: %u baud%s, vmin %u, vtime %u\n",
+                port->index, port->rate, port->rs485 ? " RS-485" : "",
+                port->vmin, port->vtime);
+        }
+    }
+}
+
+/**
+ * Reads a configuration file and applies it to the ports.  The path is
+ * kept for sioConfigReload().
+ *
+ * @return int 0 on success, -1 if the file can't be read or has a bad line,
+ *         in which case nothing was changed
+ */
+int sioConfigLoad(const char *path, struct SioPort *ports, int portCount)
+{
+    struct SioConfig cfg;
+    int i;
+
+    cfg.logLevel = -1;
+    cfg.clientQueueSet = 0;
+    for (i = 0 ; i < portCount ; i++) {
+        struct SioConfigPort *p = &cfg.port[i];
+
+        sioTtyGetSettings(&ports[i], &p->tty);
+        p->pacePercent = ports[i].pacePercent;
+        p->paceGapUs = ports[i].paceGapUs;
+        p->ttyQueueMax = ports[i].ttyOut.maxBytes;
+        p->ttyQueuePolicy = ports[i].ttyOut.policy;
+    }
+
+    configPath = path;
+    if (sioConfigRead(path, &cfg, portCount) < 0) {
+        return -1;
+    }
+    sioConfigApply(&cfg, ports, portCount);
+    return 0;
+}
+
+/* reads the configuration file again, normally in response to SIGHUP */
+void sioConfigReload(struct SioPort *ports, int portCount)
+{
+    const uint64_t start = sioNowNs();
+
+    if (configPath == 0) {
+        LogMsg(LOG_NOTICE, "[SIO] no configuration file to reload\n");
+    } else if (sioConfigLoad(configPath, ports, portCount) == 0) {
+        LogMsg(LOG_NOTICE, "[SIO] %s reloaded in %lu us\n", configPath,
+            (unsigned long)((sioNowNs() - start) / 1000));
+    } else {
+        LogMsg(LOG_ERR, "[SIO] %s not reloaded, settings unchanged\n",
+            configPath);
+    }
+}
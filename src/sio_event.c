@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include "sio_agent.h"
+
+/* maximum number of ready descriptors handled per wakeup */
+#define SIO_EVENT_BATCH 32
+
+static int epollFd = -1;
+static uint64_t eventTime;      /* when the current batch woke up */
+static int uringWanted;         /* try io_uring, see sio_uring.c */
+static int uringActive;         /* waits are done by sio_uring.c */
+
+/* asks sioEventInit() to set up the io_uring backend as well */
+void sioEventSetUring(int enable)
+{
+    uringWanted = enable;
+}
+
+/**
+ * Creates the epoll instance shared by every descriptor of the agent, and 
+ * the io_uring rings if they were asked for and the kernel has them. 
+ * 
+ * @return int 0 on success, -1 if epoll could not be created
+ */
+int sioEventInit(void)
+{
+    if (epollFd < 0) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            LogMsg(LOG_ERR, "[SIO] epoll_create1() failed, errno = %d\n", errno);
+            return -1;
+        }
+    }
+    if (uringWanted && !uringActive) {
+        if (sioUringInit(epollFd) == 0) {
+            LogMsg(LOG_INFO, "[SIO] using io_uring\n");
+            uringActive = 1;
+        } else {
+            LogMsg(LOG_NOTICE, "[SIO] io_uring unavailable, errno = %d, "
+                "using epoll\n", errno);
+        }
+    }
+    return 0;
+}
+
+void sioEventClose(void)
+{
+    if (uringActive) {
+        sioUringClose();
+        uringActive = 0;
+    }
+    if (epollFd >= 0) {
+        close(epollFd);
+        epollFd = -1;
+    }
+}
+
+/**
+ * Returns the time the current batch of events was picked up.  Messages 
+ * read by a handler are stamped with it, so latencies include any time 
+ * spent in handlers that ran first. 
+ * 
+ * @return uint64_t CLOCK_MONOTONIC ns, 0 before the first wakeup
+ */
+uint64_t sioEventTime(void)
+{
+    return eventTime;
+}
+
+/**
+ * Puts a descriptor in non-blocking mode so a handler can drain it until 
+ * EAGAIN without ever stalling the loop. 
+ * 
+ * @param fd the descriptor to change
+ * 
+ * @return int 0 on success, -1 on error
+ */
+int sioSetNonBlocking(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        LogMsg(LOG_ERR, "[SIO] can't set O_NONBLOCK on %d, errno = %d\n",
+            fd, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes a whole buffer to a descriptor that may be non-blocking, waiting 
+ * for it to drain whenever the kernel buffer is full. 
+ * 
+ * @param fd the descriptor to write
+ * @param buff the bytes to write
+ * @param len the number of bytes in buff
+ * 
+ * @return int 0 on success, -1 on error
+ */
+int sioWriteAll(int fd, const char *buff, size_t len)
+{
+    while (len > 0) {
+        const ssize_t cnt = write(fd, buff, len);
+
+        if (cnt > 0) {
+            buff += cnt;
+            len -= cnt;
+        } else if ((cnt < 0) && (errno == EAGAIN)) {
+            struct pollfd p = { fd, POLLOUT, 0 };
+            poll(&p, 1, -1);
+        } else if ((cnt < 0) && (errno == EINTR)) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Registers a descriptor with the loop.  The SioEvent is owned by the 
+ * caller, normally embedded in the object the descriptor belongs to, and 
+ * must stay valid until sioEventDel() is called for it. 
+ * 
+ * @param ev the event record; fd, handler and ctx must be filled in
+ * @param events the EPOLL* event mask to wait for
+ * 
+ * @return int 0 on success, -1 on error
+ */
+int sioEventAdd(struct SioEvent *ev, unsigned int events)
+{
+    struct epoll_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.events = events;
+    e.data.ptr = ev;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, ev->fd, &e) < 0) {
+        LogMsg(LOG_ERR, "[SIO] epoll add of %d failed, errno = %d\n",
+            ev->fd, errno);
+        return -1;
+    }
+    ev->events = events;
+    return 0;
+}
+
+/**
+ * Changes the event mask of a registered descriptor; a no-op if the mask is 
+ * unchanged. 
+ */
+int sioEventMod(struct SioEvent *ev, unsigned int events)
+{
+    struct epoll_event e;
+
+    if (events == ev->events) {
+        return 0;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.events = events;
+    e.data.ptr = ev;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, ev->fd, &e) < 0) {
+        LogMsg(LOG_ERR, "[SIO] epoll mod of %d failed, errno = %d\n",
+            ev->fd, errno);
+        return -1;
+    }
+    ev->events = events;
+    return 0;
+}
+
+/**
+ * Removes a descriptor from the loop.  Must be called before the descriptor 
+ * is closed; pending events for it in the current batch are skipped. 
+ */
+void sioEventDel(struct SioEvent *ev)
+{
+    if (ev->fd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, ev->fd, 0);
+    }
+    ev->events = 0;
+}
+
+/*
+ * Waits for ready descriptors and calls their handlers.  Returns their
+ * number, or -1 if the wait failed.
+ */
+static int sioEventPoll(int timeoutMs)
+{
+    struct epoll_event ready[SIO_EVENT_BATCH];
+    int i;
+    const int n = epoll_wait(epollFd, ready, SIO_EVENT_BATCH, timeoutMs);
+
+    if (n < 0) {
+        if (errno != EINTR) {
+            LogMsg(LOG_ERR, "[SIO] epoll_wait() failed, errno = %d\n", errno);
+        }
+        return -1;
+    }
+    if (!uringActive) {
+        eventTime = sioNowNs();
+    }
+
+    for (i = 0 ; i < n ; i++) {
+        struct SioEvent *ev = ready[i].data.ptr;
+
+        /* an earlier handler in this batch may have removed it */
+        if (ev->events != 0) {
+            ev->handler(ev, ready[i].events);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Waits once for activity and calls the handler of every ready descriptor. 
+ * With io_uring the handlers of completed operations run first, and epoll 
+ * is only asked for its ready descriptors when the ring says it has some. 
+ * 
+ * @param timeoutMs how long to wait, -1 to wait indefinitely
+ * 
+ * @return int the number of descriptors and completions handled, or -1 if 
+ *         the wait was interrupted by a signal (errno is EINTR) or failed
+ */
+int sioEventRun(int timeoutMs)
+{
+    int n;
+
+    if (!uringActive) {
+        return sioEventPoll(timeoutMs);
+    }
+
+    n = sioUringWait(timeoutMs);
+    if (n < 0) {
+        return -1;
+    }
+    eventTime = sioNowNs();
+    if (sioUringDispatch()) {
+        const int ready = sioEventPoll(0);
+
+        if (ready > 0) {
+            n += ready;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,143 @@
+#include <string.h>
+
+#include "sio_agent.h"
+
+/*
+ * Framed output.  A client that sends "sio.framed" gets "sio.framed=1" back
+ * as its last plain line; from then on everything it receives comes in
+ * length-prefixed frames, so it never has to scan for line ends.  The lines
+ * of one serial read are packed into a single frame that every framed
+ * client of the port shares and gets in one send.  Records carry a per-port
+ * sequence number, so a client can tell how many lines its queue dropped,
+ * and the time the line was read.
+ */
+#define SIO_FRAME_CMD "sio.framed"
+#define SIO_FRAME_ACK "sio.framed=1\n"
+
+/* the frame being filled, for framePort; one at a time as lines are read */
+static char frameBuff[SIO_FRAME_MAX] __attribute__((aligned(8)));
+static size_t frameLen;
+static unsigned int frameCount;
+static struct SioPort *framePort;
+
+static inline size_t sioFramePad(size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+/* writes a record for line at p, returning the bytes used */
+static size_t sioFramePut(char *p, uint32_t seq, const char *line,
+    size_t len)
+{
+    struct SioFrameRecord *rec = (struct SioFrameRecord *)p;
+    const size_t padded = sioFramePad(len);
+
+    rec->len = len;
+    rec->seq = seq;
+    rec->timestamp = sioEventTime();
+    memcpy(p + sizeof(*rec), line, len);
+    memset(p + sizeof(*rec) + len, 0, padded - len);
+    return sizeof(*rec) + padded;
+}
+
+static void sioFrameHeaderPut(char *p, size_t len, unsigned int count,
+    unsigned int flags)
+{
+    struct SioFrameHeader *h = (struct SioFrameHeader *)p;
+
+    h->magic = SIO_FRAME_MAGIC;
+    h->len = len - sizeof(*h);
+    h->count = count;
+    h->flags = flags;
+    h->reserved = 0;
+}
+
+/**
+ * Switches a client to framed output if line asks for it.  The answer is
+ * the client's last plain line, or a frame if it had already switched.
+ *
+ * @return int 1 if line was the request and has been answered, 0 if it is
+ *         for someone else
+ */
+int sioFrameNegotiate(struct SioClient *client, const char *line, size_t len)
+{
+    if ((len != sizeof(SIO_FRAME_CMD) - 1) ||
+        (memcmp(line, SIO_FRAME_CMD, len) != 0)) {
+        return 0;
+    }
+
+    sioClientSend(client, SIO_FRAME_ACK, sizeof(SIO_FRAME_ACK) - 1);
+    if ((client->ev.fd >= 0) && !client->framed) {
+        client->framed = 1;
+        client->port->framedCount++;
+        /* frames are shared by all framed clients, so they go unfiltered */
+        sioSubDetach(client);
+        LogMsg(LOG_INFO, "[SIO] client %d switched to framed output\n",
+            client->ev.fd);
+    }
+    return 1;
+}
+
+/**
+ * Adds a line for the framed clients of a port to the frame being filled.
+ * The frame goes out at the next sioFrameFlush(), or earlier when it is
+ * full or a line for another port comes along.
+ *
+ * @param port the port the line was received on
+ * @param line the line including its terminator, at most SIO_BUFFER_SIZE
+ * @param len the number of bytes in line
+ */
+void sioFrameAppend(struct SioPort *port, const char *line, size_t len)
+{
+    const size_t need = sizeof(struct SioFrameRecord) + sioFramePad(len);
+
+    if ((framePort != port) || (frameLen + need > sizeof(frameBuff))) {
+        sioFrameFlush();
+    }
+    if (frameCount == 0) {
+        framePort = port;
+        frameLen = sizeof(struct SioFrameHeader);
+    }
+
+    frameLen += sioFramePut(frameBuff + frameLen, port->frameSeq++, line, len);
+    frameCount++;
+}
+
+/* sends the frame being filled, if any, to the framed clients of its port */
+void sioFrameFlush(void)
+{
+    struct SioBuf *buf;
+
+    if (frameCount == 0) {
+        return;
+    }
+
+    sioFrameHeaderPut(frameBuff, frameLen, frameCount, 0);
+    buf = sioBufAlloc(frameBuff, frameLen);
+    frameCount = 0;
+    if (buf == 0) {
+        LogMsg(LOG_ERR, "[SIO] out of memory, frame dropped\n");
+        return;
+    }
+    sioClientBroadcastFrame(framePort, buf);
+    sioBufRelease(buf);
+}
+
+/**
+ * Wraps a message for a single framed client, such as the answer to a
+ * local command, in a frame of its own.
+ *
+ * @return struct SioBuf* the frame, or 0 if memory ran out
+ */
+struct SioBuf *sioFrameDirect(const char *msg, size_t len)
+{
+    const size_t total = sizeof(struct SioFrameHeader) +
+        sizeof(struct SioFrameRecord) + sioFramePad(len);
+    struct SioBuf *buf = sioBufAlloc(0, total);
+
+    if (buf != 0) {
+        sioFrameHeaderPut(buf->data, total, 1, SIO_FRAME_DIRECT);
+        sioFramePut(buf->data + sizeof(struct SioFrameHeader), 0, msg, len);
+    }
+    return buf;
+}
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+#include "sio_agent.h"
+
+/*
+ * Hot-plug detection: the directory holding each port's device node is
+ * watched with inotify, so a port waiting for its device is retried as soon
+ * as the node is created or udev changes its permissions.  Directories that
+ * don't exist yet, such as /dev/serial/by-id with nothing plugged in, are
+ * left to the main loop's retry timer.
+ */
+static struct SioEvent hotplugEv = { -1 };
+static struct SioPort *watched[SIO_MAX_PORTS];
+static int watchedCount;
+
+/* the part of a device path after the last slash */
+static const char *sioHotplugBase(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return (slash != 0) ? slash + 1 : path;
+}
+
+static void sioHotplugOnEvent(struct SioEvent *ev, unsigned int events)
+{
+    char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t cnt;
+
+    while ((cnt = read(ev->fd, buff, sizeof(buff))) > 0) {
+        const char *p = buff;
+
+        while (p < buff + cnt) {
+            const struct inotify_event *e = (const struct inotify_event *)p;
+            int i;
+
+            for (i = 0 ; i < watchedCount ; i++) {
+                struct SioPort *port = watched[i];
+
+                if (port->watch != e->wd) {
+                    continue;
+                } else if (e->mask & IN_IGNORED) {
+                    /* the directory is gone, the retry timer takes over */
+                    port->watch = -1;
+                } else if ((e->len > 0) && (port->serialEv.fd < 0) &&
+                    (strcmp(e->name, sioHotplugBase(port->serialName)) == 0)) {
+                    LogMsg(LOG_INFO, "[SIO] %s appeared\n", port->serialName);
+                    port->reopenAt = sioEventTime();
+                }
+            }
+            p += sizeof(*e) + e->len;
+        }
+    }
+}
+
+/**
+ * Watches the directory of a port's device node.  Ports on a pty or on
+ * stdio have nothing to watch.
+ *
+ * @return int 0 if the port is watched or needs no watch, -1 if the
+ *         directory could not be watched (port->watch stays -1)
+ */
+int sioHotplugWatch(struct SioPort *port)
+{
+    const char *name = port->serialName;
+    const char *base;
+    char dir[256];
+    int i;
+
+    if (port->useStdio || (name == 0)) {
+        return 0;
+    }
+
+    if (hotplugEv.fd < 0) {
+        hotplugEv.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        hotplugEv.handler = sioHotplugOnEvent;
+        if ((hotplugEv.fd < 0) || (sioEventAdd(&hotplugEv, EPOLLIN) < 0)) {
+            LogMsg(LOG_WARNING, "[SIO] inotify unavailable, errno = %d\n",
+                errno);
+            if (hotplugEv.fd >= 0) {
+                close(hotplugEv.fd);
+                hotplugEv.fd = -1;
+            }
+            return -1;
+        }
+    }
+
+    base = sioHotplugBase(name);
+    if (base == name) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(base - name), name);
+    }
+    port->watch = inotify_add_watch(hotplugEv.fd, dir,
+        IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+    if (port->watch < 0) {
+        return -1;
+    }
+
+    for (i = 0 ; i < watchedCount ; i++) {
+        if (watched[i] == port) {
+            return 0;
+        }
+    }
+    watched[watchedCount++] = port;
+    return 0;
+}
+
+void sioHotplugClose(void)
+{
+    if (hotplugEv.fd >= 0) {
+        sioEventDel(&hotplugEv);
+        close(hotplugEv.fd);
+        hotplugEv.fd = -1;
+    }
+    watchedCount = 0;
+}
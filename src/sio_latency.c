@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sio_agent.h"
+
+/* time from the wakeup that read a message to the write that finished it */
+struct SioHistogram sioLatencyToClient = { "serial->client" };
+struct SioHistogram sioLatencyToSerial = { "client->serial" };
+
+/* how late the loop woke for the --jitter probe */
+struct SioHistogram sioLatencyWakeup = { "wakeup" };
+
+/*
+ * Log-linear buckets in the style of HdrHistogram: values below
+ * SIO_HIST_SUB get a bucket each, above that every power of two is split
+ * into SIO_HIST_SUB / 2 buckets, so a value is off by at most 1/32.
+ */
+static inline unsigned int sioHistIndex(uint64_t ns)
+{
+    unsigned int shift;
+
+    if (ns < SIO_HIST_SUB) {
+        return ns;
+    }
+    shift = 63 - __builtin_clzll(ns) - (SIO_HIST_SUB_BITS - 1);
+    if (shift >= SIO_HIST_SHIFTS) {
+        return SIO_HIST_BUCKETS - 1;
+    }
+    return shift * (SIO_HIST_SUB / 2) + (ns >> shift);
+}
+
+/* the largest value that lands in bucket idx */
+static uint64_t sioHistValue(unsigned int idx)
+{
+    unsigned int shift;
+
+    if (idx < SIO_HIST_SUB) {
+        return idx;
+    }
+    shift = idx / (SIO_HIST_SUB / 2) - 1;
+    return ((uint64_t)(idx - shift * (SIO_HIST_SUB / 2) + 1) << shift) - 1;
+}
+
+/**
+ * Adds one sample.  Lock-free: counters are bumped with relaxed atomics so 
+ * a dump from another context sees a consistent-enough view. 
+ */
+void sioHistRecord(struct SioHistogram *h, uint64_t ns)
+{
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[sioHistIndex(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    while ((ns > max) && !__atomic_compare_exchange_n(&h->max, &max, ns, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Returns the value below which the given fraction of the samples fall. 
+ * 
+ * @param h the histogram
+ * @param fraction e.g. 0.99 for p99
+ * 
+ * @return uint64_t the percentile in ns, 0 if there are no samples
+ */
+uint64_t sioHistPercentile(const struct SioHistogram *h, double fraction)
+{
+    const unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    const unsigned long want = (unsigned long)(fraction * count + 0.5);
+    unsigned long seen = 0;
+    unsigned int i;
+
+    if (count == 0) {
+        return 0;
+    }
+    for (i = 0 ; i < SIO_HIST_BUCKETS ; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if ((seen >= want) && (seen > 0)) {
+            const uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            const uint64_t v = sioHistValue(i);
+            return (v < max) ? v : max;
+        }
+    }
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+/* formats a latency with a unit that keeps it readable */
+static const char *sioFmtNs(char *buff, size_t size, uint64_t ns)
+{
+    if (ns < 10000) {
+        snprintf(buff, size, "%uns", (unsigned)ns);
+    } else if (ns < 10000000) {
+        snprintf(buff, size, "%.1fus", ns / 1e3);
+    } else {
+        snprintf(buff, size, "%.1fms", ns / 1e6);
+    }
+    return buff;
+}
+
+/**
+ * Writes a one-line summary of a histogram, p50/p99/p99.9 and max. 
+ * 
+ * @return int the number of characters written, as snprintf()
+ */
+int sioHistFormat(const struct SioHistogram *h, char *buff, size_t size)
+{
+    char p50[16], p99[16], p999[16], max[16];
+
+    return snprintf(buff, size, "%s: n=%lu p50=%s p99=%s p99.9=%s max=%s",
+        h->name, __atomic_load_n(&h->count, __ATOMIC_RELAXED),
+        sioFmtNs(p50, sizeof(p50), sioHistPercentile(h, 0.50)),
+        sioFmtNs(p99, sizeof(p99), sioHistPercentile(h, 0.99)),
+        sioFmtNs(p999, sizeof(p999), sioHistPercentile(h, 0.999)),
+        sioFmtNs(max, sizeof(max), __atomic_load_n(&h->max, __ATOMIC_RELAXED)));
+}
+
+/* logs both directions, normally in response to SIGUSR1 */
+void sioLatencyDump(void)
+{
+    char line[160];
+
+    sioHistFormat(&sioLatencyToClient, line, sizeof(line));
+    LogMsg(LOG_NOTICE, "[SIO] latency %s\n", line);
+    sioHistFormat(&sioLatencyToSerial, line, sizeof(line));
+    LogMsg(LOG_NOTICE, "[SIO] latency %s\n", line);
+    if (sioLatencyWakeup.count > 0) {
+        sioHistFormat(&sioLatencyWakeup, line, sizeof(line));
+        LogMsg(LOG_NOTICE, "[SIO] latency %s\n", line);
+    }
+}
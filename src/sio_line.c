@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sio_agent.h"
+
+/*
+ * Word-at-a-time search for CR or LF.  A word is loaded with memcpy() so the
+ * scan is safe on targets that fault on unaligned loads; each load checks
+ * sizeof(unsigned long) bytes using the classic "has zero byte" trick.
+ */
+#define SIO_WORD_ONES  (~0UL / 0xff)
+#define SIO_WORD_HIGHS (SIO_WORD_ONES * 0x80)
+
+static inline unsigned long sioWordHasByte(unsigned long w, unsigned char b)
+{
+    const unsigned long x = w ^ (SIO_WORD_ONES * b);
+
+    return (x - SIO_WORD_ONES) & ~x & SIO_WORD_HIGHS;
+}
+
+/**
+ * Finds the first CR or LF.
+ *
+ * @param p the bytes to search
+ * @param n the number of bytes in p
+ *
+ * @return size_t the offset of the terminator, or n if there is none
+ */
+size_t sioFindEol(const char *p, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + sizeof(unsigned long) <= n; i += sizeof(unsigned long)) {
+        unsigned long w;
+        memcpy(&w, p + i, sizeof(w));
+        if (sioWordHasByte(w, '\r') | sioWordHasByte(w, '\n')) {
+            break;
+        }
+    }
+    for (; i < n; i++) {
+        if ((p[i] == '\r') || (p[i] == '\n')) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/**
+ * Allocates the buffer of a line assembler.
+ *
+ * @param lb the assembler
+ * @param maxLine the longest line accepted, terminator excluded
+ * @param maxBatch the most bytes of complete lines handed out at once;
+ *                 raised to fit at least one line of maxLine bytes
+ *
+ * @return int 0 on success, -1 if memory ran out
+ */
+int sioLineBufInit(struct SioLineBuf *lb, unsigned int maxLine,
+    unsigned int maxBatch)
+{
+    memset(lb, 0, sizeof(*lb));
+    if (maxBatch < maxLine + 1) {
+        maxBatch = maxLine + 1;
+    }
+    lb->data = malloc(maxBatch);
+    if (lb->data == 0) {
+        return -1;
+    }
+    lb->size = maxBatch;
+    lb->maxLine = maxLine;
+    return 0;
+}
+
+void sioLineBufFree(struct SioLineBuf *lb)
+{
+    free(lb->data);
+    lb->data = 0;
+}
+
+/* cuts [from, to) out of the buffer; only overlong lines take this path */
+static void sioLineBufCut(struct SioLineBuf *lb, unsigned int from,
+    unsigned int to)
+{
+    memmove(lb->data + from, lb->data + to, lb->len - to);
+    lb->len -= to - from;
+    lb->scan = from;
+}
+
+/**
+ * Splits the bytes added since the last call into lines.  Complete lines
+ * are gathered at the front of the buffer so they can go out in a single
+ * write; a partial line stays behind them until the rest arrives.  A line
+ * longer than maxLine is dropped up to and including its terminator.
+ *
+ * @param lb the assembler, with new bytes appended at data + len
+ *
+ * @return unsigned int the number of bytes of complete lines, terminators
+ *         included, at the start of data; release them with
+ *         sioLineBufConsume()
+ */
+unsigned int sioLineAssemble(struct SioLineBuf *lb)
+{
+    while (lb->scan < lb->len) {
+        const size_t hit = sioFindEol(lb->data + lb->scan,
+            lb->len - lb->scan);
+        unsigned int eol;
+
+        if (hit == lb->len - lb->scan) {
+            lb->scan = lb->len;
+            break;
+        }
+
+        eol = lb->scan + hit;
+        if (lb->discard) {
+            /* tail end of a line already reported as overlong */
+            sioLineBufCut(lb, lb->done, eol + 1);
+            lb->discard = 0;
+        } else if (eol - lb->done > lb->maxLine) {
+            LogMsg(LOG_NOTICE, "[SIO] dropped %d byte client line\n",
+                (int)(eol - lb->done));
+            sioLineBufCut(lb, lb->done, eol + 1);
+        } else {
+            lb->done = lb->scan = eol + 1;
+        }
+    }
+
+    if (!lb->discard && (lb->len - lb->done > lb->maxLine)) {
+        LogMsg(LOG_NOTICE, "[SIO] client line over %d bytes, dropping it\n",
+            (int)lb->maxLine);
+        lb->discard = 1;
+    }
+    if (lb->discard) {
+        /* nothing of an overlong line is kept */
+        lb->len = lb->scan = lb->done;
+    }
+
+    return lb->done;
+}
+
+/* releases the complete lines returned by sioLineAssemble() */
+void sioLineBufConsume(struct SioLineBuf *lb)
+{
+    if (lb->done > 0) {
+        memmove(lb->data, lb->data + lb->done, lb->len - lb->done);
+        lb->len -= lb->done;
+        lb->scan -= lb->done;
+        lb->done = 0;
+    }
+}
@@ -1,12 +1,108 @@
-#include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <string.h>
+
 #include "sio_agent.h"
 
-char *sioHandleLocal(char *qmlString)
+/*
+ * Commands answered by the agent itself instead of the device.  Each one is
+ * a whole line; the reply is in the "name=value" form the device uses for
+ * its own property updates.
+ */
+typedef int (*SioLocalHandler)(struct SioPort *port, char *reply,
+    size_t size);
+
+struct SioLocalCmd {
+    const char *name;
+    SioLocalHandler handler;
+};
+
+static unsigned long localCount;    /* commands answered since start-up */
+
+static int sioLocalVersion(struct SioPort *port, char *reply, size_t size)
+{
+    return snprintf(reply, size, "sio.version=%s\n", SIO_VERSION);
+}
+
+static int sioLocalStats(struct SioPort *port, char *reply, size_t size)
 {
-    return((char *)0);
+    unsigned long dropMsgs;
+    unsigned long dropBytes;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+
+    sioQueueTotals(&dropMsgs, &dropBytes);
+    sioCacheTotals(&cacheHits, &cacheMisses);
+    return snprintf(reply, size,
+        "sio.stats=clients:%d local:%lu drops:%lu/%lu"
+        " toClient:%lu toSerial:%lu cache:%lu/%lu\n",
+        port->clientCount, localCount, dropMsgs, dropBytes,
+        sioLatencyToClient.count, sioLatencyToSerial.count,
+        cacheHits, cacheMisses);
+}
+
+static int sioLocalBaud(struct SioPort *port, char *reply, size_t size)
+{
+    return snprintf(reply, size, "sio.baud=%u\n", port->rate);
+}
+
+static int sioLocalPort(struct SioPort *port, char *reply, size_t size)
+{
+    const int len = snprintf(reply, size, "sio.port=");
+
+    return len + sioTtyStatus(port, reply + len, size - len);
+}
+
+static const struct SioLocalCmd cmdVersion = { "sio.version", sioLocalVersion };
+static const struct SioLocalCmd cmdStats = { "sio.stats", sioLocalStats };
+static const struct SioLocalCmd cmdBaud = { "sio.baud", sioLocalBaud };
+static const struct SioLocalCmd cmdPort = { "sio.port", sioLocalPort };
+
+/**
+ * Answers a line if it is one of the agent's local commands.  The table is
+ * resolved at compile time by a switch on the line length, so a line meant
+ * for the device costs that switch and at most one memcmp().
+ *
+ * @param port the port the line was sent to
+ * @param line the line, without its terminator
+ * @param len the number of bytes in line
+ * @param reply where the answer is written, NUL-terminated
+ * @param size the number of bytes in reply
+ *
+ * @return int the length of the reply, or 0 if the line should go on to
+ *         the device
+ */
+int sioHandleLocal(struct SioPort *port, const char *line, size_t len,
+    char *reply, size_t size)
+{
+    const struct SioLocalCmd *cmd;
+    int replyLen;
+
+    switch (len) {
+    case sizeof("sio.baud") - 1:    /* and sio.port */
+        cmd = (line[4] == 'b') ? &cmdBaud : &cmdPort;
+        break;
+
+    case sizeof("sio.stats") - 1:
+        cmd = &cmdStats;
+        break;
+
+    case sizeof("sio.version") - 1:
+        cmd = &cmdVersion;
+        break;
+
+    default:
+        return 0;
+    }
+
+    if (memcmp(line, cmd->name, len) != 0) {
+        return 0;
+    }
+
+    localCount++;
+    replyLen = cmd->handler(port, reply, size);
+    if (replyLen >= (int)size) {
+        replyLen = size - 1;
+    }
+    LogMsg(LOG_INFO, "[SIO] local %s => \"%s\"\n", cmd->name, reply);
+    return replyLen;
 }
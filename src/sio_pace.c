@@ -0,0 +1,242 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <asm-generic/ioctls.h>
+
+#include "sio_agent.h"
+
+/*
+ * Paced serial output.  Without --pace the serial queue is written as fast
+ * as the driver takes it, which lets a slow device's input FIFO overflow
+ * or runs frames together on a bus that needs the line idle between them.
+ *
+ * --pace=<percent>[,<gap_us>] writes at most <percent> of the line rate,
+ * counting 10 bits a character (8N1), and keeps the driver only
+ * SIO_PACE_LEAD_NS ahead of the wire instead of filling its buffer; at 100%
+ * whatever is queued goes at once when the line is nearly idle.  With
+ * a gap each frame, the lines a client sent in one go, is written on its
+ * own once the line has been idle for <gap_us>; on an RS-485 port the
+ * RTS delays before and after sending count as part of the frame.
+ *
+ * Where the wire is comes from an estimate, corrected with TIOCOUTQ by what
+ * the driver still holds, so a device held off by flow control doesn't get
+ * more output pushed at it.  The event loop only wakes in whole
+ * milliseconds, so a gap can come out up to a millisecond longer.
+ */
+#define SIO_PACE_LEAD_NS 2000000ULL     /* driver fill ahead of the wire */
+#define SIO_PACE_BITS_PER_CHAR 10
+#define SIO_PACE_GAP_MAX_US 1000000
+#define SIO_PACE_IOV 64                 /* as many as sioQueueFlushTo() gives */
+
+/* what one sioPaceFlush() may write */
+struct SioPaceBudget {
+    int fd;
+    size_t bytes;               /* left to write */
+    size_t written;
+    int oneFrame;               /* stop after the first queued message */
+    int frameDone;              /* and it has gone out completely */
+    int refused;                /* the device took less than offered */
+};
+
+/**
+ * Takes the argument of --pace or the pace key, <percent>[,<gap_us>].
+ * A percent of 0 turns pacing off.
+ *
+ * @return int 0 on success, -1 if arg is malformed
+ */
+int sioPaceParse(const char *arg, unsigned int *percent, unsigned int *gapUs)
+{
+    char *end;
+    unsigned long pct;
+    unsigned long us = 0;
+
+    pct = strtoul(arg, &end, 10);
+    if ((end == arg) || (pct > 100)) {
+        return -1;
+    }
+    if (*end == ',') {
+        const char *p = end + 1;
+
+        us = strtoul(p, &end, 10);
+        if ((end == p) || (us > SIO_PACE_GAP_MAX_US)) {
+            return -1;
+        }
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *percent = pct;
+    *gapUs = us;
+    return 0;
+}
+
+/* sets a port's pacing; output already queued is looked at again at once */
+void sioPaceSet(struct SioPort *port, unsigned int percent, unsigned int gapUs)
+{
+    port->pacePercent = percent;
+    port->paceGapUs = gapUs;
+    port->paceAt = (port->ttyOut.bytes > 0) ? 1 : 0;
+}
+
+/* ns a character takes on the wire at the line rate */
+static uint64_t sioPaceCharNs(const struct SioPort *port)
+{
+    const unsigned int rate = (port->rate > 0) ?
+        port->rate : SIO_DEFAULT_SERIAL_RATE;
+
+    return (SIO_PACE_BITS_PER_CHAR * 1000000000ULL + rate - 1) / rate;
+}
+
+/* ns the line stays busy around a frame besides its characters */
+static uint64_t sioPaceFrameNs(const struct SioPort *port)
+{
+    uint64_t ns = port->paceGapUs * 1000ULL;
+
+    if (port->rs485) {
+        ns += (port->rtsBeforeMs + port->rtsAfterMs) * 1000000ULL;
+    }
+    return ns;
+}
+
+/* passes on at most budget->bytes of what sioQueueFlushTo() offers */
+static ssize_t sioPaceWriter(void *ctx, const struct iovec *iov, int count)
+{
+    struct SioPaceBudget *budget = ctx;
+    struct iovec cut[SIO_PACE_IOV];
+    size_t offered = 0;
+    ssize_t cnt;
+    int n;
+
+    if (budget->bytes == 0) {
+        return 0;
+    }
+    if (budget->oneFrame) {
+        count = 1;
+    }
+    for (n = 0 ; (n < count) && (n < SIO_PACE_IOV) &&
+        (offered < budget->bytes) ; n++) {
+        cut[n] = iov[n];
+        if (cut[n].iov_len > budget->bytes - offered) {
+            cut[n].iov_len = budget->bytes - offered;
+        }
+        offered += cut[n].iov_len;
+    }
+
+    cnt = writev(budget->fd, cut, n);
+    if (cnt < 0) {
+        budget->refused = (errno == EAGAIN);
+        return cnt;
+    }
+    budget->refused = ((size_t)cnt < offered);
+    budget->bytes -= cnt;
+    budget->written += cnt;
+    if (budget->oneFrame && ((size_t)cnt == iov[0].iov_len)) {
+        budget->frameDone = 1;
+        budget->bytes = 0;
+    }
+    return cnt;
+}
+
+/**
+ * Writes as much of the serial output queue as the pace allows, as
+ * sioTtyFlush() does without pacing.  When the pace holds output back,
+ * port->paceAt says when to call again; it is 0 when the queue is empty
+ * or the device itself is full, which EPOLLOUT reports.
+ *
+ * @return ssize_t the number of bytes still queued, or -1 on a write error
+ */
+ssize_t sioPaceFlush(struct SioPort *port)
+{
+    struct SioQueue *q = &port->ttyOut;
+    const uint64_t now = sioNowNs();
+    const uint64_t charNs = sioPaceCharNs(port);
+    const uint64_t pacedNs = charNs * 100 / port->pacePercent;
+    const uint64_t frameNs = sioPaceFrameNs(port);
+    struct SioPaceBudget budget;
+    uint64_t wireAt = port->paceWireAt;
+    int pending;
+    ssize_t left;
+
+    port->paceAt = 0;
+    if (q->bytes == 0) {
+        return 0;
+    }
+
+    /* what the driver still holds keeps the line busy at least that long */
+    if ((ioctl(port->serialOutFd, TIOCOUTQ, &pending) == 0) && (pending > 0)) {
+        const uint64_t busyAt = now + pending * charNs +
+            ((q->offset == 0) ? frameNs : 0);
+
+        if (busyAt > wireAt) {
+            wireAt = busyAt;
+        }
+    }
+
+    if ((frameNs > 0) && (q->offset == 0) && (wireAt > now)) {
+        /* a new frame waits until the line has been idle for the gap */
+        port->paceAt = wireAt;
+        return q->bytes;
+    } else if (wireAt > now + SIO_PACE_LEAD_NS) {
+        port->paceAt = wireAt - SIO_PACE_LEAD_NS;
+        return q->bytes;
+    } else if (wireAt < now) {
+        wireAt = now;
+    }
+
+    budget.fd = port->serialOutFd;
+    /* at the full rate the UART sets the pace, only the gaps need keeping */
+    budget.bytes = (port->pacePercent < 100) ?
+        (now + SIO_PACE_LEAD_NS - wireAt) / pacedNs + 1 : (size_t)-1;
+    budget.written = 0;
+    budget.oneFrame = (frameNs > 0);
+    budget.frameDone = 0;
+    budget.refused = 0;
+    left = sioQueueFlushTo(q, sioPaceWriter, &budget);
+
+    wireAt += budget.written * pacedNs;
+    if (budget.frameDone) {
+        wireAt += frameNs;
+    }
+    port->paceWireAt = wireAt;
+
+    if ((left > 0) && !budget.refused) {
+        /* held by the pace rather than the device */
+        port->paceAt = wireAt;
+        if (!budget.frameDone && (wireAt > now + SIO_PACE_LEAD_NS)) {
+            port->paceAt -= SIO_PACE_LEAD_NS;
+        }
+    }
+    return left;
+}
+
+/**
+ * Keeps the count of time a port's output spent held up by flow control.
+ * Call after each flush of the serial queue.
+ *
+ * @param port the port
+ * @param refused whether the device refused some of the output; with
+ *        RTS/CTS that counts only while CTS is down, with XON/XOFF, which
+ *        the driver handles out of sight, every refusal counts
+ */
+void sioFlowAccount(struct SioPort *port, int refused)
+{
+    const uint64_t now = sioNowNs();
+    int held = refused;
+
+    if (refused && (port->flow == SIO_FLOW_RTSCTS)) {
+        int lines;
+
+        held = (ioctl(port->serialOutFd, TIOCMGET, &lines) == 0) &&
+            !(lines & TIOCM_CTS);
+    }
+
+    if (held && (port->flowBlockedAt == 0)) {
+        port->flowBlockedAt = now;
+        port->flowStalls++;
+    } else if (!held && (port->flowBlockedAt != 0)) {
+        port->flowBlockedNs += now - port->flowBlockedAt;
+        port->flowBlockedAt = 0;
+    }
+}
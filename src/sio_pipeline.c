@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sio_agent.h"
+
+/*
+ * Request/reply correlation.  With --pipeline each port lets up to depth
+ * requests be outstanding on the serial link; the rest wait in arrival
+ * order and go out as replies come back.  A device line that answers a
+ * request goes only to the client that sent it.
+ *
+ * Without reply rules every client line is a request and every device line
+ * answers the oldest outstanding one.  With rules only client lines that
+ * start with a rule's request prefix are tracked, and a device line that
+ * starts with the rule's reply prefix answers the oldest outstanding
+ * request of that rule; every other line passes through as before.
+ *
+ * Matching is by order only, so a request the device never answers shifts
+ * the replies of its rule by one until it times out.  The timeout starts
+ * when the request has been written to the device, so time it spent queued
+ * behind --pace, flow control or an unplugged device doesn't count, and
+ * until then no device line is taken for its reply.
+ */
+#define SIO_PIPELINE_DEFAULT_TIMEOUT_MS 1000
+
+/* a line waiting for room in the window */
+struct SioPipeWait {
+    struct SioPipeWait *next;
+    struct SioClient *client;
+    int rule;                   /* as in SioPipeReq, -2 if not tracked */
+    size_t len;
+    char data[];
+};
+
+struct SioPipeRule {
+    char *request;
+    size_t requestLen;
+    char *reply;
+    size_t replyLen;
+};
+
+static unsigned int pipeDepth;          /* 0 when correlation is off */
+static uint64_t pipeTimeout;            /* ns */
+static struct SioPipeRule pipeRules[SIO_PIPELINE_MAX];
+static int ruleCount;
+
+static unsigned long pipeMatched;
+static unsigned long pipeTimedOut;
+
+/**
+ * Turns correlation on from an argument of the form <depth>[,<ms>].
+ *
+ * @return int 0 on success, -1 if arg is malformed
+ */
+int sioPipelineSetup(const char *arg)
+{
+    char *end;
+    unsigned long depth = strtoul(arg, &end, 10);
+    unsigned long ms = SIO_PIPELINE_DEFAULT_TIMEOUT_MS;
+
+    if ((end == arg) || (depth == 0) || (depth > SIO_PIPELINE_MAX)) {
+        return -1;
+    }
+    if (*end == ',') {
+        const char *p = end + 1;
+
+        ms = strtoul(p, &end, 10);
+        if ((end == p) || (ms == 0)) {
+            return -1;
+        }
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+
+    pipeDepth = depth;
+    pipeTimeout = ms * 1000000ULL;
+    return 0;
+}
+
+/**
+ * Adds a reply rule from an argument of the form <request>,<reply>, both
+ * line prefixes.
+ *
+ * @return int 0 on success, -1 if arg is malformed or the table is full
+ */
+int sioPipelineAddRule(const char *arg)
+{
+    struct SioPipeRule *r = &pipeRules[ruleCount];
+    const char *comma = strchr(arg, ',');
+
+    if ((ruleCount >= SIO_PIPELINE_MAX) || (comma == 0) || (comma == arg) ||
+        (comma[1] == '\0')) {
+        return -1;
+    }
+
+    r->requestLen = comma - arg;
+    r->request = malloc(r->requestLen);
+    r->replyLen = strlen(comma + 1);
+    r->reply = malloc(r->replyLen);
+    if ((r->request == 0) || (r->reply == 0)) {
+        free(r->request);
+        free(r->reply);
+        return -1;
+    }
+    memcpy(r->request, arg, r->requestLen);
+    memcpy(r->reply, comma + 1, r->replyLen);
+    ruleCount++;
+    return 0;
+}
+
+int sioPipelineEnabled(void)
+{
+    return pipeDepth > 0;
+}
+
+/* the rule tracking a client line, -1 to match by order, -2 for none */
+static int sioPipelineRequestRule(const char *line, size_t len)
+{
+    int i;
+
+    if (ruleCount == 0) {
+        return -1;
+    }
+    for (i = 0 ; i < ruleCount ; i++) {
+        if ((len >= pipeRules[i].requestLen) &&
+            (memcmp(line, pipeRules[i].request,
+            pipeRules[i].requestLen) == 0)) {
+            return i;
+        }
+    }
+    return -2;
+}
+
+/* queues a line for the device and, if tracked, opens its slot */
+static int sioPipelineSend(struct SioPort *port, struct SioClient *client,
+    int rule, const char *line, size_t len)
+{
+    struct SioPipeline *pipe = &port->pipe;
+
+    if (sioTtyWrite(port, line, len) < 0) {
+        return -1;
+    }
+    if (rule != -2) {
+        struct SioPipeReq *req = &pipe->inFlight[pipe->count++];
+
+        req->client = client;
+        req->rule = rule;
+        req->lineEnd = port->ttyOut.consumed + port->ttyOut.bytes;
+        req->sentAt = 0;
+    }
+    return 0;
+}
+
+/* sends waiting lines while the window has room */
+static void sioPipelineRelease(struct SioPort *port)
+{
+    struct SioPipeline *pipe = &port->pipe;
+    struct SioPipeWait *w;
+
+    while (((w = pipe->waitHead) != 0) &&
+        ((w->rule == -2) || (pipe->count < pipeDepth))) {
+        pipe->waitHead = w->next;
+        if (pipe->waitHead == 0) {
+            pipe->waitTail = 0;
+        }
+        pipe->waitBytes -= w->len;
+
+        if (sioPipelineSend(port, w->client, w->rule, w->data, w->len) < 0) {
+            LogMsg(LOG_NOTICE, "[SIO] serial queue full, dropping client\n");
+            sioClientClose(w->client);
+        }
+        free(w);
+    }
+}
+
+/* drops the oldest waiting lines until len more bytes fit */
+static void sioPipelineDropOldest(struct SioPort *port, size_t len)
+{
+    struct SioPipeline *pipe = &port->pipe;
+
+    while ((pipe->waitHead != 0) &&
+        (pipe->waitBytes + len > port->ttyOut.maxBytes)) {
+        struct SioPipeWait *w = pipe->waitHead;
+
+        pipe->waitHead = w->next;
+        if (pipe->waitHead == 0) {
+            pipe->waitTail = 0;
+        }
+        pipe->waitBytes -= w->len;
+        sioQueueDropped(&port->ttyOut, w->len);
+        free(w);
+    }
+}
+
+/**
+ * Sends a client line on to the device, or holds it until the window has
+ * room.  Lines that are not requests wait too while anything is held, so
+ * the device still sees every line in the order it arrived.  The lines
+ * held are capped at the serial queue's size, and a line that doesn't fit
+ * is dealt with by the serial queue's policy and counted in its drops.
+ *
+ * @param client the client the line came from
+ * @param line the line including its terminator
+ * @param len the number of bytes in line
+ *
+ * @return int 0 on success or if the line was dropped by policy, -1 if
+ *         the serial queue or the wait list refused the line and the client
+ *         has to be dropped
+ */
+int sioPipelineSubmit(struct SioClient *client, const char *line, size_t len)
+{
+    struct SioPort *port = client->port;
+    struct SioPipeline *pipe = &port->pipe;
+    const int rule = sioPipelineRequestRule(line, len);
+    struct SioPipeWait *w;
+
+    if ((pipe->waitHead == 0) &&
+        ((rule == -2) || (pipe->count < pipeDepth))) {
+        return sioPipelineSend(port, client, rule, line, len);
+    }
+
+    /* the wait list is capped like the serial queue, with its policy */
+    if ((port->ttyOut.maxBytes > 0) &&
+        (pipe->waitBytes + len > port->ttyOut.maxBytes)) {
+        if (port->ttyOut.policy == SIO_QUEUE_DISCONNECT) {
+            sioQueueDropped(&port->ttyOut, len);
+            return -1;
+        } else if (port->ttyOut.policy == SIO_QUEUE_DROP_OLDEST) {
+            sioPipelineDropOldest(port, len);
+        }
+        if (pipe->waitBytes + len > port->ttyOut.maxBytes) {
+            sioQueueDropped(&port->ttyOut, len);
+            return 0;
+        }
+    }
+
+    w = malloc(sizeof(*w) + len);
+    if (w == 0) {
+        LogMsg(LOG_ERR, "[SIO] %s(): out of memory\n", __FUNCTION__);
+        sioQueueDropped(&port->ttyOut, len);
+        return -1;
+    }
+    w->next = 0;
+    w->client = client;
+    w->rule = rule;
+    w->len = len;
+    memcpy(w->data, line, len);
+    if (pipe->waitTail != 0) {
+        pipe->waitTail->next = w;
+    } else {
+        pipe->waitHead = w;
+    }
+    pipe->waitTail = w;
+    pipe->waitBytes += len;
+    return 0;
+}
+
+/**
+ * Offers a device line to the requests outstanding on its port.  A reply
+ * goes to the client that asked, or nowhere if that client is gone, and
+ * lets the next waiting line out; the caller flushes the serial queue.
+ *
+ * @param port the port the line was received on
+ * @param line the line including its LF
+ * @param len the number of bytes in line
+ *
+ * @return int 1 if the line was a reply, 0 if it is for every client
+ */
+int sioPipelineReply(struct SioPort *port, const char *line, size_t len)
+{
+    struct SioPipeline *pipe = &port->pipe;
+    struct SioClient *client;
+    unsigned int i;
+
+    /* the oldest request this line can answer, among those written */
+    for (i = 0 ; i < pipe->count ; i++) {
+        const int rule = pipe->inFlight[i].rule;
+
+        if (pipe->inFlight[i].sentAt == 0) {
+            i = pipe->count;    /* still queued, the device hasn't seen it */
+            break;
+        } else if ((rule < 0) || ((len >= pipeRules[rule].replyLen) &&
+            (memcmp(line, pipeRules[rule].reply,
+            pipeRules[rule].replyLen) == 0))) {
+            break;
+        }
+    }
+    if (i == pipe->count) {
+        return 0;       /* unsolicited, or its request timed out */
+    }
+
+    client = pipe->inFlight[i].client;
+    pipe->count--;
+    memmove(&pipe->inFlight[i], &pipe->inFlight[i + 1],
+        (pipe->count - i) * sizeof(pipe->inFlight[0]));
+    pipeMatched++;
+
+    if (client != 0) {
+        sioClientSend(client, line, len);
+    }
+    sioPipelineRelease(port);
+    return 1;
+}
+
+/**
+ * Starts the timeout of the requests whose lines have now left the serial
+ * output queue.  Call after each flush of the queue.
+ */
+void sioPipelineWritten(struct SioPort *port, uint64_t now)
+{
+    struct SioPipeline *pipe = &port->pipe;
+    unsigned int i;
+
+    /* written in order, so the ones still queued are at the back */
+    for (i = 0 ; i < pipe->count ; i++) {
+        struct SioPipeReq *req = &pipe->inFlight[i];
+
+        if (req->sentAt != 0) {
+            continue;
+        } else if (req->lineEnd > port->ttyOut.consumed) {
+            break;
+        }
+        req->sentAt = now;
+    }
+}
+
+/* when the oldest outstanding request of a port times out, 0 for never */
+uint64_t sioPipelineDeadline(const struct SioPort *port)
+{
+    return ((port->pipe.count > 0) && (port->pipe.inFlight[0].sentAt != 0)) ?
+        port->pipe.inFlight[0].sentAt + pipeTimeout : 0;
+}
+
+/**
+ * Gives up on requests that have been outstanding for longer than the
+ * timeout, letting waiting lines out; the caller flushes the serial queue.
+ *
+ * @return int the number of requests given up
+ */
+int sioPipelineExpire(struct SioPort *port, uint64_t now)
+{
+    struct SioPipeline *pipe = &port->pipe;
+    unsigned int n = 0;
+
+    /* sent in order, so the expired ones are at the front */
+    while ((n < pipe->count) && (pipe->inFlight[n].sentAt != 0) &&
+        (now - pipe->inFlight[n].sentAt >= pipeTimeout)) {
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    LogMsg(LOG_INFO, "[SIO] port %d: %u request(s) timed out\n", port->index,
+        n);
+    pipeTimedOut += n;
+    pipe->count -= n;
+    memmove(&pipe->inFlight[0], &pipe->inFlight[n],
+        pipe->count * sizeof(pipe->inFlight[0]));
+    sioPipelineRelease(port);
+    return n;
+}
+
+/* forgets a closing client: its replies are dropped, its waiting lines too */
+void sioPipelineDropClient(struct SioClient *client)
+{
+    struct SioPipeline *pipe = &client->port->pipe;
+    struct SioPipeWait **pw = &pipe->waitHead;
+    struct SioPipeWait *last = 0;
+    unsigned int i;
+
+    for (i = 0 ; i < pipe->count ; i++) {
+        if (pipe->inFlight[i].client == client) {
+            pipe->inFlight[i].client = 0;
+        }
+    }
+
+    while (*pw != 0) {
+        struct SioPipeWait *w = *pw;
+
+        if (w->client == client) {
+            *pw = w->next;
+            pipe->waitBytes -= w->len;
+            free(w);
+        } else {
+            last = w;
+            pw = &w->next;
+        }
+    }
+    pipe->waitTail = last;
+}
+
+/* releases everything a port holds, as it is shut down */
+void sioPipelineFree(struct SioPort *port)
+{
+    struct SioPipeline *pipe = &port->pipe;
+
+    while (pipe->waitHead != 0) {
+        struct SioPipeWait *w = pipe->waitHead;
+
+        pipe->waitHead = w->next;
+        free(w);
+    }
+    pipe->waitTail = 0;
+    pipe->waitBytes = 0;
+    pipe->count = 0;
+}
+
+/* logs the counters, normally in response to SIGUSR1 */
+void sioPipelineDump(void)
+{
+    if (pipeDepth > 0) {
+        LogMsg(LOG_NOTICE, "[SIO] pipeline: %lu matched, %lu timed out\n",
+            pipeMatched, pipeTimedOut);
+    }
+}
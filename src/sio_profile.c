@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "sio_agent.h"
+
+/*
+ * Socket profiles.  Without --profile client sockets keep the system
+ * defaults and every message is written as soon as it is queued.
+ *
+ * latency     TCP_NODELAY, keepalive and a small send buffer, so updates
+ *             leave at once and a backlog stays in the agent's own queue
+ *             where its drop policy applies
+ * throughput  output is held for a short window and then written in one
+ *             go under TCP_CORK, so a dump leaves in full segments
+ * adaptive    as latency, with the window switched on per port while the
+ *             device sends more than SIO_PROFILE_HIGH_RATE lines a second
+ */
+#define SIO_PROFILE_DEFAULT_WINDOW_MS 2
+#define SIO_PROFILE_SNDBUF (16 * 1024)
+#define SIO_PROFILE_SAMPLE_NS 50000000ULL       /* rate measurement period */
+#define SIO_PROFILE_HIGH_RATE 1000              /* lines/s to start holding */
+#define SIO_PROFILE_LOW_RATE 250                /* lines/s to stop again */
+
+enum SioProfile {
+    SIO_PROFILE_NONE,
+    SIO_PROFILE_LATENCY,
+    SIO_PROFILE_THROUGHPUT,
+    SIO_PROFILE_ADAPTIVE
+};
+
+static int profile = SIO_PROFILE_NONE;
+static uint64_t profileWindow;          /* ns */
+
+/**
+ * Selects the profile from an argument of the form <name>[,<ms>], where
+ * ms is how long throughput output is held.
+ *
+ * @return int 0 on success, -1 if arg is malformed
+ */
+int sioProfileSetup(const char *arg)
+{
+    static const struct {
+        const char *name; int profile;
+    } profileTable[] = {
+        { "latency",    SIO_PROFILE_LATENCY },
+        { "throughput", SIO_PROFILE_THROUGHPUT },
+        { "adaptive",   SIO_PROFILE_ADAPTIVE }
+    };
+    const char *comma = strchr(arg, ',');
+    const size_t nameLen = (comma != 0) ? (size_t)(comma - arg) : strlen(arg);
+    unsigned long ms = SIO_PROFILE_DEFAULT_WINDOW_MS;
+    unsigned i;
+
+    if (comma != 0) {
+        char *end;
+
+        ms = strtoul(comma + 1, &end, 10);
+        if ((end == comma + 1) || (*end != '\0') || (ms == 0)) {
+            return -1;
+        }
+    }
+
+    for (i = 0 ; i < (sizeof(profileTable) / sizeof(profileTable[0])) ; i++) {
+        if ((strlen(profileTable[i].name) == nameLen) &&
+            (memcmp(profileTable[i].name, arg, nameLen) == 0)) {
+            profile = profileTable[i].profile;
+            profileWindow = ms * 1000000ULL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void sioProfileSetOpt(int fd, int level, int name, int value)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        LogMsg(LOG_DEBUG, "[SIO] setsockopt(%d, %d) failed\n", level, name);
+    }
+}
+
+/**
+ * Applies the profile's socket options to a newly accepted connection.
+ * Only TCP connections have any; Unix sockets just get the window.
+ */
+void sioProfileAccept(int fd, int addressFamily)
+{
+    if ((addressFamily != AF_INET) || (profile == SIO_PROFILE_NONE) ||
+        (profile == SIO_PROFILE_THROUGHPUT)) {
+        return;
+    }
+
+    sioProfileSetOpt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    sioProfileSetOpt(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+    sioProfileSetOpt(fd, IPPROTO_TCP, TCP_KEEPIDLE, 10);
+    sioProfileSetOpt(fd, IPPROTO_TCP, TCP_KEEPINTVL, 5);
+    sioProfileSetOpt(fd, IPPROTO_TCP, TCP_KEEPCNT, 3);
+    if (profile == SIO_PROFILE_LATENCY) {
+        sioProfileSetOpt(fd, SOL_SOCKET, SO_SNDBUF, SIO_PROFILE_SNDBUF);
+    }
+}
+
+static int sioProfileHolding(const struct SioPort *port)
+{
+    return (profile == SIO_PROFILE_THROUGHPUT) ||
+        ((profile == SIO_PROFILE_ADAPTIVE) && port->coalesce);
+}
+
+/**
+ * Counts a line the device sent, switching an adaptive port's window on or
+ * off once per sample period according to the rate seen.
+ */
+void sioProfileCount(struct SioPort *port)
+{
+    const uint64_t now = sioEventTime();
+    const uint64_t elapsed = now - port->rateStart;
+
+    if (profile != SIO_PROFILE_ADAPTIVE) {
+        return;
+    }
+
+    if (elapsed >= SIO_PROFILE_SAMPLE_NS) {
+        const unsigned long rate = port->rateLines * 1000000000ULL / elapsed;
+
+        if ((!port->coalesce && (rate >= SIO_PROFILE_HIGH_RATE)) ||
+            (port->coalesce && (rate < SIO_PROFILE_LOW_RATE))) {
+            port->coalesce = !port->coalesce;
+            LogMsg(LOG_INFO, "[SIO] port %d: %lu lines/s, coalescing %s\n",
+                port->index, rate, port->coalesce ? "on" : "off");
+        }
+        port->rateStart = now;
+        port->rateLines = 0;
+    }
+    port->rateLines++;
+}
+
+/**
+ * Decides whether output just queued for an idle client waits for the
+ * port's window instead of being written right away.
+ *
+ * @return int 1 if the write is left to sioProfileFlush(), 0 to write now
+ */
+int sioProfileDefer(struct SioClient *client)
+{
+    struct SioPort *port = client->port;
+
+    if (!sioProfileHolding(port)) {
+        return 0;
+    }
+    if (port->flushAt == 0) {
+        port->flushAt = sioEventTime() + profileWindow;
+    }
+    return 1;
+}
+
+/* when the output held for a port is due, 0 if nothing is held */
+uint64_t sioProfileDeadline(const struct SioPort *port)
+{
+    return port->flushAt;
+}
+
+/**
+ * Writes the output held for a port once its window has passed.  On TCP
+ * the writes are corked, so the lines leave in as few segments as
+ * possible, and the partial one is pushed out when the cork comes off.
+ */
+void sioProfileFlush(struct SioPort *port, uint64_t now)
+{
+    struct SioClient *client;
+    struct SioClient *next;
+    const int cork = (port->addressFamily == AF_INET);
+
+    if ((port->flushAt == 0) || (port->flushAt > now)) {
+        return;
+    }
+    port->flushAt = 0;
+
+    for (client = port->clients ; client != 0 ; client = next) {
+        next = client->next;
+        if (client->out.bytes == 0) {
+            continue;
+        }
+        if (cork) {
+            sioProfileSetOpt(client->ev.fd, IPPROTO_TCP, TCP_CORK, 1);
+        }
+        if ((sioClientFlush(client) == 0) && cork) {
+            sioProfileSetOpt(client->ev.fd, IPPROTO_TCP, TCP_CORK, 0);
+        }
+    }
+}
@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "sio_agent.h"
+
+/* initial number of slots in a queue, a power of two */
+#define SIO_QUEUE_INIT 16
+
+/* most messages handed to a single writev() */
+#define SIO_QUEUE_IOV 64
+
+/* drops by every queue since start-up */
+static unsigned long totalDropMsgs;
+static unsigned long totalDropBytes;
+
+/**
+ * Allocates a reference-counted message stamped with the current event 
+ * loop wakeup.  The caller holds the first reference and drops it with 
+ * sioBufRelease().  With data 0 the contents are left for the caller to 
+ * fill in. 
+ */
+struct SioBuf *sioBufAlloc(const char *data, size_t len)
+{
+    struct SioBuf *buf = malloc(sizeof(*buf) + len);
+
+    if (buf != 0) {
+        buf->refs = 1;
+        buf->len = len;
+        buf->stamp = sioEventTime();
+        if (data != 0) {
+            memcpy(buf->data, data, len);
+        }
+    }
+    return buf;
+}
+
+void sioBufRelease(struct SioBuf *buf)
+{
+    if (--buf->refs == 0) {
+        free(buf);
+    }
+}
+
+/**
+ * Parses a queue limit of the form <bytes>[:<policy>] where policy is one 
+ * of drop-oldest, drop-newest or disconnect.  A K or M suffix scales the 
+ * byte count and 0 means unlimited. 
+ * 
+ * @return int 0 on success, -1 if arg is malformed
+ */
+int sioQueueParse(const char *arg, size_t *maxBytes, int *policy)
+{
+    static const struct {
+        const char *name; int policy;
+    } policyTable[] = {
+        { "drop-oldest", SIO_QUEUE_DROP_OLDEST },
+        { "drop-newest", SIO_QUEUE_DROP_NEWEST },
+        { "disconnect",  SIO_QUEUE_DISCONNECT }
+    };
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+    unsigned i;
+
+    if (end == arg) {
+        return -1;
+    }
+    if ((*end == 'k') || (*end == 'K')) {
+        n *= 1024;
+        end++;
+    } else if ((*end == 'm') || (*end == 'M')) {
+        n *= 1024 * 1024;
+        end++;
+    }
+    *maxBytes = n;
+
+    if (*end == '\0') {
+        return 0;
+    } else if (*end != ':') {
+        return -1;
+    }
+    for (i = 0 ; i < (sizeof(policyTable) / sizeof(policyTable[0])) ; i++) {
+        if (strcmp(end + 1, policyTable[i].name) == 0) {
+            *policy = policyTable[i].policy;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int sioQueueInit(struct SioQueue *q, size_t maxBytes, int policy)
+{
+    memset(q, 0, sizeof(*q));
+    q->ring = malloc(SIO_QUEUE_INIT * sizeof(*q->ring));
+    if (q->ring == 0) {
+        return -1;
+    }
+    q->size = SIO_QUEUE_INIT;
+    q->maxBytes = maxBytes;
+    q->policy = policy;
+    return 0;
+}
+
+/* releases every queued message, leaving the queue usable */
+void sioQueueClear(struct SioQueue *q)
+{
+    while (q->tail != q->head) {
+        sioBufRelease(q->ring[q->tail++ & (q->size - 1)]);
+    }
+    q->offset = 0;
+    q->consumed += q->bytes;
+    q->bytes = 0;
+}
+
+void sioQueueFree(struct SioQueue *q)
+{
+    sioQueueClear(q);
+    free(q->ring);
+    q->ring = 0;
+}
+
+/**
+ * Counts a message dropped by the overflow policy of a queue, in the
+ * queue's drops and the totals sio.stats reports.
+ */
+void sioQueueDropped(struct SioQueue *q, size_t len)
+{
+    q->dropMsgs++;
+    q->dropBytes += len;
+    totalDropMsgs++;
+    totalDropBytes += len;
+
+    /* log the 1st, 2nd, 4th, 8th... drop so a stuck peer can't flood */
+    if ((q->dropMsgs & (q->dropMsgs - 1)) == 0) {
+        LogMsg(LOG_WARNING, "[SIO] output queue full, %d message(s) dropped\n",
+            (int)q->dropMsgs);
+    }
+}
+
+/*
+ * Drops the oldest messages until len more bytes fit.  A message that is
+ * partly written already is kept so the peer never sees half a line, and
+ * so are the messages a send still in flight is reading.
+ */
+static void sioQueueDropOldest(struct SioQueue *q, size_t len)
+{
+    const unsigned int mask = q->size - 1;
+    const unsigned int keep = (q->pinned > 0) ? q->pinned :
+        (q->offset > 0) ? 1 : 0;
+
+    while ((q->bytes + len > q->maxBytes) && (q->tail + keep != q->head)) {
+        struct SioBuf *victim = q->ring[(q->tail + keep) & mask];
+        unsigned int i;
+
+        /* the kept messages move up into the victim's slot */
+        for (i = keep ; i > 0 ; i--) {
+            q->ring[(q->tail + i) & mask] = q->ring[(q->tail + i - 1) & mask];
+        }
+        q->tail++;
+        q->bytes -= victim->len;
+        q->consumed += victim->len;
+        sioQueueDropped(q, victim->len);
+        sioBufRelease(victim);
+    }
+}
+
+/**
+ * Appends a reference to buf to the queue, applying the queue's overflow 
+ * policy if the memory cap would be exceeded. 
+ * 
+ * @param q the queue
+ * @param buf the message; the queue takes its own reference
+ * 
+ * @return int 0 if queued, 1 if a message was dropped to make room or buf 
+ *         itself was dropped, -1 if the policy is SIO_QUEUE_DISCONNECT and 
+ *         the cap was hit, or memory ran out
+ */
+int sioQueuePush(struct SioQueue *q, struct SioBuf *buf)
+{
+    int rv = 0;
+
+    if (buf->len == 0) {
+        return 0;
+    }
+
+    if ((q->maxBytes > 0) && (q->bytes + buf->len > q->maxBytes)) {
+        if (q->policy == SIO_QUEUE_DISCONNECT) {
+            sioQueueDropped(q, buf->len);
+            return -1;
+        } else if (q->policy == SIO_QUEUE_DROP_OLDEST) {
+            sioQueueDropOldest(q, buf->len);
+        }
+
+        /* drop-newest, or a message bigger than the whole cap */
+        if (q->bytes + buf->len > q->maxBytes) {
+            sioQueueDropped(q, buf->len);
+            return 1;
+        }
+        rv = 1;
+    }
+
+    if (q->head - q->tail == q->size) {
+        /* ring is full, double it */
+        struct SioBuf **ring = malloc(2 * q->size * sizeof(*ring));
+        unsigned int i;
+
+        if (ring == 0) {
+            return -1;
+        }
+        for (i = 0 ; i < q->size ; i++) {
+            ring[i] = q->ring[(q->tail + i) & (q->size - 1)];
+        }
+        free(q->ring);
+        q->ring = ring;
+        q->tail = 0;
+        q->head = q->size;
+        q->size *= 2;
+    }
+
+    buf->refs++;
+    q->ring[q->head++ & (q->size - 1)] = buf;
+    q->bytes += buf->len;
+    return rv;
+}
+
+static ssize_t sioQueueWritev(void *ctx, const struct iovec *iov, int count)
+{
+    return writev(*(const int *)ctx, iov, count);
+}
+
+/**
+ * Writes as much of the queue as the descriptor accepts, gathering up to 
+ * SIO_QUEUE_IOV messages into each writev().  The delivery latency of each 
+ * completed message goes to the queue's histogram, if it has one. 
+ * 
+ * @param q the queue
+ * @param fd a non-blocking descriptor
+ * 
+ * @return int the number of bytes still queued, or -1 if the write failed
+ */
+ssize_t sioQueueFlush(struct SioQueue *q, int fd)
+{
+    return sioQueueFlushTo(q, sioQueueWritev, &fd);
+}
+
+/**
+ * Describes the oldest queued messages for a gathering write, the first
+ * one without the part already sent.
+ *
+ * @param q the queue, not empty
+ * @param iov filled in with one entry per message
+ * @param max the number of entries in iov
+ *
+ * @return unsigned int the number of entries filled in
+ */
+unsigned int sioQueueIov(const struct SioQueue *q, struct iovec *iov,
+    unsigned int max)
+{
+    const unsigned int mask = q->size - 1;
+    unsigned int n = 0;
+
+    while ((n < max) && (q->tail + n != q->head)) {
+        struct SioBuf *buf = q->ring[(q->tail + n) & mask];
+
+        iov[n].iov_base = buf->data;
+        iov[n].iov_len = buf->len;
+        n++;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + q->offset;
+    iov[0].iov_len -= q->offset;
+    return n;
+}
+
+/**
+ * Takes cnt bytes written from the queue described by sioQueueIov() off
+ * its front.  The delivery latency of each completed message goes to the
+ * queue's histogram, if it has one; what is left of a message only partly
+ * written is remembered in q->offset.
+ */
+void sioQueueConsume(struct SioQueue *q, size_t cnt)
+{
+    const unsigned int mask = q->size - 1;
+    uint64_t now = 0;
+
+    q->bytes -= cnt;
+    q->consumed += cnt;
+    cnt += q->offset;
+    q->offset = 0;
+    if ((q->latency != 0) && (cnt > 0)) {
+        now = sioNowNs();
+    }
+    while ((q->tail != q->head) && (cnt >= q->ring[q->tail & mask]->len)) {
+        struct SioBuf *buf = q->ring[q->tail++ & mask];
+
+        if ((now != 0) && (buf->stamp != 0)) {
+            sioHistRecord(q->latency, now - buf->stamp);
+        }
+        cnt -= buf->len;
+        sioBufRelease(buf);
+    }
+    if (q->tail != q->head) {
+        q->offset = cnt;
+    }
+}
+
+/**
+ * Writes as much of the queue as writer accepts, as sioQueueFlush().  The 
+ * writer works like writev() on ctx; returning 0 means it is full. 
+ * 
+ * @return int the number of bytes still queued, or -1 if the write failed
+ */
+ssize_t sioQueueFlushTo(struct SioQueue *q, SioQueueWriter writer, void *ctx)
+{
+    while (q->tail != q->head) {
+        struct iovec iov[SIO_QUEUE_IOV];
+        const unsigned int n = sioQueueIov(q, iov, SIO_QUEUE_IOV);
+        const ssize_t cnt = writer(ctx, iov, n);
+
+        if (cnt < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR)) {
+                break;
+            }
+            return -1;
+        } else if (cnt == 0) {
+            break;
+        }
+
+        sioQueueConsume(q, cnt);
+        if (q->offset > 0) {
+            break;  /* partial write, descriptor is full */
+        }
+    }
+
+    return q->bytes;
+}
+
+void sioQueueTotals(unsigned long *dropMsgs, unsigned long *dropBytes)
+{
+    *dropMsgs = totalDropMsgs;
+    *dropBytes = totalDropBytes;
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sio_agent.h"
+
+/*
+ * Raw passthrough: bytes go between the device and its clients unchanged,
+ * without line framing, local commands or the cache.  Where the kernel can
+ * splice both descriptors the bytes are moved through a pipe and never
+ * enter user space; otherwise, or when the destination already has output
+ * queued, they are copied through rawBuff.  Either way whatever the
+ * destination can't take right away goes to its bounded output queue.
+ */
+#define SIO_RAW_CHUNK (64 * 1024)
+
+static char rawBuff[SIO_RAW_CHUNK];
+
+static void sioRawPipeClose(struct SioRawPipe *p)
+{
+    if (p->state > 0) {
+        close(p->fd[0]);
+        close(p->fd[1]);
+        p->state = 0;
+    }
+}
+
+static int sioRawPipeReady(struct SioRawPipe *p)
+{
+    if ((p->state == 0) && (pipe2(p->fd, O_NONBLOCK | O_CLOEXEC) < 0)) {
+        p->state = -1;
+    } else if (p->state == 0) {
+        p->state = 1;
+    }
+    return p->state > 0;
+}
+
+/* splice() can't handle one of the descriptors, copy from now on */
+static void sioRawPipeGiveUp(struct SioRawPipe *p)
+{
+    LogMsg(LOG_INFO, "[SIO] splice() not supported, copying instead\n");
+    sioRawPipeClose(p);
+    p->state = -1;
+}
+
+/*
+ * Moves what is readable on in to out through the pipe.  The bytes out
+ * can't take right away are copied to rawBuff and *left is set to their
+ * number.  Returns the bytes taken from in, 0 at end of file or -1 with
+ * errno set; EINVAL means nothing was read and the pipe was given up.
+ */
+static ssize_t sioRawSplice(struct SioRawPipe *p, int in, int out,
+    size_t *left)
+{
+    const unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    const ssize_t n = splice(in, 0, p->fd[1], 0, SIO_RAW_CHUNK, flags);
+    ssize_t done = 0;
+    int broken = 0;
+
+    if (n <= 0) {
+        if ((n < 0) && (errno == EINVAL)) {
+            sioRawPipeGiveUp(p);
+            errno = EINVAL;
+        }
+        return n;
+    }
+
+    while (done < n) {
+        const ssize_t m = splice(p->fd[0], 0, out, 0, n - done, flags);
+
+        if (m <= 0) {
+            broken = (m < 0) && (errno == EINVAL);
+            break;
+        }
+        done += m;
+    }
+
+    if (done < n) {
+        /* the pipe holds at most one chunk, so this empties it */
+        const ssize_t cnt = read(p->fd[0], rawBuff, n - done);
+        *left = (cnt > 0) ? cnt : 0;
+    }
+    if (broken) {
+        sioRawPipeGiveUp(p);
+    }
+    return n;
+}
+
+/*
+ * Moves bytes from in to out, by splice() when out is given and the pipe
+ * works, by read() into rawBuff otherwise.  *left is set to the number of
+ * bytes in rawBuff still to be queued for the destination.
+ */
+static ssize_t sioRawMove(struct SioRawPipe *p, int in, int out, size_t *left)
+{
+    ssize_t n;
+
+    *left = 0;
+    if ((out >= 0) && sioRawPipeReady(p)) {
+        n = sioRawSplice(p, in, out, left);
+        if ((n >= 0) || (errno != EINVAL)) {
+            return n;
+        }
+    }
+
+    n = read(in, rawBuff, sizeof(rawBuff));
+    if (n > 0) {
+        *left = n;
+    }
+    return n;
+}
+
+/**
+ * Passes what the device sent on to the clients of a port.  A single client
+ * with nothing queued gets it straight from the device by splice(); any
+ * other case is copied and broadcast.
+ *
+ * @return int the number of bytes read, 0 if there was nothing to read, or
+ *         -1 if the read failed and the device has to be reopened
+ */
+int sioRawFromSerial(struct SioPort *port)
+{
+    const struct SioClient *client = port->clients;
+    int out = -1;
+    size_t left;
+    ssize_t n;
+
+    if ((client != 0) && (client->next == 0) && (client->out.bytes == 0)) {
+        out = client->ev.fd;
+    }
+
+    n = sioRawMove(&port->rawRx, port->serialEv.fd, out, &left);
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+        return 0;
+    } else if (n <= 0) {
+        LogMsg(LOG_INFO, "[SIO] raw read from %s failed\n", port->ttyName);
+        return -1;
+    }
+
+    if (left > 0) {
+        sioClientBroadcast(port, rawBuff, left);
+    }
+    return n;
+}
+
+/**
+ * Passes what a client sent on to its port's device.  While the device has
+ * nothing queued the bytes are spliced to it; otherwise, while it is
+ * closed, or when the port is paced or flow controlled, they are queued
+ * behind what is already waiting.
+ *
+ * @return int 0 on success, -1 if the client hung up or overran the serial
+ *         queue and was closed
+ */
+int sioRawFromClient(struct SioClient *client)
+{
+    struct SioPort *port = client->port;
+    int out = -1;
+    size_t left;
+    ssize_t n;
+
+    /* paced or flow controlled output has to go through sioTtyFlush() */
+    if ((port->serialEv.fd >= 0) && (port->ttyOut.bytes == 0) &&
+        (port->pacePercent == 0) && (port->flow == SIO_FLOW_NONE)) {
+        out = port->serialOutFd;
+    }
+
+    n = sioRawMove(&port->rawTx, client->ev.fd, out, &left);
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+        return 0;
+    } else if (n <= 0) {
+        sioClientClose(client);
+        return -1;
+    }
+
+    if ((left > 0) && (sioTtyWrite(port, rawBuff, left) < 0)) {
+        LogMsg(LOG_NOTICE, "[SIO] serial queue full, dropping client\n");
+        sioClientClose(client);
+        return -1;
+    }
+    return 0;
+}
+
+/* releases the pipes of a port; they are opened again when next needed */
+void sioRawClose(struct SioPort *port)
+{
+    sioRawPipeClose(&port->rawRx);
+    sioRawPipeClose(&port->rawTx);
+}
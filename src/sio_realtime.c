@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "sio_agent.h"
+
+/*
+ * Real-time mode and the jitter probe.
+ *
+ * --realtime=<cpu>[,<priority>] pins the thread running the event loop to
+ * one CPU and runs it under SCHED_FIFO.  It is applied after the log
+ * writer thread, the only other thread, has started, so that keeps the
+ * default policy and can run anywhere.  Memory is locked with mlockall(),
+ * and the stack and a block of heap are touched once so the loop doesn't
+ * take a page fault on its first busy burst; malloc() is told to keep
+ * freed memory instead of trimming it or using fresh mmap()s.
+ *
+ * --jitter[=<us>] wakes the loop from a periodic timerfd and records how
+ * late each wakeup was in sioLatencyWakeup, which SIGUSR1 logs with the
+ * other histograms.  With and without --realtime it shows what the
+ * scheduling is worth on a given board.
+ */
+#define SIO_RT_DEFAULT_PRIORITY 50
+#define SIO_RT_STACK_PREFAULT (256 * 1024)
+#define SIO_RT_HEAP_PREFAULT (4 * 1024 * 1024)
+#define SIO_JITTER_DEFAULT_US 1000
+
+static int rtCpu = -1;              /* -1 without --realtime */
+static int rtPriority;
+static uint64_t jitterPeriod;       /* ns, 0 without --jitter */
+static uint64_t jitterDue;          /* ns, the next expiry not yet seen */
+static struct SioEvent jitterEv = { -1 };
+
+/**
+ * Takes the argument of --realtime, <cpu>[,<priority>].
+ *
+ * @return int 0 on success, -1 if arg is malformed
+ */
+int sioRealtimeSetup(const char *arg)
+{
+    char *end;
+    long cpu;
+    long priority = SIO_RT_DEFAULT_PRIORITY;
+
+    cpu = strtol(arg, &end, 10);
+    if ((end == arg) || (cpu < 0) || (cpu >= CPU_SETSIZE)) {
+        return -1;
+    }
+    if (*end == ',') {
+        const char *p = end + 1;
+
+        priority = strtol(p, &end, 10);
+        if ((end == p) || (priority < sched_get_priority_min(SCHED_FIFO)) ||
+            (priority > sched_get_priority_max(SCHED_FIFO))) {
+            return -1;
+        }
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+
+    rtCpu = cpu;
+    rtPriority = priority;
+    return 0;
+}
+
+/**
+ * Takes the argument of --jitter, the probe period in microseconds, or 0
+ * when it was given without one.
+ *
+ * @return int 0 on success, -1 if arg is malformed
+ */
+int sioJitterSetup(const char *arg)
+{
+    unsigned long us = SIO_JITTER_DEFAULT_US;
+
+    if (arg != 0) {
+        char *end;
+
+        us = strtoul(arg, &end, 10);
+        if ((end == arg) || (*end != '\0') || (us == 0) || (us > 1000000)) {
+            return -1;
+        }
+    }
+    jitterPeriod = us * 1000ULL;
+    return 0;
+}
+
+/* touches the stack so its pages are there before the loop needs them */
+static void sioRealtimeStack(void)
+{
+    volatile char stack[SIO_RT_STACK_PREFAULT];
+    size_t i;
+
+    for (i = 0 ; i < sizeof(stack) ; i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+/* grows the heap once and keeps it, locked, for the buffers to come */
+static void sioRealtimeHeap(void)
+{
+    char *p;
+
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    p = malloc(SIO_RT_HEAP_PREFAULT);
+    if (p != 0) {
+        memset(p, 0, SIO_RT_HEAP_PREFAULT);
+        free(p);
+    }
+}
+
+/**
+ * Applies --realtime to the calling thread, which should be the one that
+ * runs the event loop.  A step the system refuses, typically for lack of
+ * CAP_SYS_NICE or CAP_IPC_LOCK, is logged and the rest still applied.
+ */
+void sioRealtimeStart(void)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+
+    if (rtCpu < 0) {
+        return;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        LogMsg(LOG_WARNING, "[SIO] mlockall() failed, errno = %d\n", errno);
+    }
+    sioRealtimeHeap();
+    sioRealtimeStack();
+
+    CPU_ZERO(&cpus);
+    CPU_SET(rtCpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        LogMsg(LOG_WARNING, "[SIO] can't pin to CPU %d, errno = %d\n",
+            rtCpu, errno);
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = rtPriority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        LogMsg(LOG_WARNING, "[SIO] can't set SCHED_FIFO %d, errno = %d\n",
+            rtPriority, errno);
+        return;
+    }
+    LogMsg(LOG_NOTICE, "[SIO] running on CPU %d at SCHED_FIFO %d\n", rtCpu,
+        rtPriority);
+}
+
+/* the probe timer expired: record how late the loop got to it */
+static void sioOnJitter(struct SioEvent *ev, unsigned int events)
+{
+    const uint64_t now = sioEventTime();
+    uint64_t expirations;
+
+    if (read(ev->fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+        return;
+    }
+    sioHistRecord(&sioLatencyWakeup, (now > jitterDue) ? now - jitterDue : 0);
+    jitterDue += expirations * jitterPeriod;
+}
+
+/**
+ * Starts the jitter probe, if --jitter asked for it.  Call after
+ * sioEventInit().
+ *
+ * @return int 0 on success or without --jitter, -1 if the timer could not
+ *         be set up
+ */
+int sioJitterStart(void)
+{
+    struct itimerspec spec;
+    const uint64_t now = sioNowNs();
+
+    if (jitterPeriod == 0) {
+        return 0;
+    }
+
+    jitterEv.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (jitterEv.fd < 0) {
+        LogMsg(LOG_ERR, "[SIO] timerfd_create() failed, errno = %d\n", errno);
+        return -1;
+    }
+
+    /* absolute expiries, so lateness doesn't push the next one back */
+    jitterDue = now + jitterPeriod;
+    spec.it_value.tv_sec = jitterDue / 1000000000ULL;
+    spec.it_value.tv_nsec = jitterDue % 1000000000ULL;
+    spec.it_interval.tv_sec = jitterPeriod / 1000000000ULL;
+    spec.it_interval.tv_nsec = jitterPeriod % 1000000000ULL;
+    jitterEv.handler = sioOnJitter;
+    if ((timerfd_settime(jitterEv.fd, TFD_TIMER_ABSTIME, &spec, 0) < 0) ||
+        (sioEventAdd(&jitterEv, EPOLLIN) < 0)) {
+        LogMsg(LOG_ERR, "[SIO] can't start the jitter probe\n");
+        close(jitterEv.fd);
+        jitterEv.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* stops the probe and logs what it saw */
+void sioJitterStop(void)
+{
+    char line[160];
+
+    if (jitterEv.fd < 0) {
+        return;
+    }
+    sioEventDel(&jitterEv);
+    close(jitterEv.fd);
+    jitterEv.fd = -1;
+
+    sioHistFormat(&sioLatencyWakeup, line, sizeof(line));
+    LogMsg(LOG_NOTICE, "[SIO] latency %s\n", line);
+}
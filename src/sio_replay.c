@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sio_agent.h"
+
+/*
+ * sio-replay: feeds the serial side of a capture made with --capture back
+ * into an agent started with -p, by writing the received lines to the pty
+ * slave the agent reports.  Connected clients then see the same traffic
+ * with the original timing, or scaled by --speed.  Where the agent was
+ * restarted the capture carries new clock bases; the gap across a restart
+ * is not waited out.
+ */
+
+static const char *progName;
+
+static void sioReplayHelp(void)
+{
+    fprintf(stderr, "SIO Replay %s \n\n", SIO_VERSION);
+
+    fprintf(stderr, "usage: %s [options] <capture> [<pty>]\n"
+        "  where options are:\n"
+        "    -x<factor> | --speed=<factor>    replay speed, default = 1, 0 = no delays\n"
+        "    -l         | --list              print the records instead of replaying\n"
+        "    -v         | --verbose           print each record as it is replayed\n"
+        "    -h         | -? | --help         print usage information\n",
+        progName);
+}
+
+static uint64_t sioReplayNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sioReplayPrint(const struct SioCaptureClock *bases,
+    const struct SioCaptureRecord *rec)
+{
+    static const char *dirNames[] = { "pad", "serial", "socket", "clock" };
+    const char *data = (const char *)(rec + 1);
+    const int64_t real = (int64_t)bases->realBase +
+        ((int64_t)rec->timestamp - (int64_t)bases->monoBase);
+    const time_t secs = real / 1000000000LL;
+    struct tm tm;
+    char when[32];
+    uint32_t i;
+
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    if (rec->dir == SIO_CAPTURE_CLOCK) {
+        printf("%s.%06d %-6s agent started\n", when,
+            (int)((real % 1000000000LL) / 1000), dirNames[rec->dir]);
+        return;
+    }
+    printf("%s.%06d %-6s %3u %4u \"", when,
+        (int)((real % 1000000000LL) / 1000), dirNames[rec->dir % 4],
+        rec->channel, rec->len);
+    for (i = 0 ; i < rec->len ; i++) {
+        const unsigned char c = data[i];
+
+        if (iscntrl(c)) {
+            printf("^%c", (c == 0x7f) ? '?' : c - 1 + 'A');
+        } else {
+            putchar(c);
+        }
+    }
+    printf("\"\n");
+}
+
+static int sioReplayOpenPty(const char *path)
+{
+    struct termios tio;
+    const int fd = open(path, O_RDWR | O_NOCTTY);
+
+    if (fd < 0) {
+        fprintf(stderr, "%s: can't open %s: %s\n", progName, path,
+            strerror(errno));
+        return -1;
+    }
+
+    /* raw, so the lines reach the agent byte for byte */
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    double speed    = 1.0;
+    int listOnly    = 0;
+    int verbose     = 0;
+    const struct SioCaptureHeader *h;
+    const struct SioCaptureRecord *rec;
+    struct SioCaptureClock bases;
+    uint64_t pos;
+    uint64_t firstTs = 0;
+    uint64_t lastTs = 0;
+    uint64_t start = 0;
+    int rebase = 1;
+    size_t mapSize;
+    int ptyFd = -1;
+    int replayed = 0;
+
+    progName = basename(argv[0]);
+
+    while (1) {
+        static struct option longOptions[] = {
+            { "speed",      required_argument, 0, 'x' },
+            { "list",       no_argument,       0, 'l' },
+            { "verbose",    no_argument,       0, 'v' },
+            { "help",       no_argument,       0, 'h' },
+            { 0,            0, 0,  0  }
+        };
+        int c = getopt_long(argc, argv, "x:lvh?", longOptions, 0);
+
+        if (c == -1) {
+            break;  // no more options to process
+        }
+
+        switch (c) {
+        case 'x':
+            speed = atof(optarg);
+            break;
+
+        case 'l':
+            listOnly = 1;
+            break;
+
+        case 'v':
+            verbose = 1;
+            break;
+
+        case '?':
+        case 'h':
+        default:
+            sioReplayHelp();
+            exit(1);
+        }
+    }
+
+    if ((optind >= argc) || (!listOnly && (optind + 2 != argc))) {
+        sioReplayHelp();
+        exit(1);
+    }
+
+    h = sioCaptureMap(argv[optind], &mapSize);
+    if (h == 0) {
+        fprintf(stderr, "%s: can't read capture %s: %s\n", progName,
+            argv[optind], strerror(errno));
+        exit(1);
+    }
+
+    if (!listOnly) {
+        ptyFd = sioReplayOpenPty(argv[optind + 1]);
+        if (ptyFd < 0) {
+            exit(1);
+        }
+    }
+
+    bases.monoBase = h->monoBase;
+    bases.realBase = h->realBase;
+    pos = h->tail;
+    while ((rec = sioCaptureNext(h, &pos)) != 0) {
+        if ((rec->dir == SIO_CAPTURE_CLOCK) &&
+            (rec->len == sizeof(bases))) {
+            /* the agent restarted, maybe after a reboot: new bases */
+            memcpy(&bases, rec + 1, sizeof(bases));
+            rebase = 1;
+        }
+        if (listOnly || verbose) {
+            sioReplayPrint(&bases, rec);
+        }
+        if (listOnly || (rec->dir != SIO_CAPTURE_SERIAL_RX)) {
+            continue;
+        }
+
+        replayed++;
+        if (rebase || (rec->timestamp < lastTs)) {
+            /* go on from here without waiting out the restart */
+            rebase = 0;
+            firstTs = rec->timestamp;
+            start = sioReplayNow();
+        } else if (speed > 0) {
+            const uint64_t due = start +
+                (uint64_t)((rec->timestamp - firstTs) / speed);
+            struct timespec ts;
+
+            ts.tv_sec = due / 1000000000ULL;
+            ts.tv_nsec = due % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) ==
+                EINTR) {
+            }
+        }
+
+        lastTs = rec->timestamp;
+
+        if (write(ptyFd, rec + 1, rec->len) != (ssize_t)rec->len) {
+            fprintf(stderr, "%s: write to pty failed: %s\n", progName,
+                strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (!listOnly) {
+        /* let the agent drain the pty before the slave goes away */
+        tcdrain(ptyFd);
+        close(ptyFd);
+        fprintf(stderr, "%s: replayed %d line(s)\n", progName, replayed);
+    }
+    munmap((void *)h, mapSize);
+
+    return 0;
+}
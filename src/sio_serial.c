@@ -1,5 +1,8 @@
 #define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE     /* CRTSCTS */
 
+#include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -10,17 +13,16 @@
 #include <signal.h>
 #include <wait.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <linux/serial.h>
 #include <asm-generic/ioctls.h> 
 
 #include "sio_agent.h"
 
-static int sioLocalEchoFlag;
-static speed_t sioTtyRate;
-static int rs485_mode;
-
-void sioTtySetParams(int localEcho, unsigned int serialRate, int enable_rs485)
+/* the termios code for a bit rate, B0 if it needs termios2 */
+static speed_t sioTtySpeed(unsigned int serialRate)
 {
     static const struct {
         unsigned int asUint; speed_t asSpeed;
@@ -31,140 +33,772 @@ void sioTtySetParams(int localEcho, unsigned int serialRate, int enable_rs485)
         {  38400,  B38400 },
         {  57600,  B57600 },
         { 115200, B115200 },
-		{ 230400, B230400 }
+		{ 230400, B230400 },
+        { 460800, B460800 },
+        { 921600, B921600 },
+        { 1000000, B1000000 },
+        { 1500000, B1500000 },
+        { 2000000, B2000000 },
+        { 3000000, B3000000 },
+        { 4000000, B4000000 }
     };
     unsigned i;
 
-    sioLocalEchoFlag = localEcho;
-    rs485_mode = enable_rs485;
-
     for (i = 0 ; i < (sizeof(speedTable) / sizeof(speedTable[0])) ; i++) {
         if (speedTable[i].asUint == serialRate) {
-            sioTtyRate = speedTable[i].asSpeed;
-            break;
+            return speedTable[i].asSpeed;
         }
     }
+    return B0;
 }
 
-int sioTtyInit(const char *tty_dev)
+void sioTtySetParams(struct SioPort *port, int localEcho,
+    unsigned int serialRate, int enableRS485)
+{
+    port->localEcho = localEcho;
+    port->rate = serialRate;
+    port->rs485 = enableRS485;
+}
+
+/**
+ * Sets how the device driver batches input.  VMIN and VTIME go to termios 
+ * as they are; lowLatency asks the UART driver to push each received 
+ * chunk to the line discipline at once (ASYNC_LOW_LATENCY) rather than 
+ * from a deferred work item. 
+ */
+void sioTtySetTiming(struct SioPort *port, unsigned int vmin,
+    unsigned int vtime, int lowLatency)
+{
+    port->vmin = vmin;
+    port->vtime = vtime;
+    port->lowLatency = lowLatency;
+}
+
+/**
+ * Sets the flow control of a port, an enum SioFlow, and the RS-485 delays
+ * of RTS before and after sending in milliseconds.  RTS/CTS can't be used
+ * together with RS-485, where RTS drives the transmitter.
+ */
+void sioTtySetFlow(struct SioPort *port, int flow, unsigned int rtsBeforeMs,
+    unsigned int rtsAfterMs)
+{
+    port->flow = flow;
+    port->rtsBeforeMs = rtsBeforeMs;
+    port->rtsAfterMs = rtsAfterMs;
+}
+
+/**
+ * Takes a flow control name: none, rtscts or xonxoff.
+ *
+ * @return int 0 on success, -1 if arg is not one of them
+ */
+int sioTtyParseFlow(const char *arg, int *flow)
+{
+    static const struct {
+        const char *name; int flow;
+    } flowTable[] = {
+        { "none",    SIO_FLOW_NONE },
+        { "rtscts",  SIO_FLOW_RTSCTS },
+        { "xonxoff", SIO_FLOW_XONXOFF }
+    };
+    unsigned i;
+
+    for (i = 0 ; i < (sizeof(flowTable) / sizeof(flowTable[0])) ; i++) {
+        if (strcmp(flowTable[i].name, arg) == 0) {
+            *flow = flowTable[i].flow;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Takes RS-485 RTS delays of the form <before_ms>,<after_ms>, at most
+ * SIO_RS485_DELAY_MAX_MS each as the kernel allows.
+ *
+ * @return int 0 on success, -1 if arg is malformed
+ */
+int sioTtyParseDelay(const char *arg, unsigned int *beforeMs,
+    unsigned int *afterMs)
+{
+    char *end;
+    const char *p;
+    unsigned long before;
+    unsigned long after;
+
+    before = strtoul(arg, &end, 10);
+    if ((end == arg) || (*end != ',') || (before > SIO_RS485_DELAY_MAX_MS)) {
+        return -1;
+    }
+    p = end + 1;
+    after = strtoul(p, &end, 10);
+    if ((end == p) || (*end != '\0') || (after > SIO_RS485_DELAY_MAX_MS)) {
+        return -1;
+    }
+
+    *beforeMs = before;
+    *afterMs = after;
+    return 0;
+}
+
+/* puts port->flow into the termios flags of a real device */
+static void sioTtyFlowFlags(struct SioPort *port, struct termios *tio)
+{
+    tio->c_cflag &= ~CRTSCTS;
+    tio->c_iflag &= ~(IXON | IXOFF | IXANY);
+
+    if (port->flow == SIO_FLOW_RTSCTS) {
+        if (port->rs485) {
+            LogMsg(LOG_WARNING, "[SIO] %s: RTS/CTS flow control is not "
+                "possible in RS-485 mode\n", port->serialName);
+        } else {
+            tio->c_cflag |= CRTSCTS;
+        }
+    } else if (port->flow == SIO_FLOW_XONXOFF) {
+        tio->c_iflag |= IXON | IXOFF;
+        tio->c_cc[VSTART] = 0x11;   /* DC1 */
+        tio->c_cc[VSTOP] = 0x13;    /* DC3 */
+    }
+}
+
+/* applies the bit rate; non-standard rates go through termios2 */
+static int sioTtySetRate(struct SioPort *port, int fd, struct termios *tio)
+{
+    const speed_t speed = sioTtySpeed(port->rate);
+    int actual;
+
+    if (speed != B0) {
+        cfsetospeed(tio, speed);
+        cfsetispeed(tio, speed);
+        return tcsetattr(fd, TCSANOW, tio);
+    }
+
+    /*
+     * Set everything else first, BOTHER then only replaces the rate.  The
+     * stand-in rate must not be B0, which would drop DTR and RTS and hang
+     * up the line until BOTHER raises them again.
+     */
+    cfsetospeed(tio, B38400);
+    cfsetispeed(tio, B38400);
+    if (tcsetattr(fd, TCSANOW, tio) < 0) {
+        LogMsg(LOG_ERR, "[SIO] can't configure %s, errno = %d\n",
+            port->serialName, errno);
+        return -1;
+    }
+    actual = sioTtySetCustomRate(fd, port->rate);
+    if (actual < 0) {
+        LogMsg(LOG_ERR, "[SIO] %s does not support %u baud\n",
+            port->serialName, port->rate);
+        return -1;
+    }
+
+    /* a UART divides its clock, so allow the usual 2% of error */
+    if ((unsigned int)abs(actual - (int)port->rate) > port->rate / 50) {
+        LogMsg(LOG_ERR, "[SIO] %s can't do %u baud, closest is %d\n",
+            port->serialName, port->rate, actual);
+        return -1;
+    }
+    return 0;
+}
+
+/* sets or clears ASYNC_LOW_LATENCY as port->lowLatency says */
+static void sioTtySetLowLatency(struct SioPort *port, int fd)
+{
+    struct serial_struct ss;
+
+    if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+        if (port->lowLatency) {
+            ss.flags |= ASYNC_LOW_LATENCY;
+        } else {
+            ss.flags &= ~ASYNC_LOW_LATENCY;
+        }
+        if (ioctl(fd, TIOCSSERIAL, &ss) == 0) {
+            return;
+        }
+    }
+    if (port->lowLatency) {
+        LogMsg(LOG_WARNING, "[SIO] %s: low latency mode not supported\n",
+            port->serialName);
+    }
+}
+
+/* turns RS-485 mode on or off as port->rs485 says */
+static void sioTtySetRS485(struct SioPort *port, int fd)
 {
-    int fd = -1;
     struct serial_rs485 rs485conf;
+
+    memset(&rs485conf, 0, sizeof(rs485conf));
+    if (port->rs485) {
+        /* Enable RS-485 mode: */
+        rs485conf.flags |= SER_RS485_ENABLED;
+
+        /* set logical level for RTS pin equal to 1 when sending: */
+        rs485conf.flags |= SER_RS485_RTS_ON_SEND;
+
+        /* set logical level for RTS pin equal to 0 after sending: */
+        rs485conf.flags &= ~(SER_RS485_RTS_AFTER_SEND);
+
+        /* Set rts/txen delay before send, if needed: (in milliseconds) */
+        rs485conf.delay_rts_before_send = port->rtsBeforeMs;
+
+        /* Set rts/txen delay after send, if needed: (in milliseconds) */
+        rs485conf.delay_rts_after_send = port->rtsAfterMs;
+    }
+
+    /* Write the current state of the RS-485 options with ioctl. */
+    if ((ioctl(fd, TIOCSRS485, &rs485conf) < 0) && port->rs485) {
+        LogMsg(LOG_ERR,"Error: TIOCSRS485 ioctl not supported.\n");
+    }
+}
+
+/**
+ * Opens and configures the serial device of a port, or a new pty if the 
+ * port has no device name. 
+ * 
+ * @return int the descriptor, or -1 if the open failed
+ */
+int sioTtyInit(struct SioPort *port)
+{
+    const char *tty_dev = port->serialName;
+    int fd = -1;
     struct termios tio;
     memset(&tio, 0, sizeof(tio));
     tio.c_iflag = 0;
     tio.c_oflag = 0;
     tio.c_cflag = CS8 | CREAD | CLOCAL;
     tio.c_lflag = 0;
-    tio.c_cc[VMIN] = 1;
-    tio.c_cc[VTIME] = 5;
+    tio.c_cc[VMIN] = port->vmin;
+    tio.c_cc[VTIME] = port->vtime;
+
+    /* nothing written to a new descriptor is held or on the wire yet */
+    port->paceAt = 0;
+    port->paceWireAt = 0;
+    if (port->flowBlockedAt != 0) {
+        port->flowBlockedNs += sioNowNs() - port->flowBlockedAt;
+        port->flowBlockedAt = 0;
+    }
 
     if (tty_dev == 0) {
         fd = posix_openpt(O_RDWR | O_NOCTTY);
         if (fd < 0) {
-            LogMsg(LOG_ERR, "[SIO] can't open %s\n", tty_dev);
+            LogMsg(LOG_ERR, "[SIO] can't open pty master\n");
         } else {
             tcsetattr(fd, TCSANOW, &tio);
             grantpt(fd);
             unlockpt(fd);
             LogMsg(LOG_NOTICE, "[SIO] slave port = %s\n", ptsname(fd));
+            snprintf(port->ttyName, sizeof(port->ttyName), "%s", ptsname(fd));
         }
     } else {
         fd = open(tty_dev, O_RDWR);
         if (fd < 0) {
-            LogMsg(LOG_ERR, "[SIO] can't open %s\n", tty_dev);
+            LogMsg(LOG_INFO, "[SIO] can't open %s, errno = %d\n", tty_dev,
+                errno);
         } else {
-            if (rs485_mode) {
-                /* Enable RS-485 mode: */
-                rs485conf.flags |= SER_RS485_ENABLED;
-
-                /* set logical level for RTS pin equal to 1 when sending: */
-                rs485conf.flags |= SER_RS485_RTS_ON_SEND;
-
-                /* set logical level for RTS pin equal to 0 after sending: */
-                rs485conf.flags &= ~(SER_RS485_RTS_AFTER_SEND);
-
-                /* Set rts/txen delay before send, if needed: (in microseconds) */
-                rs485conf.delay_rts_before_send = 0;
- 
-                /* Set rts/txen delay after send, if needed: (in microseconds) */
-                rs485conf.delay_rts_after_send = 0;
- 
-                /* Write the current state of the RS-485 options with ioctl. */
-                if (ioctl (fd, TIOCSRS485, &rs485conf) < 0) {
-                    LogMsg(LOG_ERR,"Error: TIOCSRS485 ioctl not supported.\n");
-                }
+            if (port->rs485) {
+                sioTtySetRS485(port, fd);
             }
-            cfsetospeed(&tio, sioTtyRate);
-            cfsetispeed(&tio, sioTtyRate);
-            tcsetattr(fd, TCSANOW, &tio);
+            if (port->lowLatency) {
+                sioTtySetLowLatency(port, fd);
+            }
+            sioTtyFlowFlags(port, &tio);
+            if (sioTtySetRate(port, fd, &tio) < 0) {
+                close(fd);
+                return -1;
+            }
+            snprintf(port->ttyName, sizeof(port->ttyName), "%s", tty_dev);
         }
     }
 
     return fd;
 }
 
-int sioTtyRead(int fd, char *msgBuff, size_t bufSize, off_t *currPos)
-{
-    /* Gather entire string, drop CR. */
-    char c;
-
-    for(;;) {
-        if (read(fd, &c, 1) > 0) {
-            if ((c == '\r') || (c == '\n')){
-                int pos = *currPos;
-                *currPos = 0;
-
-                if (pos < 1) {
-                    /* nothing here */
-                    return 0;
-                } else {
-                    msgBuff[pos++] = '\n';
-                    msgBuff[pos++] = '\0';
-
-                    if (sioLocalEchoFlag) {
-                        write(fd, "\r\n", 2);
-                    }
-
-                    LogMsg(LOG_INFO, "[SIO] received => \"%s\"\n", msgBuff);
-
-                    return pos;
-                }
-            } else if (sioLocalEchoFlag && (c == '\b')) {
-                /*  If it's BS with nothing in buffer, ignore, else
-                 *  back up stream, erasing last character typed. */
-                if (*currPos > 0) {
-                    (*currPos)--;
-                    write(fd, "\b \b", 3);
-                }
-                return 0;
-            } else {
-                if (*currPos >= bufSize) {
-                    /* buffer full with no CR can't be good; flush it */
-                    *currPos = 0;
-                } else {
-                    msgBuff[(*currPos)++] = c;
-                    if (sioLocalEchoFlag) {
-                        write(fd, &c, 1);
-                    }
-                }
-                return 0;
+/* reads the settings sioTtyReconfigure() can change back from a port */
+void sioTtyGetSettings(const struct SioPort *port, struct SioTtySettings *s)
+{
+    s->rate = port->rate;
+    s->rs485 = port->rs485;
+    s->vmin = port->vmin;
+    s->vtime = port->vtime;
+    s->lowLatency = port->lowLatency;
+    s->flow = port->flow;
+    s->rtsBeforeMs = port->rtsBeforeMs;
+    s->rtsAfterMs = port->rtsAfterMs;
+}
+
+static void sioTtyPutSettings(struct SioPort *port,
+    const struct SioTtySettings *s)
+{
+    sioTtySetParams(port, port->localEcho, s->rate, s->rs485);
+    sioTtySetTiming(port, s->vmin, s->vtime, s->lowLatency);
+    sioTtySetFlow(port, s->flow, s->rtsBeforeMs, s->rtsAfterMs);
+}
+
+/**
+ * Changes a port's serial settings and applies them to its open device,
+ * as after a configuration reload.  Nothing is flushed: bytes queued in
+ * either direction and the partial line in the receive ring are kept.  If
+ * the driver refuses the new rate the old settings are put back, on the
+ * port and on the line, so the device keeps running as before.  The
+ * RS-485 and low latency modes are only written once the rate has been
+ * taken, and only if they changed.
+ *
+ * @param port the port
+ * @param s the new settings
+ *
+ * @return int 0 on success or if the device is closed, -1 if the driver
+ *         refused the settings and the old ones are still in effect
+ */
+int sioTtyReconfigure(struct SioPort *port, const struct SioTtySettings *s)
+{
+    const int fd = port->serialEv.fd;
+    struct SioTtySettings old;
+    struct termios saved;
+    struct termios tio;
+    int rv;
+
+    sioTtyGetSettings(port, &old);
+    sioTtyPutSettings(port, s);
+    if ((fd < 0) || port->useStdio) {
+        return 0;
+    }
+    if (tcgetattr(fd, &saved) < 0) {
+        sioTtyPutSettings(port, &old);
+        return -1;
+    }
+    tio = saved;
+    tio.c_cc[VMIN] = port->vmin;
+    tio.c_cc[VTIME] = port->vtime;
+    if (port->serialName == 0) {
+        /* a pty has no line to configure */
+        rv = tcsetattr(fd, TCSANOW, &tio);
+    } else {
+        sioTtyFlowFlags(port, &tio);
+        rv = sioTtySetRate(port, fd, &tio);
+    }
+    if (rv < 0) {
+        sioTtyPutSettings(port, &old);
+        if (port->serialName == 0) {
+            tcsetattr(fd, TCSANOW, &saved);
+        } else {
+            /* a custom rate isn't in termios, so set the old rate again */
+            sioTtySetRate(port, fd, &saved);
+        }
+        return rv;
+    }
+
+    /*
+     * RS-485 and low latency mode may have been set up by the device tree
+     * or a boot script, as sioTtyInit() allows; leave them unless the
+     * configuration changed them.
+     */
+    if ((port->rs485 != old.rs485) || (port->rtsBeforeMs != old.rtsBeforeMs) ||
+        (port->rtsAfterMs != old.rtsAfterMs)) {
+        sioTtySetRS485(port, fd);
+    }
+    if (port->lowLatency != old.lowLatency) {
+        sioTtySetLowLatency(port, fd);
+    }
+    return 0;
+}
+
+void sioTtyClose(struct SioPort *port)
+{
+    if (port->readDone != 0) {
+        /* a read still in flight is for this descriptor, not the next */
+        port->readDone = 0;
+        port->readStale = sioUringBusy(&port->readOp);
+        sioUringCancel(&port->readOp);
+    }
+    close(port->serialEv.fd);
+    port->serialEv.fd = -1;
+}
+
+/**
+ * Describes the serial port for the sio.port local command. 
+ * 
+ * @return int the number of characters written, as snprintf()
+ */
+int sioTtyStatus(const struct SioPort *port, char *buff, size_t size)
+{
+    static const char *const flowName[] = { "none", "rtscts", "xonxoff" };
+    uint64_t blockedNs = port->flowBlockedNs;
+    char flow[64] = "";
+    char pace[32] = "";
+
+    if (port->flowBlockedAt != 0) {
+        blockedNs += sioNowNs() - port->flowBlockedAt;
+    }
+    if (port->flow != SIO_FLOW_NONE) {
+        snprintf(flow, sizeof(flow), " flow:%s blocked:%lums/%lu",
+            flowName[port->flow], (unsigned long)(blockedNs / 1000000),
+            port->flowStalls);
+    }
+    if (port->pacePercent > 0) {
+        snprintf(pace, sizeof(pace), " pace:%u%%/%uus", port->pacePercent,
+            port->paceGapUs);
+    }
+
+    if (port->useStdio) {
+        return snprintf(buff, size, "stdio queued:%u%s\n",
+            (unsigned)port->ttyOut.bytes, pace);
+    }
+    return snprintf(buff, size, "%s %s queued:%u%s%s\n", port->ttyName,
+        (port->serialEv.fd >= 0) ? "open" : "closed",
+        (unsigned)port->ttyOut.bytes, flow, pace);
+}
+
+static void sioTtyRingCopy(const struct SioTtyRing *ring, unsigned int from,
+    unsigned int len, char *dst)
+{
+    const unsigned int off = from & (SIO_TTY_RING_SIZE - 1);
+    const unsigned int first = (off + len > SIO_TTY_RING_SIZE) ?
+        SIO_TTY_RING_SIZE - off : len;
+
+    memcpy(dst, ring->data + off, first);
+    memcpy(dst + first, ring->data, len - first);
+}
+
+void sioTtyRingReset(struct SioTtyRing *ring)
+{
+    ring->head = ring->tail = ring->scan = 0;
+    ring->lineLen = 0;
+}
+
+/* the free bytes of the ring, after dropping a line that fills all of it */
+static unsigned int sioTtyRingFree(struct SioTtyRing *ring)
+{
+    const unsigned int room = SIO_TTY_RING_SIZE - (ring->head - ring->tail);
+
+    if (room == 0) {
+        /* a line that long never fits in a message; flush it */
+        ring->tail = ring->scan = ring->head;
+        ring->lineLen = 0;
+        return SIO_TTY_RING_SIZE;
+    }
+    return room;
+}
+
+/*
+ * Finds where the next read into the receive ring goes, for reads that
+ * can't be split around its end as io_uring's can't: the free bytes from
+ * *start on, never 0.
+ */
+static unsigned int sioTtyRingRoom(struct SioTtyRing *ring, char **start)
+{
+    const unsigned int off = ring->head & (SIO_TTY_RING_SIZE - 1);
+    const unsigned int room = sioTtyRingFree(ring);
+
+    *start = ring->data + off;
+    return (off + room > SIO_TTY_RING_SIZE) ? SIO_TTY_RING_SIZE - off : room;
+}
+
+/*
+ * Local echo (test) mode: bytes are handled one at a time so backspace can
+ * erase the partial line, but the echo for the whole chunk goes out in a
+ * single write().
+ */
+static int sioTtyReadEcho(int fd, struct SioTtyRing *ring, size_t room)
+{
+    const unsigned int mask = SIO_TTY_RING_SIZE - 1;
+    char chunk[SIO_BUFFER_SIZE];
+    char echo[3 * SIO_BUFFER_SIZE];
+    size_t echoLen = 0;
+    ssize_t cnt;
+    ssize_t i;
+
+    if (room > sizeof(chunk)) {
+        room = sizeof(chunk);
+    }
+
+    cnt = read(fd, chunk, room);
+    if (cnt <= 0) {
+        return cnt;
+    }
+
+    /* backspace may pull head back, so rescan the partial line afterwards */
+    ring->scan = ring->tail;
+
+    for (i = 0 ; i < cnt ; i++) {
+        const char c = chunk[i];
+
+        if ((c == '\r') || (c == '\n')) {
+            if (ring->lineLen > 0) {
+                ring->data[ring->head++ & mask] = c;
+                ring->lineLen = 0;
+                echo[echoLen++] = '\r';
+                echo[echoLen++] = '\n';
             }
+        } else if (c == '\b') {
+            /*  If it's BS with nothing in buffer, ignore, else
+             *  back up stream, erasing last character typed. */
+            if (ring->lineLen > 0) {
+                ring->head--;
+                ring->lineLen--;
+                memcpy(echo + echoLen, "\b \b", 3);
+                echoLen += 3;
+            }
+        } else if (ring->lineLen >= SIO_BUFFER_SIZE - 2) {
+            /* buffer full with no CR can't be good; flush it */
+            ring->head -= ring->lineLen;
+            ring->lineLen = 0;
         } else {
-            LogMsg(LOG_INFO, "[SIO] sio_tty_reader(): error on read()\n");
+            ring->data[ring->head++ & mask] = c;
+            ring->lineLen++;
+            echo[echoLen++] = c;
+        }
+    }
+
+    if ((echoLen > 0) && (sioWriteAll(fd, echo, echoLen) < 0)) {
+        LogMsg(LOG_INFO, "[SIO] %s(): error on echo write()\n", __FUNCTION__);
+    }
+
+    return cnt;
+}
+
+/**
+ * Drains everything the serial device has ready into the port's receive 
+ * ring with a single readv().  Complete lines are then taken out of the 
+ * ring with sioTtyNextLine(). 
+ * 
+ * @param port the port; all complete lines in its ring must have been 
+ *             consumed with sioTtyNextLine() since the previous call
+ * 
+ * @return int the number of bytes read, or -1 if the read failed and the 
+ *         device should be reopened
+ */
+int sioTtyRead(struct SioPort *port)
+{
+    const int fd = port->serialEv.fd;
+    struct SioTtyRing *ring = &port->ring;
+    const unsigned int start = ring->head & (SIO_TTY_RING_SIZE - 1);
+    const unsigned int room = sioTtyRingFree(ring);
+    struct iovec iov[2];
+    ssize_t cnt;
+
+    if (port->localEcho) {
+        cnt = sioTtyReadEcho(fd, ring, room);
+    } else {
+        iov[0].iov_base = ring->data + start;
+        iov[0].iov_len = room;
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = 0;
+        if (start + room > SIO_TTY_RING_SIZE) {
+            iov[0].iov_len = SIO_TTY_RING_SIZE - start;
+            iov[1].iov_len = room - iov[0].iov_len;
+        }
+
+        cnt = readv(fd, iov, (iov[1].iov_len > 0) ? 2 : 1);
+        if (cnt > 0) {
+            ring->head += cnt;
+        }
+    }
+
+    if ((cnt < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+        /* non-blocking descriptor with nothing (more) to read */
+        return 0;
+    } else if (cnt <= 0) {
+        LogMsg(LOG_INFO, "[SIO] sio_tty_reader(): error on read()\n");
+        return -1;
+    }
+
+    return cnt;
+}
+
+/* queues the next io_uring read of a port into its receive ring */
+static int sioTtyReadNext(struct SioPort *port)
+{
+    char *start;
+    const unsigned int room = sioTtyRingRoom(&port->ring, &start);
+
+    return sioUringRead(&port->readOp, port->serialEv.fd, start, room,
+        sioUringFixed(port->index, port->ring.data, sizeof(port->ring.data)));
+}
+
+static void sioTtyOnRead(struct SioUringOp *op, int res, unsigned int flags)
+{
+    struct SioPort *port = (struct SioPort *)((char *)op -
+        offsetof(struct SioPort, readOp));
+
+    if (port->readStale) {
+        /* the cancelled read of a closed descriptor */
+        port->readStale = 0;
+    } else if (res > 0) {
+        port->ring.head += res;
+        port->readDone(&port->serialEv, EPOLLIN);
+    } else if ((res != -EAGAIN) && (res != -EINTR)) {
+        LogMsg(LOG_INFO, "[SIO] sio_tty_reader(): error on read(), %d\n",
+            -res);
+        port->readDone(&port->serialEv, EPOLLERR);
+        return;
+    }
+
+    /* the handler may have closed the device */
+    if ((port->readDone != 0) && !op->pending &&
+        (sioTtyReadNext(port) < 0)) {
+        port->readDone(&port->serialEv, EPOLLERR);
+    }
+}
+
+/**
+ * Reads the serial device of a line-mode port through io_uring instead of
+ * epoll: each read goes straight into the receive ring, which is
+ * registered with the kernel once, and done runs when it completes just
+ * as sioTtyRead() would have been called on EPOLLIN.  done gets EPOLLERR
+ * instead when the device should be reopened.  Reading stops with
+ * sioTtyClose().
+ *
+ * @return int 0 on success, -1 if io_uring isn't in use; the device is
+ *         then left to epoll and sioTtyRead()
+ */
+int sioTtyReadAsync(struct SioPort *port, SioEventHandler done)
+{
+    port->readOp.handler = sioTtyOnRead;
+    if (sioUringBusy(&port->readOp)) {
+        /* the stale read's completion queues the first one */
+        port->readDone = done;
+        return 0;
+    }
+    if (sioTtyReadNext(port) < 0) {
+        return -1;
+    }
+    port->readDone = done;
+    return 0;
+}
+
+/**
+ * Takes the next complete line out of the receive ring.  CR and LF both end 
+ * a line, empty lines are dropped and the line is handed back terminated by 
+ * a single LF and a NUL. 
+ * 
+ * @param ring the receive ring filled by sioTtyRead()
+ * @param msgBuff where the line is copied
+ * @param bufSize the number of bytes in msgBuff; longer lines are flushed
+ * 
+ * @return int the length of the line including the LF (but not the NUL), or 
+ *         0 if no complete line is waiting
+ */
+int sioTtyNextLine(struct SioTtyRing *ring, char *msgBuff, size_t bufSize)
+{
+    const unsigned int mask = SIO_TTY_RING_SIZE - 1;
+
+    while (ring->scan != ring->head) {
+        /* search the contiguous run starting at scan */
+        const unsigned int off = ring->scan & mask;
+        unsigned int run = ring->head - ring->scan;
+        size_t hit;
+
+        if (off + run > SIO_TTY_RING_SIZE) {
+            run = SIO_TTY_RING_SIZE - off;
+        }
+
+        hit = sioFindEol(ring->data + off, run);
+        ring->scan += hit;
+        if (hit < run) {
+            const unsigned int first = ring->tail;
+            const unsigned int len = ring->scan - first;
+
+            ring->tail = ++ring->scan;
+            if (len == 0) {
+                /* nothing here */
+                continue;
+            } else if (len + 2 > bufSize) {
+                LogMsg(LOG_INFO, "[SIO] dropped %d byte line\n", len);
+                continue;
+            }
+
+            sioTtyRingCopy(ring, first, len, msgBuff);
+            msgBuff[len] = '\n';
+            msgBuff[len + 1] = '\0';
+
+            LogMsg(LOG_INFO, "[SIO] received => \"%s\"\n", msgBuff);
+
+            return len + 1;
+        }
+    }
+
+    if (ring->head - ring->tail + 2 > bufSize) {
+        /* buffer full with no CR can't be good; flush it */
+        ring->tail = ring->scan = ring->head;
+        ring->lineLen = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets the memory cap and overflow policy of the serial output queue, 
+ * creating the queue on first use. 
+ * 
+ * @return int 0 on success, -1 if the queue could not be allocated
+ */
+int sioTtySetQueueParams(struct SioPort *port, size_t maxBytes, int policy)
+{
+    if (port->ttyOut.ring == 0) {
+        if (sioQueueInit(&port->ttyOut, maxBytes, policy) < 0) {
             return -1;
         }
+        port->ttyOut.latency = &sioLatencyToSerial;
+        return 0;
     }
+    port->ttyOut.maxBytes = maxBytes;
+    port->ttyOut.policy = policy;
+    return 0;
 }
 
+/**
+ * Queues a message for the serial port; sioTtyFlush() writes it out. 
+ * 
+ * @param port the port
+ * @param msgBuff the bytes to send
+ * @param buffSize the number of bytes in msgBuff
+ * 
+ * @return int 0 if the message was queued or dropped by policy, -1 if the 
+ *         queue is full and its policy asks to disconnect the sender
+ */
+int sioTtyWrite(struct SioPort *port, const char *msgBuff, int buffSize)
+{
+    struct SioBuf *buf;
+    int rv;
+
+    LogMsg(LOG_INFO, "[SIO] sending => \"%.*s\"\n", buffSize, msgBuff);
+
+    buf = sioBufAlloc(msgBuff, buffSize);
+    if (buf == 0) {
+        LogMsg(LOG_ERR, "[SIO] %s(): out of memory\n", __FUNCTION__);
+        return 0;
+    }
+    rv = sioQueuePush(&port->ttyOut, buf);
+    sioBufRelease(buf);
+
+    return (rv < 0) ? -1 : 0;
+}
 
-void sioTtyWrite(int serialFd, const char *msgBuff, int buffSize)
+/**
+ * Writes as much of the serial output queue as the device accepts without 
+ * blocking, or as --pace allows (see sio_pace.c). 
+ * 
+ * @param port the port, written through its serialOutFd
+ * 
+ * @return ssize_t the number of bytes still queued, or -1 on a write error 
+ *         (the queue is kept for when the device is reopened)
+ */
+ssize_t sioTtyFlush(struct SioPort *port)
 {
-    LogMsg(LOG_INFO, "[SIO] sending => \"%s\"\n", msgBuff);
+    ssize_t left;
 
+    if (port->pacePercent > 0) {
+        left = sioPaceFlush(port);
+    } else {
+        port->paceAt = 0;
+        left = sioQueueFlush(&port->ttyOut, port->serialOutFd);
+    }
 
-    if (write(serialFd, msgBuff, buffSize) < 0) {
+    if (left < 0) {
         LogMsg(LOG_INFO, "[SIO] %s(): error on write()\n", __FUNCTION__);
+    } else if (port->flow != SIO_FLOW_NONE) {
+        /* bytes left and not held by the pace: the device is full */
+        sioFlowAccount(port, (left > 0) && (port->paceAt == 0));
     }
+    return left;
 }
-
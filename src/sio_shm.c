@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "sio_agent.h"
+
+/*
+ * Agent side of the shared-memory transport described in sio_shm.h.  A
+ * client that switched keeps its SioClient, queue and line assembler;
+ * only the bytes go through the rings instead of the socket.  The agent
+ * sleeps on one eventfd for both "lines from the client" and "room for
+ * more output".
+ */
+#define SIO_SHM_REQUEST "sio.shm"
+#define SIO_SHM_ACK "sio.shm=1\n"
+#define SIO_SHM_NAK "sio.shm=0\n"
+
+struct SioShmLink {
+    struct SioEvent ev;         /* the agent's eventfd, ctx is the client */
+    int clientFd;               /* the client's eventfd */
+    struct SioShmHeader *header;
+    size_t mapSize;
+    struct SioShmEnd tx;        /* toClient, the agent produces */
+    struct SioShmEnd rx;        /* toAgent, the agent consumes */
+};
+
+static void sioShmLinkFree(struct SioShmLink *link)
+{
+    if (link->ev.fd >= 0) {
+        close(link->ev.fd);
+    }
+    if (link->clientFd >= 0) {
+        close(link->clientFd);
+    }
+    if (link->header != 0) {
+        munmap(link->header, link->mapSize);
+    }
+    free(link);
+}
+
+/* creates the segment and eventfds, returning the memfd or -1 */
+static int sioShmCreate(struct SioShmLink *link)
+{
+    const size_t headerSize = (sizeof(struct SioShmHeader) +
+        SIO_SHM_CACHELINE - 1) & ~(size_t)(SIO_SHM_CACHELINE - 1);
+    void *map;
+    int fd;
+
+    link->mapSize = headerSize + 2 * SIO_SHM_RING_SIZE;
+    link->ev.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    link->clientFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fd = memfd_create("sio-shm", MFD_CLOEXEC);
+    if ((link->ev.fd < 0) || (link->clientFd < 0) || (fd < 0) ||
+        (ftruncate(fd, link->mapSize) < 0)) {
+        goto fail;
+    }
+    map = mmap(0, link->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+
+    link->header = map;
+    link->header->magic = SIO_SHM_MAGIC;
+    link->header->headerSize = headerSize;
+    link->header->ringSize = SIO_SHM_RING_SIZE;
+    sioShmEndInit(&link->tx, link->header, 0, link->clientFd);
+    sioShmEndInit(&link->rx, link->header, 1, link->clientFd);
+    return fd;
+
+fail:
+    LogMsg(LOG_ERR, "[SIO] can't set up shared memory, errno = %d\n", errno);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+/* sends the answer with the descriptors the client needs attached */
+static int sioShmSendFds(int sock, int memFd, int clientFd, int agentFd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buff[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    const int fds[3] = { memFd, clientFd, agentFd };
+    struct iovec iov = { SIO_SHM_ACK, sizeof(SIO_SHM_ACK) - 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buff;
+    msg.msg_controllen = sizeof(control.buff);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return (sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len) ?
+        0 : -1;
+}
+
+/**
+ * Switches a client to shared memory if line asks for it.  Only clients of
+ * a Unix socket can take the descriptors, and only while nothing is queued
+ * for them, so no line ends up on the socket after the answer; others are
+ * told "sio.shm=0" and stay on the socket.
+ *
+ * @param client the client the line came from
+ * @param line the line, without its terminator
+ * @param len the number of bytes in line
+ * @param onWake the handler for the agent's eventfd
+ *
+ * @return int 1 if line was the request and has been answered, 0 if it is
+ *         for someone else
+ */
+int sioShmNegotiate(struct SioClient *client, const char *line, size_t len,
+    SioEventHandler onWake)
+{
+    struct SioShmLink *link;
+    int memFd;
+
+    if ((len != sizeof(SIO_SHM_REQUEST) - 1) ||
+        (memcmp(line, SIO_SHM_REQUEST, len) != 0)) {
+        return 0;
+    }
+
+    if ((client->out.bytes > 0) && (client->shm == 0)) {
+        sioClientFlush(client);
+    }
+    if ((client->port->addressFamily != AF_UNIX) || (client->shm != 0) ||
+        (client->ev.fd < 0) || (client->out.bytes > 0) ||
+        ((link = calloc(1, sizeof(*link))) == 0)) {
+        if (client->ev.fd >= 0) {
+            sioClientSend(client, SIO_SHM_NAK, sizeof(SIO_SHM_NAK) - 1);
+        }
+        return 1;
+    }
+
+    memFd = sioShmCreate(link);
+    if ((memFd < 0) ||
+        (sioShmSendFds(client->ev.fd, memFd, link->clientFd, link->ev.fd) < 0)) {
+        if (memFd >= 0) {
+            close(memFd);
+        }
+        sioShmLinkFree(link);
+        sioClientSend(client, SIO_SHM_NAK, sizeof(SIO_SHM_NAK) - 1);
+        return 1;
+    }
+    close(memFd);       /* the mapping and the client's copy keep it */
+
+    link->ev.handler = onWake;
+    link->ev.ctx = client;
+    sioShmWaitData(&link->rx);
+    if (sioEventAdd(&link->ev, EPOLLIN) < 0) {
+        sioShmLinkFree(link);
+        sioClientClose(client);
+        return 1;
+    }
+    client->shm = link;
+    LogMsg(LOG_INFO, "[SIO] client %d switched to shared memory\n",
+        client->ev.fd);
+    return 1;
+}
+
+/**
+ * Takes what the client put in its ring into its line assembler, as
+ * sioTioSocketRead() does for the socket.  When the ring is empty the
+ * client is asked to wake the agent for the next bytes.
+ *
+ * @return int the number of bytes appended, 0 if there were none
+ */
+int sioShmReceive(struct SioClient *client)
+{
+    struct SioShmLink *link = client->shm;
+    struct SioLineBuf *in = &client->in;
+    size_t n;
+
+    do {
+        n = sioShmGet(&link->rx, in->data + in->len, in->size - in->len);
+    } while ((n == 0) && (in->len < in->size) && !sioShmWaitData(&link->rx));
+
+    if (n > 0) {
+        LogMsg(LOG_INFO, "[SIO] received => \"%.*s\"\n", (int)n,
+            in->data + in->len);
+        in->len += n;
+    }
+    return n;
+}
+
+static ssize_t sioShmWriter(void *ctx, const struct iovec *iov, int count)
+{
+    struct SioShmLink *link = ctx;
+    ssize_t total = 0;
+    int i;
+
+    for (i = 0 ; i < count ; i++) {
+        const size_t n = sioShmPut(&link->tx, iov[i].iov_base, iov[i].iov_len);
+
+        total += n;
+        if (n < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+/**
+ * Moves a client's queued output into its ring.  What doesn't fit stays
+ * queued and the client is asked to wake the agent when it makes room.
+ *
+ * @return int always 0; a client that went away is noticed on its socket
+ */
+int sioShmFlush(struct SioClient *client)
+{
+    struct SioShmLink *link = client->shm;
+
+    while ((sioQueueFlushTo(&client->out, sioShmWriter, link) > 0) &&
+        !sioShmWaitSpace(&link->tx)) {
+        /* room appeared while asking for it */
+    }
+    return 0;
+}
+
+/* releases the shared memory of a closing client */
+void sioShmDetach(struct SioClient *client)
+{
+    if (client->shm != 0) {
+        sioEventDel(&client->shm->ev);
+        sioShmLinkFree(client->shm);
+        client->shm = 0;
+    }
+}
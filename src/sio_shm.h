@@ -0,0 +1,85 @@
+#ifndef SIO_SHM_H
+#define SIO_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Shared-memory transport for clients on the same board.  A client of a
+ * Unix socket port sends "sio.shm"; the agent answers "sio.shm=1" and
+ * passes a memfd and two eventfds along with it.  The memfd holds a
+ * SioShmHeader and two single-producer single-consumer byte rings, one for
+ * each direction, carrying the same newline-terminated lines as the socket
+ * did.  The socket stays open: closing it is how either side notices the
+ * other has gone.
+ *
+ * A side only writes the other's eventfd when the other has said, through
+ * the ring's dataWanted or spaceWanted flag, that it is about to sleep, so
+ * a busy consumer is never woken.  Everything in this file is usable from
+ * a client without the rest of the agent: see sio_shm_ring.c.
+ */
+#define SIO_SHM_MAGIC 0x314d4853u         /* "SHM1" */
+#define SIO_SHM_RING_SIZE (64 * 1024)     /* per direction, a power of two */
+#define SIO_SHM_CACHELINE 64
+
+/*
+ * One direction.  head and tail count bytes and only grow; the data for
+ * offset n is at n & (size - 1).  Each side's fields are on a cache line of
+ * their own.
+ */
+struct SioShmRing {
+    /* written by the producer */
+    uint64_t head __attribute__((aligned(SIO_SHM_CACHELINE)));
+    uint32_t spaceWanted;       /* producer sleeps until tail moves */
+
+    /* written by the consumer */
+    uint64_t tail __attribute__((aligned(SIO_SHM_CACHELINE)));
+    uint32_t dataWanted;        /* consumer sleeps until head moves */
+};
+
+struct SioShmHeader {
+    uint32_t magic;
+    uint32_t headerSize;        /* the toClient data follows the header */
+    uint32_t ringSize;          /* bytes of data in each ring */
+    uint32_t reserved;
+    struct SioShmRing toClient;
+    struct SioShmRing toAgent;  /* data follows the toClient data */
+};
+
+/* one end of a ring, as seen by the side that owns it */
+struct SioShmEnd {
+    struct SioShmRing *ring;
+    char *data;
+    uint32_t size;
+    int peerFd;                 /* the other side's eventfd */
+};
+
+/* a client's view of its connection */
+struct SioShmClient {
+    int sock;                   /* the Unix socket, kept open */
+    int wakeFd;                 /* eventfd the agent writes to wake us */
+    struct SioShmHeader *header;
+    size_t mapSize;
+    struct SioShmEnd rx;        /* toClient, we consume */
+    struct SioShmEnd tx;        /* toAgent, we produce */
+};
+
+/* ring primitives, defined in sio_shm_ring.c and shared with the agent */
+void sioShmEndInit(struct SioShmEnd *end, struct SioShmHeader *header,
+    int toAgent, int peerFd);
+size_t sioShmPut(struct SioShmEnd *end, const void *buf, size_t len);
+size_t sioShmGet(struct SioShmEnd *end, void *buf, size_t size);
+int sioShmWaitData(struct SioShmEnd *end);
+int sioShmWaitSpace(struct SioShmEnd *end);
+void sioShmWake(int fd);
+
+/* client library, defined in sio_shm_ring.c */
+int sioShmConnect(struct SioShmClient *client, const char *socketPath);
+ssize_t sioShmRead(struct SioShmClient *client, void *buf, size_t size,
+    int timeoutMs);
+int sioShmWrite(struct SioShmClient *client, const void *buf, size_t len,
+    int timeoutMs);
+void sioShmDisconnect(struct SioShmClient *client);
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ * Shared-memory rings and the client library for them.  This file only
+ * needs sio_shm.h, so a client can build it into its own program.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sio_shm.h"
+
+#define SIO_SHM_REQUEST "sio.shm\n"
+
+void sioShmEndInit(struct SioShmEnd *end, struct SioShmHeader *header,
+    int toAgent, int peerFd)
+{
+    end->ring = toAgent ? &header->toAgent : &header->toClient;
+    end->data = (char *)header + header->headerSize +
+        (toAgent ? header->ringSize : 0);
+    end->size = header->ringSize;
+    end->peerFd = peerFd;
+}
+
+/* wakes the side waiting on eventfd fd */
+void sioShmWake(int fd)
+{
+    const uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0) {
+        /* the counter is saturated, so a wakeup is pending anyway */
+    }
+}
+
+/**
+ * Copies as much of buf into the ring as fits and wakes the consumer if
+ * it is waiting for data.  Only the producing side may call this.
+ *
+ * @return size_t the number of bytes copied, 0 if the ring is full
+ */
+size_t sioShmPut(struct SioShmEnd *end, const void *buf, size_t len)
+{
+    struct SioShmRing *r = end->ring;
+    const uint64_t head = r->head;
+    const uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    const uint32_t at = head & (end->size - 1);
+    size_t n = end->size - (head - tail);
+    size_t first;
+
+    if (n > len) {
+        n = len;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    first = (n < end->size - at) ? n : end->size - at;
+    memcpy(end->data + at, buf, first);
+    memcpy(end->data, (const char *)buf + first, n - first);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in sioShmWaitData() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&r->dataWanted, 0, __ATOMIC_RELAXED)) {
+        sioShmWake(end->peerFd);
+    }
+    return n;
+}
+
+/**
+ * Copies up to size bytes out of the ring and wakes the producer if it is
+ * waiting for room.  Only the consuming side may call this.
+ *
+ * @return size_t the number of bytes copied, 0 if the ring is empty
+ */
+size_t sioShmGet(struct SioShmEnd *end, void *buf, size_t size)
+{
+    struct SioShmRing *r = end->ring;
+    const uint64_t tail = r->tail;
+    const uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    const uint32_t at = tail & (end->size - 1);
+    size_t n = head - tail;
+    size_t first;
+
+    if (n > size) {
+        n = size;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    first = (n < end->size - at) ? n : end->size - at;
+    memcpy(buf, end->data + at, first);
+    memcpy((char *)buf + first, end->data, n - first);
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in sioShmWaitSpace() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&r->spaceWanted, 0, __ATOMIC_RELAXED)) {
+        sioShmWake(end->peerFd);
+    }
+    return n;
+}
+
+/**
+ * Asks the producer for a wakeup when data arrives.  The ring is checked
+ * again afterwards, so data put in just before isn't slept through.
+ *
+ * @return int 1 if the caller should wait on its eventfd, 0 if there is
+ *         data to read already
+ */
+int sioShmWaitData(struct SioShmEnd *end)
+{
+    struct SioShmRing *r = end->ring;
+
+    __atomic_store_n(&r->dataWanted, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+        __atomic_store_n(&r->dataWanted, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Asks the consumer for a wakeup when it makes room, as sioShmWaitData().
+ *
+ * @return int 1 if the caller should wait on its eventfd, 0 if there is
+ *         room already
+ */
+int sioShmWaitSpace(struct SioShmEnd *end)
+{
+    struct SioShmRing *r = end->ring;
+
+    __atomic_store_n(&r->spaceWanted, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < end->size) {
+        __atomic_store_n(&r->spaceWanted, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Waits for the agent's wakeup.  Returns 1 when woken, 0 on timeout and -1
+ * if the agent closed the socket.
+ */
+static int sioShmSleep(struct SioShmClient *client, int timeoutMs)
+{
+    struct pollfd fds[2];
+    uint64_t count;
+    char c;
+
+    fds[0].fd = client->wakeFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = client->sock;
+    fds[1].events = POLLIN;
+
+    if (poll(fds, 2, timeoutMs) < 0) {
+        return (errno == EINTR) ? 1 : -1;
+    }
+    if ((fds[1].revents != 0) && (recv(client->sock, &c, 1, 0) <= 0)) {
+        return -1;
+    }
+    if (fds[0].revents == 0) {
+        return 0;
+    }
+    if (read(client->wakeFd, &count, sizeof(count)) < 0) {
+        /* nothing pending after all */
+    }
+    return 1;
+}
+
+/**
+ * Connects to an agent's Unix socket and switches the connection to
+ * shared memory.  Lines that arrive on the socket before the agent's
+ * answer are skipped.
+ *
+ * @param client filled in on success
+ * @param socketPath the port's Unix socket
+ *
+ * @return int 0 on success, -1 with errno set if the connection failed or
+ *         the agent refused (ENOTSUP)
+ */
+int sioShmConnect(struct SioShmClient *client, const char *socketPath)
+{
+    union {
+        struct cmsghdr hdr;
+        char buff[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct sockaddr_un addr;
+    char line[64];
+    size_t lineLen = 0;
+    int fds[3] = { -1, -1, -1 };
+    struct stat st;
+    void *map;
+
+    memset(client, 0, sizeof(*client));
+    client->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->sock < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+    if ((connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (send(client->sock, SIO_SHM_REQUEST, sizeof(SIO_SHM_REQUEST) - 1,
+        MSG_NOSIGNAL) < 0)) {
+        goto fail;
+    }
+
+    /* one byte at a time, so nothing after the answer is consumed */
+    while (1) {
+        struct iovec iov = { line + lineLen, 1 };
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buff;
+        msg.msg_controllen = sizeof(control.buff);
+        if (recvmsg(client->sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+            goto fail;
+        }
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if ((cmsg != 0) && (cmsg->cmsg_level == SOL_SOCKET) &&
+            (cmsg->cmsg_type == SCM_RIGHTS) &&
+            (cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+
+        if (line[lineLen] != '\n') {
+            lineLen += (lineLen < sizeof(line) - 2) ? 1 : 0;
+            continue;
+        }
+        line[lineLen + 1] = '\0';
+        if (strncmp(line, "sio.shm=", 8) == 0) {
+            if (fds[0] < 0) {
+                errno = ENOTSUP;
+                goto fail;
+            }
+            break;
+        }
+        lineLen = 0;
+    }
+
+    if ((fstat(fds[0], &st) < 0) ||
+        (st.st_size < (off_t)sizeof(struct SioShmHeader))) {
+        goto fail;
+    }
+    map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    close(fds[0]);
+    client->header = map;
+    client->mapSize = st.st_size;
+    if ((client->header->magic != SIO_SHM_MAGIC) ||
+        (client->header->headerSize + 2 * (size_t)client->header->ringSize !=
+        client->mapSize)) {
+        errno = EPROTO;
+        fds[0] = -1;
+        goto fail;
+    }
+
+    client->wakeFd = fds[1];
+    sioShmEndInit(&client->rx, client->header, 0, fds[2]);
+    sioShmEndInit(&client->tx, client->header, 1, fds[2]);
+    return 0;
+
+fail:
+    {
+        const int err = errno;
+        int i;
+
+        for (i = 0 ; i < 3 ; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        if (client->header != 0) {
+            munmap(client->header, client->mapSize);
+        }
+        close(client->sock);
+        client->sock = -1;
+        errno = err;
+    }
+    return -1;
+}
+
+/**
+ * Reads what the agent has sent, waiting up to timeoutMs for something to
+ * arrive (-1 waits forever).
+ *
+ * @return ssize_t the number of bytes read, 0 on timeout, or -1 if the
+ *         agent has gone
+ */
+ssize_t sioShmRead(struct SioShmClient *client, void *buf, size_t size,
+    int timeoutMs)
+{
+    while (1) {
+        const size_t n = sioShmGet(&client->rx, buf, size);
+        int rv;
+
+        if (n > 0) {
+            return n;
+        } else if (!sioShmWaitData(&client->rx)) {
+            continue;
+        }
+        rv = sioShmSleep(client, timeoutMs);
+        if (rv <= 0) {
+            return rv;
+        }
+    }
+}
+
+/**
+ * Sends len bytes to the agent, waiting up to timeoutMs each time the ring
+ * is full.
+ *
+ * @return int 0 on success, -1 on timeout or if the agent has gone
+ */
+int sioShmWrite(struct SioShmClient *client, const void *buf, size_t len,
+    int timeoutMs)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        const size_t n = sioShmPut(&client->tx, p, len);
+
+        p += n;
+        len -= n;
+        if ((len > 0) && sioShmWaitSpace(&client->tx) &&
+            (sioShmSleep(client, timeoutMs) <= 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sioShmDisconnect(struct SioShmClient *client)
+{
+    if (client->sock < 0) {
+        return;
+    }
+    munmap(client->header, client->mapSize);
+    close(client->wakeFd);
+    close(client->rx.peerFd);
+    close(client->sock);
+    client->sock = -1;
+}
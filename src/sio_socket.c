@@ -11,7 +11,11 @@
 
 #include "sio_agent.h"
 
-#define MAXPENDING 1
+#define MAXPENDING 8
+#define SIO_PACKET_BATCH 32     /* packets taken by one recvmmsg() */
+
+/* one line per slot, compacted towards the front once received */
+static char packetBuff[SIO_PACKET_BATCH][SIO_BUFFER_SIZE + 1];
 
 static void sioDieWithError(char *errorMessage)
 {
@@ -19,12 +23,12 @@ static void sioDieWithError(char *errorMessage)
     exit(1);
 }
 
-static int sioCreateUnixServerSocket(const char *socketPath)
+static int sioCreateUnixServerSocket(const char *socketPath, int type)
 {
     int sock;
     struct sockaddr_un echoServAddr;
 
-    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    if ((sock = socket(AF_UNIX, type, 0)) < 0) {
         sioDieWithError("socket() failed");
     }
 
@@ -110,13 +114,14 @@ int sioTioSocketAccept(int serverFd, int addressFamily)
 
 
 int sioTioSocketInit(unsigned short port, int *addressFamily,
-    const char *unixSocketPath)
+    const char *unixSocketPath, int seqpacket)
 {
     int listenFd = -1;
 
     if (port == 0) {
         /* create a Unix domain socket */
-        listenFd = sioCreateUnixServerSocket(unixSocketPath);
+        listenFd = sioCreateUnixServerSocket(unixSocketPath,
+            seqpacket ? SOCK_SEQPACKET : SOCK_STREAM);
         *addressFamily = AF_UNIX;
     } else {
         listenFd = sioCreateTCPServerSocket(port);
@@ -127,47 +132,182 @@ int sioTioSocketInit(unsigned short port, int *addressFamily,
 
 
 /**
- * Reads a single message from the socket connected to the 
- * tio-agent. If no message is ready to be received, the call 
- * will block until one is available. 
+ * Reads what the tio-agent sent into the client's line assembler.  The 
+ * socket is non-blocking, so this is called when the event loop reports it 
+ * readable.  sioLineAssemble() then picks the complete lines out. 
  * 
  * @param socketFd the file descriptor of for the already open 
  *                 socket connecting to the tio-agent
- * @param msgBuff address of a contiguous array into which the 
- *                message will be written upon receipt from the
- *                tio-agent
- * @param bufferSize the number of bytes in msgBuff
+ * @param in the client's line assembler; the bytes are appended at 
+ *           in->data + in->len
  * 
- * @return int 0 if no message to return (handled here), -1 if 
- *         recv() returned an error code (close connection) or
- *         >0 to indicate msgBuff has that many characters
- *         filled in
+ * @return int 0 if nothing was read (handled here), -1 if recv() returned 
+ *         an error code (caller closes the connection) or >0 for the 
+ *         number of bytes appended
  */
-int sioTioSocketRead(int socketFd, char *msgBuff, size_t bufferSize)
+int sioTioSocketRead(int socketFd, struct SioLineBuf *in)
 {
+    char *const start = in->data + in->len;
     int cnt;
 
-    if ((cnt = recv(socketFd, msgBuff, bufferSize, 0)) <= 0) {
+    if (((cnt = recv(socketFd, start, in->size - in->len, 0)) < 0) &&
+        ((errno == EAGAIN) || (errno == EINTR))) {
+        /* spurious wakeup on a non-blocking socket */
+        return 0;
+    } else if (cnt <= 0) {
         LogMsg(LOG_INFO, "[SIO] %s(): recv() failed, client closed\n", __FUNCTION__);
-        close(socketFd);
         return -1;
     } else {
-		LogMsg(LOG_INFO, "[SIO] received => \"%s\"\n", msgBuff);
-        msgBuff[cnt] = 0;
+        LogMsg(LOG_INFO, "[SIO] received => \"%.*s\"\n", cnt, start);
+        in->len += cnt;
         return cnt;
     }
 }
 
 
-void sioTioSocketWrite(int socketFd, const char *buff)
+/**
+ * Reads a burst of packets from a SOCK_SEQPACKET client.  Every packet is
+ * one line, so nothing has to be reassembled: a packet without a CR or LF
+ * at its end gets a LF, and one longer than maxLine or SIO_BUFFER_SIZE is
+ * dropped.  An empty packet can't be told from the end of the connection
+ * and ends it the same way.
+ *
+ * @param socketFd the non-blocking client socket
+ * @param maxLine the longest line accepted, terminator excluded
+ * @param lines set to the lines read, terminated and back to back; they
+ *              stay valid until the next call
+ * @param closed set to 1 if the client closed after the lines read
+ *
+ * @return int the number of bytes at *lines, 0 if there were none, or -1
+ *         if recvmmsg() failed (caller closes the connection)
+ */
+int sioTioSocketReadPackets(int socketFd, unsigned int maxLine, char **lines,
+    int *closed)
 {
-    int cnt = strlen(buff);
-	
-	LogMsg(LOG_INFO, "[SIO] sending => \"%s\"\n", buff);
+    struct mmsghdr msgs[SIO_PACKET_BATCH];
+    struct iovec iov[SIO_PACKET_BATCH];
+    char *out = packetBuff[0];
+    int count;
+    int i;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0 ; i < SIO_PACKET_BATCH ; i++) {
+        iov[i].iov_base = packetBuff[i];
+        iov[i].iov_len = SIO_BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    *lines = out;
+    *closed = 0;
+    count = recvmmsg(socketFd, msgs, SIO_PACKET_BATCH, MSG_DONTWAIT, 0);
+    if ((count < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+        /* spurious wakeup on a non-blocking socket */
+        return 0;
+    } else if (count <= 0) {
+        LogMsg(LOG_INFO, "[SIO] %s(): recvmmsg() failed, client closed\n",
+            __FUNCTION__);
+        return -1;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        const char *p = packetBuff[i];
+        unsigned int len = msgs[i].msg_len;
+
+        if (len == 0) {
+            LogMsg(LOG_INFO, "[SIO] %s(): client closed\n", __FUNCTION__);
+            *closed = 1;
+            break;
+        }
+        if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+            (len - ((p[len - 1] == '\n') || (p[len - 1] == '\r')) > maxLine)) {
+            LogMsg(LOG_NOTICE, "[SIO] dropped client packet over %d bytes\n",
+                (int)maxLine);
+            continue;
+        }
 
-    if (send(socketFd, buff, cnt, 0) != cnt) {
+        /* out never passes the start of slot i, so this moves left */
+        memmove(out, p, len);
+        if ((out[len - 1] != '\n') && (out[len - 1] != '\r')) {
+            out[len++] = '\n';
+        }
+        out += len;
+    }
+
+    if (out > *lines) {
+        LogMsg(LOG_INFO, "[SIO] received => \"%.*s\"\n",
+            (int)(out - *lines), *lines);
+    }
+    return out - *lines;
+}
+
+
+/**
+ * Sends as much of a client's output queue as the socket accepts, without 
+ * blocking. 
+ * 
+ * @param socketFd the non-blocking client socket
+ * @param out the client's output queue
+ * 
+ * @return ssize_t the number of bytes still queued, or -1 if the connection 
+ *         failed
+ */
+ssize_t sioTioSocketWrite(int socketFd, struct SioQueue *out)
+{
+    const ssize_t left = sioQueueFlush(out, socketFd);
+
+    if (left < 0) {
         LogMsg(LOG_ERR, "[SIO] socket_send_to_client(): send() failed, %d\n",
             socketFd);
-        perror("what's messed up?");
     }
+    return left;
+}
+
+
+/* sends each queued message as a packet of its own, see sioQueueFlushTo() */
+static ssize_t sioPacketWriter(void *ctx, const struct iovec *iov, int count)
+{
+    struct mmsghdr msgs[SIO_PACKET_BATCH];
+    ssize_t total = 0;
+    int sent;
+    int i;
+
+    if (count > SIO_PACKET_BATCH) {
+        count = SIO_PACKET_BATCH;   /* the queue comes back for the rest */
+    }
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (i = 0 ; i < count ; i++) {
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)&iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    sent = sendmmsg(*(int *)ctx, msgs, count, MSG_NOSIGNAL);
+    if (sent < 0) {
+        return -1;
+    }
+    for (i = 0 ; i < sent ; i++) {
+        total += msgs[i].msg_len;
+    }
+    return total;
+}
+
+
+/**
+ * Sends a SOCK_SEQPACKET client's output queue as sioTioSocketWrite()
+ * does, one packet per queued line (or frame) and as many packets per
+ * sendmmsg() as are queued.  A packet is taken whole or not at all, so
+ * nothing is ever left half sent.
+ *
+ * @return ssize_t the number of bytes still queued, or -1 if the connection
+ *         failed
+ */
+ssize_t sioTioSocketWritePackets(int socketFd, struct SioQueue *out)
+{
+    const ssize_t left = sioQueueFlushTo(out, sioPacketWriter, &socketFd);
+
+    if (left < 0) {
+        LogMsg(LOG_ERR, "[SIO] %s(): sendmmsg() failed, %d\n", __FUNCTION__,
+            socketFd);
+    }
+    return left;
 }
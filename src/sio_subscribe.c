@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sio_agent.h"
+
+/*
+ * Subscriptions.  A client that sends "sio.sub=<pattern>" stops getting
+ * every device line and gets only those that contain one of its patterns,
+ * or start with it when the pattern is written "^<prefix>".  "sio.unsub"
+ * drops them all and goes back to every line.  Either is answered with
+ * "sio.sub=<n>", the number of patterns now held, or "sio.sub=-1" if the
+ * pattern was refused.  Framed clients share one frame per read, which
+ * can't be filtered per client, so their patterns are refused and a client
+ * that switches to framed output loses the ones it had.
+ *
+ * Replies to a client's own requests are always sent.  With --pipeline
+ * sio_pipeline.c routes them.  Without it the agent can't tell a reply from
+ * any other line, so every device line goes to the clients that asked last,
+ * including those whose request the cache merged, until the device has
+ * spoken and another request is sent.
+ *
+ * The patterns of all clients of a port are compiled into one Aho-Corasick
+ * automaton, turned into a DFA over the bytes the patterns use, so a line
+ * is scanned once whatever the number of patterns.  Each state carries the
+ * clients whose patterns end there as a bit mask.
+ */
+#define SIO_SUB_CMD "sio.sub="
+#define SIO_SUB_CLEAR "sio.unsub"
+
+struct SioSubMatcher {
+    unsigned char classOf[256]; /* byte to column, 0 for bytes in no pattern */
+    unsigned int classes;
+    unsigned int shift;         /* a row is 1 << shift entries, >= classes */
+    unsigned int nodes;
+    uint32_t all;               /* bits of every subscribed client */
+    uint32_t anySubstring;      /* clients with a pattern that isn't a prefix */
+    uint16_t *next;             /* the DFA, a row of edges per node */
+    uint16_t *depth;            /* bytes from the root */
+    uint32_t *hit;              /* clients with a pattern ending here */
+    uint32_t *prefixHit;        /* clients with a prefix ending here */
+};
+
+static void sioSubMatcherFree(struct SioSubMatcher *m)
+{
+    if (m != 0) {
+        free(m->next);
+        free(m->depth);
+        free(m->hit);
+        free(m->prefixHit);
+        free(m);
+    }
+}
+
+/* adds one pattern to the trie, returning the node it ends at */
+static unsigned int sioSubInsert(struct SioSubMatcher *m, const char *p)
+{
+    unsigned int node = 0;
+
+    for ( ; *p != '\0' ; p++) {
+        uint16_t *edge = &m->next[(node << m->shift) |
+            m->classOf[(unsigned char)*p]];
+
+        if (*edge == 0) {
+            m->depth[m->nodes] = m->depth[node] + 1;
+            *edge = m->nodes++;
+        }
+        node = *edge;
+    }
+    return node;
+}
+
+/* turns the trie into the DFA: failure links, then the missing edges */
+static void sioSubLink(struct SioSubMatcher *m)
+{
+    uint16_t *fail = calloc(m->nodes, sizeof(*fail));
+    uint16_t *queue = malloc(m->nodes * sizeof(*queue));
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    unsigned int c;
+
+    if ((fail == 0) || (queue == 0)) {
+        free(fail);
+        free(queue);
+        return;
+    }
+
+    for (c = 0 ; c < m->classes ; c++) {
+        if (m->next[c] != 0) {
+            queue[tail++] = m->next[c];
+        }
+    }
+    while (head < tail) {
+        const unsigned int u = queue[head++];
+
+        /* fail[u] is shallower, so its hits are complete already */
+        m->hit[u] |= m->hit[fail[u]];
+        for (c = 0 ; c < m->classes ; c++) {
+            uint16_t *edge = &m->next[(u << m->shift) | c];
+            const uint16_t viaFail = m->next[(fail[u] << m->shift) | c];
+
+            if (*edge != 0) {
+                fail[*edge] = viaFail;
+                queue[tail++] = *edge;
+            } else {
+                *edge = viaFail;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+}
+
+/* compiles the patterns of every client of a port, 0 if there are none */
+static struct SioSubMatcher *sioSubCompile(struct SioPort *port)
+{
+    struct SioSubMatcher *m;
+    struct SioClient *client;
+    size_t bytes = 1;
+    int i;
+
+    m = calloc(1, sizeof(*m));
+    if (m == 0) {
+        return 0;
+    }
+
+    m->classes = 1;
+    for (client = port->clients ; client != 0 ; client = client->next) {
+        for (i = 0 ; i < client->subCount ; i++) {
+            const unsigned char *p = (const unsigned char *)client->sub[i];
+
+            for (p += (*p == '^') ; *p != '\0' ; p++) {
+                if (m->classOf[*p] == 0) {
+                    m->classOf[*p] = m->classes++;
+                }
+                bytes++;
+            }
+        }
+        m->all |= client->subBit;
+    }
+    if (m->all == 0) {
+        free(m);
+        return 0;
+    }
+
+    while ((1u << m->shift) < m->classes) {
+        m->shift++;
+    }
+    m->next = calloc(bytes << m->shift, sizeof(*m->next));
+    m->depth = calloc(bytes, sizeof(*m->depth));
+    m->hit = calloc(bytes, sizeof(*m->hit));
+    m->prefixHit = calloc(bytes, sizeof(*m->prefixHit));
+    if ((m->next == 0) || (m->depth == 0) || (m->hit == 0) ||
+        (m->prefixHit == 0)) {
+        sioSubMatcherFree(m);
+        return 0;
+    }
+
+    m->nodes = 1;
+    for (client = port->clients ; client != 0 ; client = client->next) {
+        for (i = 0 ; i < client->subCount ; i++) {
+            const char *p = client->sub[i];
+
+            if (*p == '^') {
+                m->prefixHit[sioSubInsert(m, p + 1)] |= client->subBit;
+            } else {
+                m->hit[sioSubInsert(m, p)] |= client->subBit;
+                m->anySubstring |= client->subBit;
+            }
+        }
+    }
+    sioSubLink(m);
+    return m;
+}
+
+/* puts a port's current subscriptions into effect */
+static void sioSubRebuild(struct SioPort *port)
+{
+    sioSubMatcherFree(port->sub);
+    port->sub = sioSubCompile(port);
+    if ((port->sub == 0) && (port->subBits != 0)) {
+        LogMsg(LOG_ERR, "[SIO] out of memory, subscribers get nothing\n");
+    } else if (port->sub != 0) {
+        LogMsg(LOG_INFO, "[SIO] port %d: subscriptions use %u states, "
+            "%u byte classes\n", port->index, port->sub->nodes,
+            port->sub->classes);
+    }
+}
+
+/* forgets a client's patterns; the caller rebuilds the port's matcher */
+static void sioSubClear(struct SioClient *client)
+{
+    while (client->subCount > 0) {
+        free(client->sub[--client->subCount]);
+    }
+    client->port->subBits &= ~client->subBit;
+    client->port->subAsking &= ~client->subBit;
+    client->subBit = 0;
+}
+
+/* takes a new pattern for a client, returning -1 if it is refused */
+static int sioSubAdd(struct SioClient *client, const char *pattern,
+    size_t len)
+{
+    struct SioPort *port = client->port;
+    char *copy;
+    int i;
+
+    for (i = 0 ; i < client->subCount ; i++) {
+        if ((strlen(client->sub[i]) == len) &&
+            (memcmp(client->sub[i], pattern, len) == 0)) {
+            return 0;   /* already held */
+        }
+    }
+    if ((client->subCount >= SIO_SUB_MAX) || (len > SIO_SUB_PATTERN_MAX) ||
+        (memchr(pattern, '\0', len) != 0)) {
+        return -1;
+    }
+
+    copy = malloc(len + 1);
+    if (copy == 0) {
+        return -1;
+    }
+    memcpy(copy, pattern, len);
+    copy[len] = '\0';
+    client->sub[client->subCount++] = copy;
+
+    if (client->subBit == 0) {
+        const uint32_t unused = ~port->subBits;
+
+        /* the lowest unused bit; there is one, a port has at most 32 clients */
+        client->subBit = unused & -unused;
+        port->subBits |= client->subBit;
+    }
+    return 0;
+}
+
+/**
+ * Handles a client's "sio.sub=<pattern>" or "sio.unsub" and recompiles
+ * the port's matcher.
+ *
+ * @param client the client the line came from
+ * @param line the line, without its terminator
+ * @param len the number of bytes in line
+ *
+ * @return int 1 if line was a subscription command and has been answered,
+ *         0 if it is for someone else
+ */
+int sioSubRequest(struct SioClient *client, const char *line, size_t len)
+{
+    const size_t cmdLen = sizeof(SIO_SUB_CMD) - 1;
+    char reply[32];
+    int replyLen;
+    int rv = 0;
+
+    if ((len == sizeof(SIO_SUB_CLEAR) - 1) &&
+        (memcmp(line, SIO_SUB_CLEAR, len) == 0)) {
+        sioSubClear(client);
+    } else if ((len >= cmdLen) && (memcmp(line, SIO_SUB_CMD, cmdLen) == 0)) {
+        rv = client->framed ? -1 :
+            sioSubAdd(client, line + cmdLen, len - cmdLen);
+    } else {
+        return 0;
+    }
+
+    sioSubRebuild(client->port);
+    replyLen = snprintf(reply, sizeof(reply), "sio.sub=%d\n",
+        (rv < 0) ? -1 : client->subCount);
+    sioClientSend(client, reply, replyLen);
+    return 1;
+}
+
+/* drops the subscriptions of a closing client */
+void sioSubDetach(struct SioClient *client)
+{
+    if (client->subCount > 0) {
+        sioSubClear(client);
+        sioSubRebuild(client->port);
+    }
+}
+
+/**
+ * Notes that a client sent the device a request, or had it merged with one
+ * on its way, while requests are not correlated.  The device lines that
+ * follow go to the client whatever its patterns.
+ */
+void sioSubAsked(struct SioClient *client)
+{
+    struct SioPort *port = client->port;
+
+    if (port->subAnswered) {
+        /* a new exchange; the clients that asked before have had theirs */
+        port->subAsking = 0;
+        port->subAnswered = 0;
+    }
+    port->subAsking |= client->subBit;
+}
+
+/**
+ * Takes a device line as (part of) the answer to the requests noted by
+ * sioSubAsked().
+ *
+ * @return uint32_t the subBit of every client that asked, to be sent the
+ *         line whether it matches their patterns or not
+ */
+uint32_t sioSubAnswer(struct SioPort *port)
+{
+    port->subAnswered = 1;
+    return port->subAsking;
+}
+
+/**
+ * Finds the clients that subscribed to a device line.  The scan stops as
+ * soon as every subscriber matched, or when only prefixes are left and the
+ * line has left them all behind.
+ *
+ * @param port the port the line was read from
+ * @param line the line, terminator included or not
+ * @param len the number of bytes in line
+ *
+ * @return uint32_t the subBit of every client the line is for; clients
+ *         without subscriptions are not included
+ */
+uint32_t sioSubMatch(const struct SioPort *port, const char *line, size_t len)
+{
+    const struct SioSubMatcher *m = port->sub;
+    const unsigned char *p = (const unsigned char *)line;
+    unsigned int state = 0;
+    uint32_t found;
+    size_t i;
+
+    if (m == 0) {
+        return 0;
+    }
+    while ((len > 0) && ((p[len - 1] == '\n') || (p[len - 1] == '\r'))) {
+        len--;
+    }
+
+    /* prefixes match while the automaton stays on the path from the root */
+    found = m->hit[0] | m->prefixHit[0];
+    for (i = 0 ; i < len ; i++) {
+        state = m->next[(state << m->shift) | m->classOf[p[i]]];
+        found |= m->hit[state];
+        if (m->depth[state] != i + 1) {
+            break;
+        }
+        found |= m->prefixHit[state];
+    }
+
+    /* then only clients with substrings still waiting need the rest */
+    while ((++i < len) && ((m->anySubstring & ~found) != 0)) {
+        do {
+            state = m->next[(state << m->shift) | m->classOf[p[i]]];
+        } while ((m->hit[state] == 0) && (++i < len));
+        found |= m->hit[state];
+    }
+    return found;
+}
@@ -0,0 +1,601 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "sio_agent.h"
+
+/*
+ * io_uring backend, chosen with --io-uring.  This file only runs the rings;
+ * the hot paths of a line-mode port use it to work on completions instead
+ * of readiness events:
+ *
+ * serial reads  sio_serial.c reads straight into the port's receive ring,
+ *               registered as a fixed buffer, see sioTtyReadAsync()
+ * client input  sio_client.c keeps one multishot receive per client, so a
+ *               client that keeps sending costs no submissions at all;
+ *               the data lands in buffers shared by all clients
+ * client output sio_client.c keeps one sendmsg() in flight per client,
+ *               gathering its queue as writev() would
+ *
+ * Everything else (listeners, raw and SOCK_SEQPACKET ports, shared memory,
+ * stdio, serial output and timers) stays on the epoll instance of
+ * sio_event.c, which is itself watched by a one-shot IORING_OP_POLL_ADD.
+ * Submissions queued by the handlers go to the kernel in the same
+ * io_uring_enter() that waits for the next batch, so a loop iteration
+ * costs one system call however many reads and sends it started.
+ *
+ * An operation is named by the address of its SioUringOp, which must stay
+ * valid while sioUringBusy() says so.  The rings are set up with raw system
+ * calls, so there is no liburing dependency; a 6.0 kernel is needed for
+ * multishot receive.
+ */
+#ifdef IORING_RECV_MULTISHOT
+
+#define SIO_URING_ENTRIES 256
+
+/* maximum number of completions handled per wakeup */
+#define SIO_URING_BATCH 64
+
+/* receive buffers shared by all clients, a power of two */
+#define SIO_URING_BUFS 64
+#define SIO_URING_BUF_SIZE SIO_BUFFER_SIZE
+#define SIO_URING_GROUP 0
+
+static int ringFd = -1;
+static void *sqRing;
+static void *cqRing;
+static size_t sqRingSize;
+static size_t cqRingSize;
+static struct io_uring_sqe *sqes;
+static size_t sqesSize;
+
+static unsigned *sqHead;
+static unsigned *sqTail;
+static unsigned sqMask;
+static unsigned sqEntries;
+static unsigned *sqArray;
+static unsigned sqLocalTail;    /* entries queued, submitted or not */
+
+static unsigned *cqHead;
+static unsigned *cqTail;
+static unsigned cqMask;
+static struct io_uring_cqe *cqes;
+
+static struct io_uring_cqe batch[SIO_URING_BATCH];
+static int batchCount;
+
+static int epollFd = -1;
+static struct SioUringOp epollOp;
+static int epollReady;
+
+static int fixedSlots;          /* a sparse table of SIO_MAX_PORTS buffers */
+static int fixedState[SIO_MAX_PORTS];   /* 1 registered, -1 refused */
+
+static struct io_uring_buf_ring *bufRing;
+static char *bufData;
+static uint16_t bufTail;
+
+static int sioUringEnter(unsigned toSubmit, unsigned minComplete,
+    unsigned flags, void *arg, size_t argSize)
+{
+    return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags,
+        arg, argSize);
+}
+
+static int sioUringRegister(unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return syscall(__NR_io_uring_register, ringFd, opcode, arg, nrArgs);
+}
+
+static unsigned sioUringUnsubmitted(void)
+{
+    return sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The next free submission entry for op, 0 for one without a completion
+ * handler, submitting what is queued if the ring is full.  Returns 0 if
+ * the kernel takes nothing.
+ */
+static struct io_uring_sqe *sioUringSqe(struct SioUringOp *op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (sioUringUnsubmitted() == sqEntries) {
+        sioUringEnter(sqEntries, 0, 0, 0, 0);
+        if (sioUringUnsubmitted() == sqEntries) {
+            LogMsg(LOG_ERR, "[SIO] io_uring submission ring full\n");
+            return 0;
+        }
+    }
+
+    idx = sqLocalTail & sqMask;
+    sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)op;
+    sqArray[idx] = idx;
+    sqLocalTail++;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    if (op != 0) {
+        op->pending = 1;
+    }
+    return sqe;
+}
+
+static void sioUringOnEpoll(struct SioUringOp *op, int res,
+    unsigned int flags)
+{
+    if (res < 0) {
+        LogMsg(LOG_ERR, "[SIO] io_uring poll of epoll failed, errno = %d\n",
+            -res);
+    }
+    epollReady = 1;
+}
+
+/* puts receive buffer bid at the end of the ring the kernel takes from */
+static void sioUringPutBuffer(unsigned int bid)
+{
+    struct io_uring_buf *buf = &bufRing->bufs[bufTail & (SIO_URING_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(bufData + bid * SIO_URING_BUF_SIZE);
+    buf->len = SIO_URING_BUF_SIZE;
+    buf->bid = bid;
+    bufTail++;
+    __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+/* sets up the buffers of the client receives, -1 if they can't be had */
+static int sioUringBufInit(void)
+{
+    const size_t ringSize = SIO_URING_BUFS * sizeof(struct io_uring_buf);
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+
+    bufRing = mmap(0, ringSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufRing == MAP_FAILED) {
+        bufRing = 0;
+        return -1;
+    }
+    bufData = malloc(SIO_URING_BUFS * SIO_URING_BUF_SIZE);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)bufRing;
+    reg.ring_entries = SIO_URING_BUFS;
+    reg.bgid = SIO_URING_GROUP;
+    if ((bufData == 0) ||
+        (sioUringRegister(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)) {
+        free(bufData);
+        bufData = 0;
+        munmap(bufRing, ringSize);
+        bufRing = 0;
+        return -1;
+    }
+
+    bufTail = 0;
+    for (i = 0 ; i < SIO_URING_BUFS ; i++) {
+        sioUringPutBuffer(i);
+    }
+    return 0;
+}
+
+void sioUringClose(void)
+{
+    if (ringFd >= 0) {
+        munmap(sqes, sqesSize);
+        if (cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
+        ringFd = -1;
+    }
+    if (bufRing != 0) {
+        munmap(bufRing, SIO_URING_BUFS * sizeof(struct io_uring_buf));
+        bufRing = 0;
+    }
+    free(bufData);
+    bufData = 0;
+    memset(fixedState, 0, sizeof(fixedState));
+    memset(&epollOp, 0, sizeof(epollOp));
+    batchCount = 0;
+    epollFd = -1;
+}
+
+/**
+ * Sets up the rings, the buffer table for serial reads and the receive
+ * buffers of the clients.  Completions are only run inside the wait of
+ * sioUringWait() where the kernel can do that (6.1 and later).
+ *
+ * @param fd the epoll instance of sio_event.c, watched through the ring
+ *
+ * @return int 0 on success, -1 if io_uring can't be used
+ */
+int sioUringInit(int fd)
+{
+    struct io_uring_params p;
+    struct io_uring_rsrc_register slots;
+
+    memset(&p, 0, sizeof(p));
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+    ringFd = syscall(__NR_io_uring_setup, SIO_URING_ENTRIES, &p);
+    if ((ringFd < 0) && (errno == EINVAL) && (p.flags != 0)) {
+        memset(&p, 0, sizeof(p));
+        ringFd = syscall(__NR_io_uring_setup, SIO_URING_ENTRIES, &p);
+    }
+    if (ringFd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(ringFd);
+        ringFd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqRingSize > sqRingSize) {
+            sqRingSize = cqRingSize;
+        }
+        cqRingSize = sqRingSize;
+    }
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = sqRing;
+    if ((sqRing != MAP_FAILED) && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    }
+    sqes = mmap(0, sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if ((sqRing == MAP_FAILED) || (cqRing == MAP_FAILED) ||
+        (sqes == MAP_FAILED)) {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if ((cqRing != MAP_FAILED) && (cqRing != sqRing)) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        close(ringFd);
+        ringFd = -1;
+        return -1;
+    }
+
+    sqHead = (unsigned *)((char *)sqRing + p.sq_off.head);
+    sqTail = (unsigned *)((char *)sqRing + p.sq_off.tail);
+    sqMask = *(unsigned *)((char *)sqRing + p.sq_off.ring_mask);
+    sqEntries = p.sq_entries;
+    sqArray = (unsigned *)((char *)sqRing + p.sq_off.array);
+    sqLocalTail = *sqTail;
+
+    cqHead = (unsigned *)((char *)cqRing + p.cq_off.head);
+    cqTail = (unsigned *)((char *)cqRing + p.cq_off.tail);
+    cqMask = *(unsigned *)((char *)cqRing + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cqRing + p.cq_off.cqes);
+
+    epollFd = fd;
+    epollOp.handler = sioUringOnEpoll;
+
+    /* one buffer slot per port, filled in when the port is opened */
+    memset(&slots, 0, sizeof(slots));
+    slots.nr = SIO_MAX_PORTS;
+    slots.flags = IORING_RSRC_REGISTER_SPARSE;
+    fixedSlots = (sioUringRegister(IORING_REGISTER_BUFFERS2, &slots,
+        sizeof(slots)) == 0);
+    if (!fixedSlots) {
+        LogMsg(LOG_INFO, "[SIO] no registered buffers, errno = %d\n", errno);
+    }
+    if (sioUringBufInit() < 0) {
+        LogMsg(LOG_NOTICE, "[SIO] no io_uring receive buffers, errno = %d, "
+            "clients stay on epoll\n", errno);
+    }
+    return 0;
+}
+
+/**
+ * Submits what is queued and waits for completions, or for the epoll
+ * instance to have ready descriptors.
+ *
+ * @param timeoutMs how long to wait, -1 to wait indefinitely
+ *
+ * @return int the number of completions picked up for sioUringDispatch(),
+ *         or -1 if the wait was interrupted by a signal or failed
+ */
+int sioUringWait(int timeoutMs)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_sqe *sqe;
+    unsigned head;
+    unsigned tail;
+
+    if (!epollOp.pending && ((sqe = sioUringSqe(&epollOp)) != 0)) {
+        uint32_t events = POLLIN;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        /* the kernel reads poll32_events as two swapped 16 bit halves */
+        events = (events << 16) | (events >> 16);
+#endif
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = epollFd;
+        sqe->poll32_events = events;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    if ((sioUringEnter(sioUringUnsubmitted(), 1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &arg, sizeof(arg)) < 0) && (errno != ETIME)) {
+        if (errno != EINTR) {
+            LogMsg(LOG_ERR, "[SIO] io_uring_enter() failed, errno = %d\n",
+                errno);
+        }
+        return -1;
+    }
+
+    /* copy the batch out first, handlers queue new submissions */
+    batchCount = 0;
+    head = *cqHead;
+    tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    while ((head != tail) && (batchCount < SIO_URING_BATCH)) {
+        batch[batchCount++] = cqes[head++ & cqMask];
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    return batchCount;
+}
+
+/**
+ * Runs the completions picked up by sioUringWait().
+ *
+ * @return int 1 if the epoll instance has ready descriptors, 0 if not
+ */
+int sioUringDispatch(void)
+{
+    int i;
+
+    epollReady = 0;
+    for (i = 0 ; i < batchCount ; i++) {
+        struct SioUringOp *op = (void *)(uintptr_t)batch[i].user_data;
+
+        if (op == 0) {
+            continue;   /* a cancellation */
+        }
+        if (!(batch[i].flags & IORING_CQE_F_MORE)) {
+            op->pending = 0;
+        }
+        op->handler(op, batch[i].res, batch[i].flags);
+    }
+    batchCount = 0;
+    return epollReady;
+}
+
+/**
+ * Registers a buffer that reads can then name by index, such as the
+ * receive ring of a port.  Each index is registered once; a failure is
+ * remembered too.
+ *
+ * @param index the buffer's index, below SIO_MAX_PORTS
+ * @param data the buffer, which must stay valid until sioUringClose()
+ * @param len the number of bytes in data
+ *
+ * @return int index, or -1 if the buffer can't be registered
+ */
+int sioUringFixed(int index, void *data, size_t len)
+{
+    if ((ringFd >= 0) && (fixedState[index] == 0)) {
+        struct iovec iov = { data, len };
+        struct io_uring_rsrc_update2 update;
+
+        memset(&update, 0, sizeof(update));
+        update.offset = index;
+        update.data = (uintptr_t)&iov;
+        update.nr = 1;
+        fixedState[index] = (fixedSlots && (sioUringRegister(
+            IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1)) ?
+            1 : -1;
+    }
+    return (fixedState[index] > 0) ? index : -1;
+}
+
+/**
+ * Queues a read.  The handler of op gets the byte count, 0 at the end of
+ * the file, or -errno.
+ *
+ * @param op the operation, idle
+ * @param fd the descriptor; it is read at its current position
+ * @param buff where the bytes go
+ * @param len the number of bytes wanted
+ * @param fixed the index buff was registered under with sioUringFixed(),
+ *              or -1
+ *
+ * @return int 0 on success, -1 if io_uring isn't in use or takes nothing
+ */
+int sioUringRead(struct SioUringOp *op, int fd, void *buff, size_t len,
+    int fixed)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((ringFd < 0) || ((sqe = sioUringSqe(op)) == 0)) {
+        return -1;
+    }
+    sqe->opcode = (fixed >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buff;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = (fixed >= 0) ? fixed : 0;
+    return 0;
+}
+
+/**
+ * Queues a multishot receive on a stream socket.  Its handler runs for each
+ * chunk with the byte count and flags to pass to sioUringBuffer(); op stays
+ * pending until a completion without IORING_CQE_F_MORE, which it gets on
+ * errors, at the end of the stream and when the shared buffers ran out
+ * (-ENOBUFS).
+ *
+ * @return int 0 on success, -1 if io_uring or its receive buffers aren't
+ *         in use, or it takes nothing
+ */
+int sioUringRecv(struct SioUringOp *op, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((ringFd < 0) || (bufRing == 0) || ((sqe = sioUringSqe(op)) == 0)) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = SIO_URING_GROUP;
+    return 0;
+}
+
+/**
+ * Returns the buffer a receive completion filled, 0 if it has none.  The
+ * buffer must be handed back with sioUringRecycle() before the handler
+ * returns.
+ */
+const char *sioUringBuffer(unsigned int flags)
+{
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+        return 0;
+    }
+    return bufData + (flags >> IORING_CQE_BUFFER_SHIFT) * SIO_URING_BUF_SIZE;
+}
+
+/* hands the buffer of a receive completion back to the kernel */
+void sioUringRecycle(unsigned int flags)
+{
+    if (flags & IORING_CQE_F_BUFFER) {
+        sioUringPutBuffer(flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+}
+
+/**
+ * Queues a sendmsg() on a socket.  msg and what it points to must stay
+ * valid until the handler of op has run.
+ *
+ * @return int 0 on success, -1 if io_uring isn't in use or takes nothing
+ */
+int sioUringSend(struct SioUringOp *op, int fd, const struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((ringFd < 0) || ((sqe = sioUringSqe(op)) == 0)) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+/* asks for an operation in flight to end; it completes with -ECANCELED */
+void sioUringCancel(struct SioUringOp *op)
+{
+    struct io_uring_sqe *sqe;
+
+    if (op->pending && (ringFd >= 0) && ((sqe = sioUringSqe(0)) != 0)) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)op;
+    }
+}
+
+/**
+ * Tells whether the kernel may still complete op, so its memory must not
+ * be reused yet.
+ */
+int sioUringBusy(const struct SioUringOp *op)
+{
+    return op->pending && (ringFd >= 0);
+}
+
+#else
+
+/* built against kernel headers without multishot receive: epoll only */
+int sioUringInit(int fd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void sioUringClose(void)
+{
+}
+
+int sioUringWait(int timeoutMs)
+{
+    return -1;
+}
+
+int sioUringDispatch(void)
+{
+    return 1;
+}
+
+int sioUringFixed(int index, void *data, size_t len)
+{
+    return -1;
+}
+
+int sioUringRead(struct SioUringOp *op, int fd, void *buff, size_t len,
+    int fixed)
+{
+    return -1;
+}
+
+int sioUringRecv(struct SioUringOp *op, int fd)
+{
+    return -1;
+}
+
+const char *sioUringBuffer(unsigned int flags)
+{
+    return 0;
+}
+
+void sioUringRecycle(unsigned int flags)
+{
+}
+
+int sioUringSend(struct SioUringOp *op, int fd, const struct msghdr *msg)
+{
+    return -1;
+}
+
+void sioUringCancel(struct SioUringOp *op)
+{
+}
+
+int sioUringBusy(const struct SioUringOp *op)
+{
+    return 0;
+}
+
+#endif